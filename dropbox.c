@@ -1,859 +1,8418 @@
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <time.h>
-#include <assert.h>
-
-// settings about file system
-#define BLOCK_NUM 4226          // blocks [0..127] are researved
-                                // init num empty blocks = 4098 
-#define BLOCK_SIZE 8192
-#define MAX_FILE_NUM 128        // determines the number of dir entries and inodes
-#define INODE_BLOCK_NUM 1250    // determines the number of blocks each inode can have
-#define MAX_FILE_SIZE 10240000  // ~ 10 M
-
-// for parsing command line input
-#define WHITESPACE " \t\n"
-#define MAX_COMMAND_SIZE 255
-#define MAX_NUM_ARGUMENTS 10
-
-// macros to decode / set attribute integer
-#define ATTRIBUTE_GET_H(x) ( (x) / 2 )          // hide      = high bit
-#define ATTRIBUTE_GET_R(x) ( (x) % 2)           // read-only = low bit
-#define PLUSMINUS(x)       ( (x) ? '+' : '-' )
-
-struct Directory_Entry { // Entry ~ 2
-  uint8_t  valid;
-  char     name[255];
-  uint32_t inode;
-  time_t   time;
-};
-
-struct Inode {                      // Inode ~ 5 KB
-  uint8_t  attribute;               // 0: h-r-  1: h-r+  2: h+r-  3: h+r+
-  uint32_t blocks[INODE_BLOCK_NUM]; // max file size ~ 10 MB
-  uint32_t size;
-};
-
-uint8_t blocks[BLOCK_NUM][BLOCK_SIZE];
-
-struct Directory_Entry *dir;
-struct Inode *inodes;
-uint8_t *inodeMap; // 1 = in use, 0 = empty
-uint8_t *blockMap; // 1 = in use, 0 = empty
-
-FILE *image = NULL;
-
-void Initialize()
-{
-  dir = (struct Directory_Entry *) &blocks[0];
-  inodeMap = (uint8_t*) &blocks[7];
-  blockMap = (uint8_t*) &blocks[8];
-  // inodes take 128 * 5KB / 8192 ~ 80 blocks
-  inodes = (struct Inode *) &blocks[9]; 
-
-  for (int i = 0; i < MAX_FILE_NUM; ++i) { // init entries, inodes and inodeMap
-    // entries
-    dir[i].valid = 0;
-    dir[i].inode = -1;
-    memset(dir[i].name,0,255);
-    dir[i].time = 0;
-    // inodes
-    // inodes[i].valid = 0;
-    inodes[i].attribute = 0;
-    inodes[i].size = -1;
-    memset(&inodes[i].blocks[0], -1, INODE_BLOCK_NUM);
-    // map
-    inodeMap[i] = 0;
-  }
-
-  for (int i = 0; i < BLOCK_NUM; ++i)
-  {
-    blockMap[i] = i > 127 ? 0 : 1; // block 0-127 reserved
-  }
-}
-
-int Df()
-{
-  int space = 0;
-  for (int i = 0; i < BLOCK_NUM; ++i)
-  {
-    if (blockMap[i] == 0)
-    {
-      space += BLOCK_SIZE;
-    }
-  }
-
-  return space;
-}
-
-void PrintDf()
-{
-  int space = Df();
-  printf("%d bytes free.\n", space);
-}
-
-// search for next empty block and return the index
-int GetEmptyBlock()
-{  
-  for (int i = 128; i < BLOCK_NUM; ++i)
-  {
-    if (blockMap[i] == 0)
-    {
-      return i;
-    }
-  }
-  return -1;
-}
-
-// search for next empty inode and return the index
-int GetEmptyInode() 
-{  
-  for (int i = 0; i < MAX_FILE_NUM; ++i)
-  {
-    if (inodeMap[i] == 0)
-    {
-      return i;
-    }
-  }
-  return -1;
-}
-
-// search for next invalid entry and return the index
-int GetEmptyDirEntry() 
-{  
-  for (int i = 0; i < MAX_FILE_NUM; ++i)
-  {
-    if (dir[i].valid == 0)
-    {
-      return i;
-    }
-  }
-  return -1;
-}
-
-// search for entry index by file name
-int GetDir(const char* fname)
-{
-  for (int i = 0; i < MAX_FILE_NUM; ++i)
-  {
-    if (strcmp(fname, dir[i].name) == 0)
-    {
-      return i;
-    }
-  }
-  return -1;
-}
-
-// release all blocks under an inode id 
-void Erase(int nid)
-{
-  printf("\nErasing node #%d\n", nid);
-  inodes[nid].size = 0;
-  int i = 0;
-  while (i < INODE_BLOCK_NUM && inodes[nid].blocks[i] != -1)
-  {
-    blockMap[ inodes[nid].blocks[i] ] = 0;
-    inodes[nid].blocks[i] = -1;
-  }
-}
-
-inline int WritePermission(int nid)
-{
-  return ! ATTRIBUTE_GET_R( inodes[nid].attribute );
-}
-
-// copy file into the file system by fname
-// if exists an entry with same name, then overwrite
-// else create a new entry
-int Put(const char *fname)
-{
-  if ( strlen(fname) > 32 )
-  {
-    printf("put error: File name too long.\n");
-    return -1;
-  }
-  
-  // Open the input file read-only 
-  FILE *ifp = fopen ( fname, "r" ); 
-  if (!ifp) // cannot open file
-  {
-    printf("put error: File does not exist.\n");
-    return -1;
-  }
-  int    status;                   // Hold the status of all return values.
-  struct stat buf;                 // stat struct to hold the returns from the stat call
-  status =  stat( fname, &buf ); 
-  if (status == -1)
-  {
-    perror("put error: stat");
-    return -1;
-  }
-
-  int did = GetDir(fname); // directory entry id
-  int nid = dir[did].inode;
-  int erase = 0;
-  // if there's an existing file, keep the entry and inode but erase all it's blocks
-  if (did != -1) 
-  {
-    if ( WritePermission(nid) )
-    {
-      Erase(nid);
-      erase = 1;
-    }
-    else
-    {
-      printf("put error: No permission to write file \"%s\"\n", fname);
-      return -1;
-    }
-  }
-  // else allocate new entry and inode
-  else
-  {
-    did = GetEmptyDirEntry();
-    if (did == -1)
-    {
-      printf("put error: No more directory entry is allowed.\n");
-      return -1;
-    }
-    else
-    {
-      nid = GetEmptyInode();
-      if (nid == -1)
-      {
-        printf("put error: No more empty Inode.\n");
-        return -1;
-      }
-      dir[did].inode = nid;
-    }
-  }
-
-  // Save off the size of the input file since we'll use it in a couple of places
-  int copy_size   = buf . st_size;
-  if ( copy_size > MAX_FILE_SIZE)
-  {
-    printf("put error: File size is bigger than max size.\n");
-    return -1;
-  }
-  if ( copy_size > Df() )
-  {
-    printf("put error: Not enough disk space.\n");
-    return -1;
-  }
-
-  printf("Reading %d bytes from %s\n", (int) buf . st_size, fname );
-
-  // We want to copy and write in chunks of BLOCK_SIZE. So to do this 
-  // we are going to use fseek to move along our file stream in chunks of BLOCK_SIZE.
-  // We will copy bytes, increment our file pointer by BLOCK_SIZE and repeat.
-  int offset      = 0;               
-
-  // We are going to copy and store our file in BLOCK_SIZE chunks instead of one big 
-  // memory pool. Why? We are simulating the way the file system stores file data in
-  // blocks of space on the disk. block_index will keep us pointing to the area of
-  // the area that we will read from or write to.
-  int block_index = GetEmptyBlock();
-  if (block_index == -1)
-  {
-    // this should not happen because of size check
-    printf("No more empty blocks found!!!!!!!!!!!\n");
-    return -1;
-  }
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  int id = 0;
-  while( copy_size > 0 )
-  {
-    // Index into the input file by offset number of bytes.  Initially offset is set to
-    // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-    // then increase the offset by BLOCK_SIZE and continue the process.  This will
-    // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-    fseek( ifp, offset, SEEK_SET );
-
-    // Read BLOCK_SIZE number of bytes from the input file and store them in our
-    // data array. 
-    int bytes  = fread( blocks[block_index], BLOCK_SIZE, 1, ifp );
-
-    // If bytes == 0 and we haven't reached the end of the file then something is 
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if ( bytes == 0 && !feof( ifp ) )
-    {
-      printf("An error occured reading from the input file.\n");
-      return -1;
-    }
-    else
-    {
-      blockMap[block_index] = 1;
-      inodes[nid].blocks[id] = block_index;
-      ++id;
-    }
-    
-    // Clear the EOF file flag.
-    clearerr( ifp );
-
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-    
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset    += BLOCK_SIZE;
-
-    // Increment the index into the block array 
-    block_index ++;
-  }
-
-  if (!erase) // set up entry & inode if they are new
-  {
-    dir[did].valid = 1;
-    strcpy(dir[did].name, fname);
-    inodeMap[ nid ] = 1;
-  }
-  inodes[ nid ].size = buf.st_size;
-  time(&dir[did].time);
-
-  // debug
-  printf("Put file: %s (size=%d), entry #%d, node #%d\n", dir[did].name, inodes[nid].size, did, nid);
-
-  // We are done copying from the input file so close it out.
-  fclose( ifp );
-
-  return 0;
-}
-
-int Get(const char* fname)
-{
-  int did = GetDir(fname);
-  if (did == -1)
-  {
-    printf("get error: File not found.\f");
-    return -1;
-  }
-
-  int nid = dir[did].inode;
-
-  FILE *ofp;
-  ofp = fopen(fname, "w");
-
-  if( ofp == NULL )
-  {
-    printf("Could not open output file: %s\n", fname );
-    perror("Opening output file returned");
-    return -1;
-  }
-
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  int block_index = 0;
-  int copy_size   = inodes[nid].size;
-  int offset      = 0;
-
-  printf("Writing %d bytes to %s\n", inodes[nid].size, fname );
-
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-  // our stored data to the file fp, then we will increment the offset into the file we are writing to.
-  // On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-  // how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-  // last iteration we'd end up with gibberish at the end of our file. 
-  while( copy_size > 0 )
-  { 
-
-    int num_bytes;
-
-    // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-    // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-    // end up with garbage at the end of the file.
-    if( copy_size < BLOCK_SIZE )
-    {
-      num_bytes = copy_size;
-    }
-    else 
-    {
-      num_bytes = BLOCK_SIZE;
-    }
-
-    // Write num_bytes number of bytes from our data array into our output file.
-    fwrite( blocks[ inodes[nid].blocks[block_index] ], num_bytes, 1, ofp ); 
-
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= num_bytes;
-    offset    += BLOCK_SIZE;
-    ++block_index;
-
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek( ofp, offset, SEEK_SET );
-  }
-
-  // Close the output file, we're done. 
-  fclose( ofp );
-
-
-  return 0;
-}
-
-int GetDest(const char* fname, const char* dest)
-{
-  int did = GetDir(fname);
-  if (did == -1)
-  {
-    printf("get error: File not found.\f");
-    return -1;
-  }
-
-  int nid = dir[did].inode;
-
-  FILE *ofp;
-  ofp = fopen(dest, "w");
-
-  if( ofp == NULL )
-  {
-    printf("Could not open output file: %s\n", dest );
-    perror("Opening output file returned");
-    return -1;
-  }
-
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  int block_index = 0;
-  int copy_size   = inodes[nid].size;
-  int offset      = 0;
-
-  printf("Writing %d bytes to %s\n", copy_size, dest );
-
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-  // our stored data to the file fp, then we will increment the offset into the file we are writing to.
-  // On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just copy
-  // how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on the
-  // last iteration we'd end up with gibberish at the end of our file. 
-  while( copy_size > 0 )
-  { 
-
-    int num_bytes;
-
-    // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-    // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-    // end up with garbage at the end of the file.
-    if( copy_size < BLOCK_SIZE )
-    {
-      num_bytes = copy_size;
-    }
-    else 
-    {
-      num_bytes = BLOCK_SIZE;
-    }
-
-    int bid = inodes[nid].blocks[block_index];
-    //printf("bid = %d\n",bid);
-
-    // Write num_bytes number of bytes from our data array into our output file.
-    fwrite( blocks[bid], num_bytes, 1, ofp ); 
-
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= num_bytes;
-    offset    += num_bytes;
-    ++block_index;
-    
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek( ofp, offset, SEEK_SET );
-  }
-
-  // Close the output file, we're done. 
-  fclose( ofp );
-
-
-  return 0;
-}
-
-int Del(const char * fname)
-{
-  int did = GetDir(fname);
-  struct Directory_Entry *entry = &dir[did];
-  if (did == -1) 
-  {
-    printf("del error: File not found.\n");
-    return -1;
-  }
-  else 
-  {
-    if ( WritePermission(dir[did].inode) )
-    {
-      Erase(entry->inode);
-      inodeMap[entry->inode] = 0;
-      inodes[entry->inode].size = 0;
-      inodes[entry->inode].attribute = 0;
-      entry->valid = 0;
-      memset(entry->name,0,255);
-      entry->inode = -1;
-    }
-    else
-    {
-      printf("del error: No permission to delete file \"%s\"\n", fname);
-    }
-  }
-  return 0;
-}
-
-int Createfs(const char* fname) 
-{
-  FILE *ofp;
-  ofp = fopen(fname, "w");
-
-  if( ofp == NULL )
-  {
-    printf("Could not open output file: %s\n", fname );
-    perror("Opening output file returned");
-    return -1;
-  }
-
-  int size = fwrite(blocks[0], BLOCK_SIZE, BLOCK_NUM, ofp);
-  if (size != BLOCK_NUM)
-  {
-    perror("createfs error: Failed to write all blocks.");
-    return -1;
-  }
-  return 0;
-}
-
-void PrintDir(int did)
-{
-  int nid = dir[did].inode;
-  char attr[5];
-  attr[0] = 'h';
-  attr[1] = PLUSMINUS( ATTRIBUTE_GET_H(inodes[nid].attribute) );
-  //printf("(%d) converted to (%c)\n", inodes[nid].attribute, attr[1]);
-  attr[2] = 'r';
-  attr[3] = PLUSMINUS( ATTRIBUTE_GET_R(inodes[nid].attribute) );
-  attr[4] = 0;
-
-  printf("%d | %s | %s | %s\n", inodes[nid].size, ctime(&dir[did].time),
-                                attr, dir[did].name);
-}
-
-int List(int showAll) // if show then print all hidden files
-{
-  int found = 0;
-  for (int i = 0; i < MAX_FILE_NUM; ++i)
-  {
-    if ( dir[i].valid )
-    {
-      if (dir[i].inode < 0 || dir[i].inode > 127) // this should not happen
-      {
-        printf("list error: Illegal inode index(%d) found in file '%s'\n", i, dir[i].name);
-        return -1;
-      }
-      int hidden = ATTRIBUTE_GET_H(inodes[dir[i].inode].attribute);
-      if ( showAll || !hidden )
-      {
-        PrintDir(i);
-      }
-      if (!found) { found = 1; }
-    }
-  }
-
-  if (!found)
-  {
-    printf("list: No files found.\n");
-  }
-
-  return 0;
-}
-
-int Open(const char *fname)
-{
-  // Open the input file for read and write
-  image = fopen ( fname, "r+" ); 
-
-  int    status;                   // Hold the status of all return values.
-  struct stat buf;                 // stat struct to hold the returns from the stat call
-  status =  stat( fname , &buf ); 
-  if (status == -1)
-  {
-    perror("open error: File not found.");
-    return -1;
-  }
-  // quick check the file size
-  if (buf.st_size != BLOCK_NUM * BLOCK_SIZE)
-  {
-    printf("open error: Wrong file size.\n");
-    return -1;
-  }
-
-  if ( fread(&blocks[0], BLOCK_SIZE, BLOCK_NUM, image) == -1)
-  {
-    printf("open error: Failed to read blocks.\n");
-    return -1;
-  }
-  
-  return 0;
-}
-
-int Close()
-{
-  if (image == NULL)
-  {
-    printf("close error: No opened image file.\n");
-    return -1;
-  }
-  else
-  {
-    fseek(image, 0, SEEK_SET);
-    int size = fwrite(&blocks[0], BLOCK_SIZE, BLOCK_NUM, image);
-    if (size != BLOCK_NUM)
-    {
-      printf("close error: Failed to write all blocks (#%d)\n", size);
-      perror("error");
-      return -1;
-    }
-    fclose(image);
-    image = NULL;
-    Initialize(); // reset the metadata
-    return 0;
-  }
-}
-
-int Attrib(char attr, char sign, const char* fname)
-{
-  int did = GetDir(fname);
-  if (did == -1)
-  {
-    printf("attrib error: No such file \"%s\"\n",fname);
-    return -1;
-  }
-  int nid = dir[did].inode;
-  // printf("inode #%d, attr = %d\n", nid, inodes[nid].attribute);
-  if (attr == 'h')
-  {
-    if (sign == '+') { inodes[nid].attribute ^= 2; }       // attr ^= 0b10
-    else if (sign == '-') { inodes[nid].attribute &= 1; }  // attr &= 0b01
-  }
-  else if (attr == 'r')
-  {
-    if (sign == '+') { inodes[nid].attribute ^= 1; }
-    else if (sign == '-') { inodes[nid].attribute &= 2; }
-  }
-  
-  // printf("inode #%d, attr = %d\n", nid, inodes[nid].attribute);
-  return 0;
-}
-
-int AttribHelper(const char* str, const char* fname)
-{
-  // printf("ahelper len = %zu|%s\n", strlen(str), str);
-  // printf("(%c)(%c)\n", str[0], str[1]);
-  if (strlen(str) != 2 || ( str[1] != 'h' && str[1] != 'r' ) || ( str[0] != '+' && str[0] != '-'))
-  {
-    printf("attrib error: Wrong command format.\n");
-    return -1;
-  }
-  else
-  {
-    int ret = Attrib(str[1],str[0], fname);
-    return ret;
-  }
-}
-
-//////////////////////////////////////////////////////////////////////////////////////////////////
-// 
-// User Input
-//
-// This function processes user input into command tokens 
-int Tokenize(char* str, char** token, int* token_count)
-{ 
-  char *working_str  = strdup( str );
-  // we are going to move the working_str pointer so
-  // keep track of its original value so we can deallocate
-  // the correct amount at the end
-  char *working_root = working_str;                                                  
-  
-  // saveptr for strtok_r
-  char *arg_ptr;  
-
-  // Tokenize the input strings with whitespace used as the delimiter
-  // Empty tokens will not be saved in the array
-  for ( ; *token_count < MAX_NUM_ARGUMENTS; working_str = NULL, ++(*token_count) )
-  {
-    char* t = strtok_r(working_str, WHITESPACE, &arg_ptr);
-    if ( !t ) { break; }
-    snprintf(token[ *token_count ], MAX_COMMAND_SIZE, "%s", t );
-  }
-
-  free( working_root );
-  return 0;
-}
-
-// Check if a char pointed by `ptr` appears in a string `set`
-int IsElement(char* ptr, const char* set) 
-{
-  int i = 0;
-  while ( i < strlen(set) )
-  {
-    if ( *ptr == set[i++] ) { return 1; }
-  }
-  return 0;
-}
-
-// This function trims whitespaces on both ends
-// return str pointer passed in
-char* TrimWhiteSpace(char* str)
-{
-  assert(str);
-  if ( strlen(str) < 1 ) return str;
-
-  char* temp = strdup(str);
-  // end temp string after last non whitespace char
-  char* ptr = temp + strlen(str); // point to terminal null char
-  while (ptr != temp && IsElement(ptr-1,WHITESPACE))
-  {
-    --ptr;
-  }
-  *ptr = 0;
-  // move ptr to first non whitespace char
-  ptr = temp;
-  while ( IsElement(ptr,WHITESPACE) )
-  {
-    ++ptr;
-  }
-  // copy
-  strcpy(str,ptr);
-  free(temp);
-  return str;
-}
-
-int main()
-{
-  Initialize();
-
-  // cmd input string
-  char* cmd_str = (char*) calloc( MAX_COMMAND_SIZE, sizeof(char) );
-  char* working_ptr = cmd_str;
-
-  // For parsing command tokens
-  char* token[MAX_NUM_ARGUMENTS];
-  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
-  {
-    token[i] = (char*)calloc(MAX_COMMAND_SIZE, sizeof(char));
-  }
-  int token_count = 0;
-
-  // main loop
-  while (1) 
-  {
-    printf ("msh> ");
-    while( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) );
-    /* Trim whitespace at both ends */
-    working_ptr = TrimWhiteSpace(cmd_str);
-    if ( !working_ptr || !strlen(working_ptr) )
-      continue; // empty str, restart loop
-
-    /* Parse input */
-    token_count = 0;
-    Tokenize(working_ptr, token, &token_count);
-
-    if ( strcmp("put", token[0]) == 0)
-    {
-      Put(token[1]);
-      continue; // restart loop after printing history
-    }
-
-    else if ( strcmp("list", token[0]) == 0)
-    {
-      if (token_count == 2 && strcmp("-a", token[1]) == 0)
-      {
-        List(1); // showAll
-      }
-      else
-      {
-        List(0);
-      }
-      continue; // restart loop after printing history
-    }
-    else if ( strcmp("get", token[0]) == 0)
-    {
-      if (token_count == 2)
-      {
-        Get(token[1]);
-      }
-      else if (token_count == 3)
-      {
-        GetDest(token[1], token[2]);
-      }
-      else
-      {
-        printf("Usage: get filename [destination] (optional)\n");
-      }
-      continue;
-    }
-
-    else if (strcmp("createfs", token[0]) == 0)
-    {
-      Createfs(token[1]);
-      continue;
-    }
-
-    else if (strcmp("open", token[0]) == 0)
-    {
-      Open(token[1]);
-      continue;
-    }
-
-    else if (strcmp("close", token[0]) == 0)
-    {
-      Close();
-      continue;
-    }
-
-    else if (strcmp("del", token[0]) == 0)
-    {
-      Del(token[1]);
-      continue;
-    }
-
-    else if (strcmp("attrib", token[0]) == 0)
-    {
-      if (token_count != 3)
-      {
-        printf("Usage: attrib command (e.g. h+ or r-) filename\n");
-      }
-      AttribHelper(token[1], token[2]);
-      continue;
-    }
-    
-    else if (strcmp("df", token[0]) == 0)
-    {
-      PrintDf();
-      continue;
-    }
-    
-    else if (strcmp("exit", token[0]) == 0 || strcmp("quit", token[0]) == 0)
-    {
-      break;
-    }
-
-    else
-    {
-      printf("error: Unknown command.\n");
-      continue;
-    }
-    
-  }
-  
-  // mem recycle
-  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
-  {
-    free(token[i]);
-  }
-  free(cmd_str);
-
-
-  return 0;
-}
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <termios.h>
+#include <fnmatch.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// settings about file system
+#define BLOCK_NUM 4226          // default image size, createfs can be given another
+#define BLOCK_SIZE 8192
+#define INODES_PER_DATA 2       // createfs makes this many inodes per block, files may be smaller
+#define DIRECT_NUM 12           // direct block pointers in an inode
+#define PTRS_PER_BLOCK ( BLOCK_SIZE / sizeof(uint32_t) )
+#define MAX_NAME_LEN 255        // longest name of a single path component
+#define MAX_PATH_LEN 1024
+#define ROOT_INODE 0
+#define PIPE_CHUNK ( 1 << 20 )  // unit of host I/O for archives and big gets
+#define SEGMENT_BLOCKS 128      // unit of saving and of log mode, the largest chunk allocated
+#define HUGE_PAGE ( 2 << 20 )   // the block store is mapped in whole huge pages of this size
+
+// image identification, stored in the super block (block 0)
+#define FS_MAGIC   0x58425044   // "DPBX"
+#define FS_VERSION 4             // 3: no inline data or packed tails
+
+// for parsing command line input
+#define WHITESPACE " \t\n"
+#define MAX_COMMAND_SIZE 2048   // room for a few full-length paths
+#define MAX_NUM_ARGUMENTS 10
+
+// macros to decode / set attribute integer
+#define ATTRIBUTE_GET_H(x) ( (x) / 2 )          // hide      = high bit
+#define ATTRIBUTE_GET_R(x) ( (x) % 2)           // read-only = low bit
+#define PLUSMINUS(x)       ( (x) ? '+' : '-' )
+
+// inode types
+#define INODE_FILE 0
+#define INODE_DIR  1
+
+// inode flags
+#define INODE_REMOVED 1         // directory unlinked, nothing may be added to it
+#define INODE_INLINE  2         // file kept in the inode itself, no blocks
+
+// The image is laid out as
+//   super block | inode map | block map | inode table | data
+// where the region sizes follow from the block and inode counts.
+struct Super_Block {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_num;
+  uint32_t inode_num;
+  uint32_t inode_map;               // first block of each region
+  uint32_t block_map;
+  uint32_t inode_table;
+  uint32_t data_start;
+  uint32_t root;                    // inode of the root directory
+  uint32_t flags;
+  uint32_t kdf_rounds;              // encrypted images: PBKDF2 iterations
+  uint8_t  salt[16];
+  uint8_t  key_check[32];           // SHA-256 of the derived keys
+  uint32_t parity_start;            // images with parity: first block after the covered area, else 0
+  uint32_t csum_start;              // first checksum block
+  uint16_t stripe_data;             // blocks per stripe
+  uint16_t stripe_parity;           // parity blocks per stripe
+  uint32_t flush_seconds;           // write-back: checkpoint this often, 0 = not by time
+  uint32_t flush_mb;                // or once this many MB changed, 0 = not by size
+};
+
+// super block flags
+#define SUPER_ENCRYPTED 1
+#define SUPER_LOG       2               // log mode, see Segments
+
+// a directory entry unpacked from a b-tree node
+struct Directory_Entry {
+  uint32_t hash;
+  uint32_t inode;                   // b-tree internal nodes: child block right of this key
+  int64_t  time;
+  uint8_t  len;
+  char     name[MAX_NAME_LEN + 1];
+};
+
+// Block pointers are 0 when unused (block 0 is the super block). Past the
+// direct pointers come a single, a double and a triple indirect block, each
+// level holding PTRS_PER_BLOCK pointers, so mapping an offset reads at most
+// three blocks.
+//
+// Small files don't take blocks: up to INLINE_MAX bytes are kept in the inode
+// in place of the pointers (INODE_INLINE). A bigger file whose last block
+// would be partly empty keeps that end in a tail block instead, shared with
+// the ends of other files (see Tail blocks); the pointers then map only the
+// whole blocks before it.
+#define INLINE_MAX 112
+
+struct Inode {                      // Inode = 128 bytes
+  uint8_t  attribute;               // 0: h-r-  1: h-r+  2: h+r-  3: h+r+
+  uint8_t  type;                    // INODE_FILE or INODE_DIR
+  uint8_t  flags;
+  uint8_t  pad;
+  uint32_t parent;                  // directories: inode of the parent directory
+  uint64_t size;
+  union {
+    struct {
+      uint32_t direct[DIRECT_NUM];  // directories: direct[0] = b-tree root
+      uint32_t indirect[3];         // single, double, triple
+      uint32_t tail;                // tail block holding the end of the file, 0 = none
+      uint8_t  tail_unit;           // where in it the end starts, in TAIL_UNITs
+      uint8_t  tail_pad[3];
+      uint32_t reserved;            // blocks mapped past the end of the file (see Reserve)
+      uint8_t  spare[40];
+    };
+    uint8_t data[INLINE_MAX];       // INODE_INLINE: the whole file
+  };
+};
+
+#define INODES_PER_BLOCK ( BLOCK_SIZE / sizeof(struct Inode) )
+
+// Every directory is a B+ tree of entries sorted by name, one node per block.
+// Leaves hold the entries; internal nodes hold separator keys, where inode[i]
+// is the child right of key i and `child` is the leftmost one. Leaves are not
+// chained, so a node never has to change because a sibling was copied; an
+// in-order scan keeps its path on a small stack instead.
+//
+// Nodes are stored as a struct of arrays: the fields scanned on every lookup
+// or listing (hash, inode, time, name length) sit densely at the front of the
+// block and the names live in a heap growing down from the end of the block.
+// A lookup compares 4-byte hashes and only touches a name on a hash match.
+#define BTREE_SLOTS 192             // multiple of BTREE_LANES
+#define BTREE_LANES 8               // hashes compared per step of a leaf scan
+#define BTREE_MAX_DEPTH 16
+
+struct BTree_Node {
+  uint16_t leaf;
+  uint16_t count;
+  uint16_t heap;                    // lowest used byte of the name heap
+  uint16_t garbage;                 // bytes of removed names still in the heap
+  uint32_t child;                   // internal: leftmost child
+  uint32_t hash[BTREE_SLOTS];       // FNV-1a of the name
+  uint32_t inode[BTREE_SLOTS];
+  int64_t  time[BTREE_SLOTS];       // leaves only
+  uint16_t off[BTREE_SLOTS];        // name position in the block
+  uint8_t  len[BTREE_SLOTS];        // name length without the terminating 0
+  char     names[];                 // heap, up to the end of the block
+};
+
+#define BTREE_HEAP_START ( sizeof(struct BTree_Node) )
+#define BTREE_HEAP_SIZE  ( BLOCK_SIZE - BTREE_HEAP_START )
+
+uint8_t (*blocks)[BLOCK_SIZE] = NULL;
+uint8_t *segDirty;                  // per segment: a block in it changed since the image was saved
+uint64_t segsDirtied;               // how many times a segment became dirty
+uint64_t flushKickAt = UINT64_MAX;  // write-back: wake the flusher once segsDirtied gets here
+
+struct Super_Block *super;
+struct Inode *inodes;
+uint8_t *inodeMap; // 1 = in use, 0 = empty
+uint8_t *blockMap; // 1 = in use, 2 = reserved for a file but not written, 0 = empty
+
+// allocation hint: no inode below this is free
+uint32_t inodeHint;
+
+FILE *image = NULL;
+char imagePath[MAX_PATH_LEN];       // of the open image
+__thread FILE *out;                 // where commands print their results
+
+__thread int  cwd = ROOT_INODE;     // current working directory
+__thread char cwdPath[MAX_PATH_LEN] = "/";
+
+// Concurrency
+//
+// Commands may run on several threads at once (the server runs each request
+// on a worker). Readers never take a lock: directory trees are copy-on-write,
+// so an update copies the nodes on its path, edits the copies and publishes
+// them by swapping the root pointer in the directory inode, and a put writes
+// the new contents to a fresh inode before swapping the directory entry.
+// Whatever an update takes out of the tree is retired, and only freed once
+// every command that might still see it has finished (epoch based
+// reclamation). Writers to one directory are serialized by a striped lock,
+// the maps and counters of the allocator by a lock of their own.
+#define DIR_LOCKS   64
+#define MAX_THREADS 256
+
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;  // maps, hints, counters, retired list
+pthread_mutex_t dirLocks[DIR_LOCKS] = { [0 ... DIR_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER };
+
+uint32_t freeBlocks;                // free data blocks
+uint32_t reservedBlocks;            // promised to updates in progress
+__thread uint32_t myReserve;        // the part promised to this thread
+
+struct Retired {
+  uint64_t epoch;                   // global epoch when it was taken out
+  uint32_t id;
+  uint8_t  inode;                   // an inode with all its blocks, else a single block
+};
+
+struct Retired *retired = NULL;
+size_t nretired = 0;
+size_t retiredCap = 0;
+
+// Write-back: blocks freed while the image file may still use them are held
+// back from the free lists until a checkpoint that does not is committed.
+struct Retired *held = NULL;
+size_t nheld = 0;
+size_t heldCap = 0;
+int heldKicked;                     // the flusher was woken for them
+uint8_t *flushDurable;              // per block: in use in the checkpoint on disk, NULL = write-back off
+uint8_t *flushTaken;                // in use in the checkpoint being written
+
+// Each thread announces the epoch it entered its command in; 0 = not in one.
+struct Reader_Slot {
+  uint64_t epoch;
+  int      used;
+  char     pad[52];                 // one cache line per thread
+};
+
+uint64_t globalEpoch = 1;
+struct Reader_Slot readers[MAX_THREADS];
+__thread int readerSlot = -1;
+__thread int retiring = 0;          // this command retired something
+
+// Commands hold commandLock shared; a checkpoint takes it alone for a moment
+// so it sees no command half done. Writers first, or a busy server would
+// keep it out.
+pthread_rwlock_t commandLock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+__thread int commandHeld;
+
+int AllocBlock();
+int AllocRun(uint64_t want, uint32_t near, uint32_t *len);
+void ForgetKey();
+void ParityInit(int n, int m);
+void MarkDirty(uint32_t bid, uint32_t n);
+void SealParity();
+extern uint8_t *stripeDirty;
+extern uint32_t stripeCount;
+int AllocInode();
+void InitNode(uint32_t bid, int leaf);
+void TailForget();
+void BuddyBuild();
+void FlushStart(int saved);
+void FlushStop();
+int FlushSync();
+extern int flushStarted;
+int JournalReplay(int fd, off_t size);
+void JournalRemove();
+void FlushKick();
+void FlushThrottle();
+int GetPiped(int nid, FILE *ofp);
+extern int pipeDepth;
+uint64_t ParseSize(const char *str);
+
+// Spans
+//
+// With `-S file` every command and the phases inside it (lookups, allocation,
+// host reads and writes, copies, metadata updates, encryption, parity, image
+// I/O) are timed as spans: SpanStart takes the time, SpanStop adds the span
+// to a ring shared by all threads, a slot being claimed with one atomic add.
+// The newest SPAN_RING spans are saved at exit in Chrome trace-event JSON,
+// for chrome://tracing or Perfetto. Off, a span costs a load and a branch.
+#define SPAN_RING ( 1 << 16 )
+
+struct Span {
+  const char *name;                 // a literal or from SpanName
+  uint64_t start;                   // ns after spans were turned on
+  uint64_t end;
+  uint32_t tid;
+  uint64_t seq;                     // index of the span in the slot + 1, 0 while it is written
+};
+
+int spanOn = 0;
+struct Span *spanRing;
+uint64_t spanNext;                  // spans ever taken
+uint64_t spanEpoch;
+uint32_t spanThreads;
+__thread uint32_t spanTid;          // 1, 2 ... in the order threads first add a span
+const char *spanPath;
+
+uint64_t NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 0 when spans are off
+static inline uint64_t SpanStart()
+{
+  return __builtin_expect(spanOn, 0) ? NowNs() : 0;
+}
+
+void SpanPush(const char *name, uint64_t start)
+{
+  uint64_t end = NowNs();
+  if (!spanTid) { spanTid = __atomic_add_fetch(&spanThreads, 1, __ATOMIC_RELAXED); }
+  uint64_t i = __atomic_fetch_add(&spanNext, 1, __ATOMIC_RELAXED);
+  struct Span *sp = &spanRing[i % SPAN_RING];
+  __atomic_store_n(&sp->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  sp->name = name;
+  sp->start = start - spanEpoch;
+  sp->end = end - spanEpoch;
+  sp->tid = spanTid;
+  __atomic_store_n(&sp->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+static inline void SpanStop(const char *name, uint64_t start)
+{
+  if (__builtin_expect(start != 0, 0)) { SpanPush(name, start); }
+}
+
+// a lasting copy of a command name, the same one for the same name
+const char *SpanName(const char *name)
+{
+  static const char *names[64];
+  static int count = 0;
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&lock);
+  int i = 0;
+  while (i < count && strcmp(names[i], name) != 0) { ++i; }
+  if (i == count && count < 64) { names[count++] = strdup(name); }
+  const char *kept = i < count ? names[i] : "command";
+  pthread_mutex_unlock(&lock);
+  return kept;
+}
+
+// write s as a JSON string, command names are whatever was typed
+void SpanString(FILE *fp, const char *s)
+{
+  fputc('"', fp);
+  for ( ; *s; ++s)
+  {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') { fprintf(fp, "\\%c", c); }
+    else if (c < 0x20) { fprintf(fp, "\\u%04x", c); }
+    else { fputc(c, fp); }
+  }
+  fputc('"', fp);
+}
+
+// write the spans still in the ring to spanPath
+void SpanSave()
+{
+  FILE *fp = fopen(spanPath, "w");
+  if (!fp)
+  {
+    perror("error: Cannot save the spans");
+    return;
+  }
+  uint64_t next = __atomic_load_n(&spanNext, __ATOMIC_ACQUIRE);
+  uint64_t first = next > SPAN_RING ? next - SPAN_RING : 0;
+  fprintf(fp, "{\"traceEvents\":[\n");
+  int sep = 0;
+  for (uint64_t i = first; i < next; ++i)
+  {
+    struct Span *sp = &spanRing[i % SPAN_RING];
+    if (__atomic_load_n(&sp->seq, __ATOMIC_ACQUIRE) != i + 1) { continue; } // still being written
+    fprintf(fp, "%s{\"name\":", sep ? ",\n" : "");
+    SpanString(fp, sp->name);
+    fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+            sp->tid, sp->start / 1e3, ( sp->end - sp->start ) / 1e3);
+    sep = 1;
+  }
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%" PRIu64 "}}\n", first);
+  if (fclose(fp) == EOF) { perror("error: Cannot save the spans"); }
+}
+
+// start taking spans, to be saved to path when the program ends
+int SpanBegin(const char *path)
+{
+  spanRing = calloc(SPAN_RING, sizeof(struct Span));
+  if (!spanRing)
+  {
+    printf("error: No memory for spans.\n");
+    return -1;
+  }
+  spanPath = path;
+  spanEpoch = NowNs();
+  spanOn = 1;
+  atexit(SpanSave);
+  return 0;
+}
+
+// The block store is mapped in huge pages where the system gives them, so
+// copying files in and out and scanning the image walk a few TLB entries
+// instead of one per 4 KB: explicit ones (MAP_HUGETLB) if some are set
+// aside, else a range aligned to them that the kernel is asked to back with
+// transparent huge pages, else plain pages. A huge page holds whole blocks.
+// $DROPBOX_HUGEPAGES=0 asks for plain pages, to compare.
+size_t      storeSize;              // bytes mapped at blocks
+const char *storePages = "4 KB pages";
+
+// map size bytes of zeros, a multiple of HUGE_PAGE, NULL if there is no memory
+void *StoreMap(size_t size)
+{
+  const char *env = getenv("DROPBOX_HUGEPAGES");
+  int huge = !env || strcmp(env, "0") != 0;
+  int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *p = huge ? mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0) : MAP_FAILED;
+  if (p != MAP_FAILED)
+  {
+    storePages = "2 MB pages";
+    return p;
+  }
+  // one page more than needed, then the ends around an aligned range go
+  uint8_t *q = mmap(NULL, size + HUGE_PAGE, prot, flags, -1, 0);
+  if (q == MAP_FAILED) { return NULL; }
+  uint8_t *aligned = (uint8_t *) ( ( (uintptr_t) q + HUGE_PAGE - 1 ) & ~(uintptr_t) ( HUGE_PAGE - 1 ) );
+  if (aligned > q) { munmap(q, aligned - q); }
+  munmap(aligned + size, q + HUGE_PAGE - aligned);
+  storePages = huge && madvise(aligned, size, MADV_HUGEPAGE) == 0 ? "transparent huge pages" : "4 KB pages";
+  return aligned;
+}
+
+// Move the store to a mapping for block_num blocks, keeping the blocks that
+// fit and zeroing the rest. -1 if there is no memory, the store stays as it is.
+int StoreResize(uint32_t block_num)
+{
+  size_t size = ( (size_t) block_num * BLOCK_SIZE + HUGE_PAGE - 1 ) / HUGE_PAGE * HUGE_PAGE;
+  uint8_t (*store)[BLOCK_SIZE] = StoreMap(size);
+  if (!store) { return -1; }
+  if (blocks)
+  {
+    memcpy(store, blocks, size < storeSize ? size : storeSize);
+    munmap(blocks, storeSize);
+  }
+  blocks = store;
+  storeSize = size;
+  return 0;
+}
+
+// (re)allocate the in-memory block store for block_num blocks
+int AllocStore(uint32_t block_num)
+{
+  if (blocks) { munmap(blocks, storeSize); }
+  blocks = NULL;
+  free(segDirty);
+  StoreResize(block_num);
+  segDirty = calloc(( block_num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS, 1);
+  if (!blocks || !segDirty)
+  {
+    fprintf(out, "error: Cannot allocate %u blocks.\n", block_num);
+    return -1;
+  }
+  return 0;
+}
+
+// point the metadata globals at their regions of the block store
+void MapMetadata()
+{
+  super = (struct Super_Block *) &blocks[0];
+  inodeMap = (uint8_t*) &blocks[super->inode_map];
+  blockMap = (uint8_t*) &blocks[super->block_map];
+  inodes = (struct Inode *) &blocks[super->inode_table];
+  inodeHint = 0;
+  freeBlocks = 0;
+  for (uint32_t i = super->data_start; i < super->block_num; ++i)
+  {
+    freeBlocks += blockMap[i] == 0;
+  }
+  BuddyBuild();
+  reservedBlocks = 0;
+  nretired = 0; // anything retired belonged to the previous image
+  nheld = 0;    // and held, it is on the free lists again
+  TailForget();
+
+  free(stripeDirty);
+  stripeDirty = NULL;
+  if (super->parity_start)
+  {
+    ParityInit(super->stripe_data, super->stripe_parity);
+    stripeCount = ( super->parity_start + super->stripe_data - 1 ) / super->stripe_data;
+    stripeDirty = calloc(stripeCount, 1);
+    assert(stripeDirty);
+  }
+}
+
+// end of the area files and directories are allocated in
+uint32_t DataEnd()
+{
+  return super->parity_start ? super->parity_start : super->block_num;
+}
+
+// inodes a file system of block_num blocks is made with
+uint32_t InodesFor(uint32_t block_num)
+{
+  uint64_t want = (uint64_t) block_num * INODES_PER_DATA;
+  if (want > INT32_MAX) { want = INT32_MAX; } // inode numbers are ints
+  return want / INODES_PER_BLOCK * INODES_PER_BLOCK;
+}
+
+// build an empty file system of block_num blocks in memory
+int Initialize(uint32_t block_num)
+{
+  uint32_t inode_num = InodesFor(block_num);
+  uint32_t inode_map_blocks = ( inode_num + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint32_t block_map_blocks = ( block_num + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint32_t inode_table_blocks = inode_num / INODES_PER_BLOCK;
+  uint32_t data_start = 1 + inode_map_blocks + block_map_blocks + inode_table_blocks;
+  if (block_num <= data_start + 1)
+  {
+    fprintf(out, "error: %u blocks is too small for a file system.\n", block_num);
+    return -1;
+  }
+  if ( AllocStore(block_num) == -1 )
+  {
+    return -1;
+  }
+  ForgetKey(); // a new file system starts unencrypted
+
+  super = (struct Super_Block *) &blocks[0];
+  super->magic = FS_MAGIC;
+  super->version = FS_VERSION;
+  super->block_num = block_num;
+  super->inode_num = inode_num;
+  super->inode_map = 1;
+  super->block_map = super->inode_map + inode_map_blocks;
+  super->inode_table = super->block_map + block_map_blocks;
+  super->data_start = data_start;
+  super->root = ROOT_INODE;
+
+  // the store is zeroed: every inode is free and has no blocks
+  blockMap = (uint8_t*) &blocks[super->block_map];
+  for (uint32_t i = 0; i < data_start; ++i)
+  {
+    blockMap[i] = 1; // metadata blocks reserved
+  }
+  MapMetadata();
+
+  // root directory starts as a single empty leaf
+  int root = AllocBlock();
+  InitNode(root, 1);
+  inodeMap[ROOT_INODE] = 1;
+  inodes[ROOT_INODE].type = INODE_DIR;
+  inodes[ROOT_INODE].parent = ROOT_INODE;
+  inodes[ROOT_INODE].size = 0;
+  inodes[ROOT_INODE].direct[0] = root;
+
+  cwd = ROOT_INODE;
+  strcpy(cwdPath, "/");
+  return 0;
+}
+
+uint64_t Df()
+{
+  pthread_mutex_lock(&allocLock);
+  uint64_t space = (uint64_t) freeBlocks * BLOCK_SIZE;
+  pthread_mutex_unlock(&allocLock);
+  return space;
+}
+
+void PrintDf()
+{
+  uint64_t space = Df();
+  fprintf(out, "%" PRIu64 " bytes free.\n", space);
+}
+
+// Promise n blocks to the calling thread, so an update that has started
+// cannot run out of space halfway. -1 if there are not enough.
+// Blocks held back for the checkpoint on disk do not count; running short
+// while there are some wakes the flusher to give them back.
+int ReserveBlocks(uint64_t n)
+{
+  pthread_mutex_lock(&allocLock);
+  int ok = freeBlocks - reservedBlocks >= n;
+  if (ok)
+  {
+    reservedBlocks += n;
+    myReserve += n;
+  }
+  int kick = !ok && nheld;
+  pthread_mutex_unlock(&allocLock);
+  if (kick) { FlushKick(); }
+  return ok ? 0 : -1;
+}
+
+// give back what is left of the calling thread's reservation
+void Unreserve()
+{
+  pthread_mutex_lock(&allocLock);
+  reservedBlocks -= myReserve;
+  myReserve = 0;
+  pthread_mutex_unlock(&allocLock);
+}
+
+// Free blocks
+//
+// Free data blocks are kept by a buddy allocator: free space is cut into
+// aligned chunks of 2^k blocks, k < BUDDY_ORDERS (8 KB to 1 MB), with a list
+// per size. A request takes the smallest chunk that is big enough and hands
+// the halves it splits off back to the lists; a freed block merges with its
+// buddy while that is free as a whole, and so on up. A new file asks for the
+// largest chunk its size fills, so big files are laid out in 1 MB chunks that
+// come one after the other and small ones do not break them up. The block
+// map stays what the image records; the lists are rebuilt from it whenever
+// an image is mapped.
+#define BUDDY_ORDERS 8              // the largest chunk is a segment
+
+uint32_t *buddyNext;                // per first block of a free chunk, 0 = end of the list
+uint32_t *buddyPrev;
+uint8_t  *buddyOrder;               // per block: order + 1 if a free chunk starts there, else 0
+uint32_t  buddyHead[BUDDY_ORDERS];  // 0 = empty list, block 0 is never free
+uint32_t  buddyTail[BUDDY_ORDERS];
+uint32_t  runHint;                  // block after the last run taken
+
+// put a free chunk on its list, at the front (reused first) or the back
+void BuddyLink(uint32_t b, int k, int back)
+{
+  buddyOrder[b] = k + 1;
+  buddyNext[b] = back ? 0 : buddyHead[k];
+  buddyPrev[b] = back ? buddyTail[k] : 0;
+  if (back && buddyTail[k]) { buddyNext[buddyTail[k]] = b; }
+  if (!back && buddyHead[k]) { buddyPrev[buddyHead[k]] = b; }
+  if (!buddyHead[k] || !back) { buddyHead[k] = b; }
+  if (!buddyTail[k] || back) { buddyTail[k] = b; }
+}
+
+void BuddyUnlink(uint32_t b)
+{
+  int k = buddyOrder[b] - 1;
+  if (buddyPrev[b]) { buddyNext[buddyPrev[b]] = buddyNext[b]; } else { buddyHead[k] = buddyNext[b]; }
+  if (buddyNext[b]) { buddyPrev[buddyNext[b]] = buddyPrev[b]; } else { buddyTail[k] = buddyPrev[b]; }
+  buddyOrder[b] = 0;
+}
+
+// cut the free blocks of the data area into the largest chunks they make,
+// listed from the start of the image on
+void BuddyBuild()
+{
+  free(buddyNext); free(buddyPrev); free(buddyOrder);
+  buddyNext = malloc(super->block_num * sizeof(uint32_t));
+  buddyPrev = malloc(super->block_num * sizeof(uint32_t));
+  buddyOrder = calloc(super->block_num, 1);
+  assert(buddyNext && buddyPrev && buddyOrder);
+  memset(buddyHead, 0, sizeof(buddyHead));
+  memset(buddyTail, 0, sizeof(buddyTail));
+  runHint = 0;
+
+  uint32_t end = DataEnd();
+  for (uint32_t b = super->data_start; b < end; )
+  {
+    if (blockMap[b]) { ++b; continue; }
+    uint32_t n = 1;                 // free blocks from b on, up to the largest chunk
+    while (n < ( 1u << ( BUDDY_ORDERS - 1 ) ) && b + n < end && !blockMap[b+n]) { ++n; }
+    int k = BUDDY_ORDERS - 1;
+    while (k > 0 && ( b % ( 1u << k ) || ( 1u << k ) > n )) { --k; }
+    BuddyLink(b, k, 1);
+    b += 1u << k;
+  }
+}
+
+// Take an aligned chunk of 2^k blocks: the one at `near` if a free chunk at
+// least that big starts there, else the first of the smallest size there is,
+// splitting a bigger one if need be. -1 if there is no chunk as big.
+// Callers hold allocLock.
+int BuddyTake(int k, uint32_t near)
+{
+  uint32_t b = near;
+  int j = near && near < super->block_num ? buddyOrder[near] - 1 : -1;
+  if (j < k)
+  {
+    // a log goes on in a whole free segment while there is one
+    j = super->flags & SUPER_LOG && buddyHead[BUDDY_ORDERS - 1] ? BUDDY_ORDERS - 1 : k;
+    for ( ; j < BUDDY_ORDERS && !buddyHead[j]; ++j) { }
+    if (j == BUDDY_ORDERS) { return -1; }
+    b = buddyHead[j];
+  }
+  BuddyUnlink(b);
+  while (j > k)
+  {
+    --j;
+    BuddyLink(b + ( 1u << j ), j, 0);
+  }
+  memset(&blockMap[b], 1, 1u << k);
+  MarkDirty(b, 1u << k);
+  freeBlocks -= 1u << k;
+  return b;
+}
+
+// take an empty block, out of the thread's reservation if it has one
+int AllocBlock()
+{
+  int bid = -1;
+  pthread_mutex_lock(&allocLock);
+  int log = super->flags & SUPER_LOG;
+  if (myReserve > 0 || freeBlocks > reservedBlocks)
+  {
+    bid = BuddyTake(0, log ? runHint : 0);
+  }
+  if (bid != -1 && log) { runHint = bid + 1; }
+  if (bid != -1 && myReserve > 0) { --myReserve; --reservedBlocks; }
+  pthread_mutex_unlock(&allocLock);
+  return bid;
+}
+
+// put a free block on the lists, merged with its free buddies, callers hold allocLock
+void BuddyFree(uint32_t bid)
+{
+  ++freeBlocks;
+  int k = 0;
+  while (k + 1 < BUDDY_ORDERS)
+  {
+    uint32_t buddy = bid ^ ( 1u << k );
+    if (buddy >= super->block_num || buddyOrder[buddy] != k + 1) { break; }
+    BuddyUnlink(buddy);
+    bid &= ~( 1u << k );
+    ++k;
+  }
+  BuddyLink(bid, k, 0);
+}
+
+// Give a block back, callers hold allocLock. With write-back on, one the
+// image file may still use is held until a checkpoint without it is
+// committed, so nothing written over it reaches the disk before.
+void FreeBlock(uint32_t bid)
+{
+  blockMap[bid] = 0;
+  if (!flushDurable || !( flushDurable[bid] || flushTaken[bid] ))
+  {
+    BuddyFree(bid);
+    return;
+  }
+  if (nheld == heldCap)
+  {
+    heldCap = heldCap ? heldCap * 2 : 256;
+    held = realloc(held, heldCap * sizeof(*held));
+    assert(held);
+  }
+  held[nheld].epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  held[nheld].id = bid;
+  held[nheld].inode = 0;
+  ++nheld;
+  // hurry the checkpoint once they add up
+  if (!heldKicked && nheld > freeBlocks / 4)
+  {
+    heldKicked = 1;
+    FlushKick();
+  }
+}
+
+// free the held blocks a checkpoint taken at epoch no longer uses, callers hold allocLock
+void HeldRelease(uint64_t epoch)
+{
+  size_t keep = 0;
+  for (size_t i = 0; i < nheld; ++i)
+  {
+    if (held[i].epoch < epoch) { BuddyFree(held[i].id); } else { held[keep++] = held[i]; }
+  }
+  nheld = keep;
+  heldKicked = 0;
+}
+
+// Take up to want adjacent empty blocks as one chunk: the largest power of
+// two not above want, else the largest chunk there is. If a free chunk
+// starts at `near`, the block after the previous run of the file (or after
+// the last run anybody took, for a new file), it is taken instead even if it
+// is smaller, so files stay in one piece and follow each other.
+// Returns the first block and sets *len, -1 when nothing is free.
+int AllocRun(uint64_t want, uint32_t near, uint32_t *len)
+{
+  int bid = -1;
+  *len = 0;
+  pthread_mutex_lock(&allocLock);
+  uint64_t avail = myReserve > 0 ? myReserve : freeBlocks - reservedBlocks;
+  if (want > avail) { want = avail; }
+  int k = 0;
+  while (k + 1 < BUDDY_ORDERS && ( 1ull << ( k + 1 ) ) <= want) { ++k; }
+  if (!near) { near = runHint; }
+  int at = near < super->block_num ? buddyOrder[near] - 1 : -1;
+  if (at >= 0 && at < k) { k = at; }
+  for ( ; want > 0 && bid == -1 && k >= 0; --k)
+  {
+    bid = BuddyTake(k, near);
+    if (bid != -1) { *len = 1u << k; }
+  }
+  if (bid != -1)
+  {
+    runHint = bid + *len;
+    uint32_t own = myReserve < *len ? myReserve : *len;
+    myReserve -= own;
+    reservedBlocks -= own;
+  }
+  pthread_mutex_unlock(&allocLock);
+  return bid;
+}
+
+// take the next empty inode
+int AllocInode()
+{
+  int nid = -1;
+  pthread_mutex_lock(&allocLock);
+  for (uint32_t i = inodeHint; i < super->inode_num; ++i)
+  {
+    if (inodeMap[i] == 0)
+    {
+      inodeMap[i] = 1;
+      inodeHint = i + 1;
+      nid = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&allocLock);
+  return nid;
+}
+
+// callers hold allocLock
+void FreeInode(uint32_t nid)
+{
+  memset(&inodes[nid], 0, sizeof(struct Inode));
+  inodeMap[nid] = 0;
+  if (nid < inodeHint) { inodeHint = nid; }
+}
+
+// Tail blocks
+//
+// A tail block is cut into TAIL_UNITs and holds the ends of several files.
+// Its first unit is a header with a bit per unit in use. Ends are placed
+// first fit in the few tail blocks known to have room (tailCache), else in a
+// new block; a block is freed again once its last end is. Freed ends come
+// back through reclamation, like blocks, so a reader never sees the units
+// reused under it. Tail blocks from before the image was opened join the
+// cache once one of their ends is freed.
+#define TAIL_UNIT  64
+#define TAIL_UNITS ( BLOCK_SIZE / TAIL_UNIT )
+#define TAIL_MAX   ( BLOCK_SIZE - TAIL_UNIT )   // longest end that is packed
+#define TAIL_CACHE 16
+#define TAIL_MAGIC 0x4c494154                   // "TAIL"
+
+struct Tail_Header {
+  uint32_t magic;
+  uint16_t used;                    // units in use, the header's included
+  uint16_t pad;
+  uint8_t  map[TAIL_UNITS / 8];
+};
+
+uint32_t tailCache[TAIL_CACHE];     // tail blocks that had free units, 0 = none
+int tailNext;                       // cache slot to replace next
+
+struct Tail_Header *Tail(uint32_t bid)
+{
+  return (struct Tail_Header *) blocks[bid];
+}
+
+int TailUnits(uint64_t bytes)
+{
+  return ( bytes + TAIL_UNIT - 1 ) / TAIL_UNIT;
+}
+
+// first of n free adjacent units in tail block bid, -1 if there are none
+int TailFit(uint32_t bid, int n)
+{
+  struct Tail_Header *h = Tail(bid);
+  if (TAIL_UNITS - h->used < n) { return -1; }
+  int run = 0;
+  for (int u = 1; u < TAIL_UNITS; ++u)
+  {
+    run = h->map[u / 8] & ( 1 << ( u % 8 ) ) ? 0 : run + 1;
+    if (run == n) { return u - n + 1; }
+  }
+  return -1;
+}
+
+void TailMark(uint32_t bid, int unit, int n, int used)
+{
+  struct Tail_Header *h = Tail(bid);
+  for (int u = unit; u < unit + n; ++u)
+  {
+    if (used) { h->map[u / 8] |= 1 << ( u % 8 ); }
+    else { h->map[u / 8] &= ~( 1 << ( u % 8 ) ); }
+  }
+  h->used += used ? n : -n;
+  MarkDirty(bid, 1);
+}
+
+// a new image starts without known tail blocks
+void TailForget()
+{
+  memset(tailCache, 0, sizeof(tailCache));
+  tailNext = 0;
+}
+
+// remember a tail block with room, callers hold allocLock
+void TailRemember(uint32_t bid)
+{
+  for (int i = 0; i < TAIL_CACHE; ++i)
+  {
+    if (tailCache[i] == bid) { return; }
+  }
+  for (int i = 0; i < TAIL_CACHE; ++i)
+  {
+    if (tailCache[i] == 0) { tailCache[i] = bid; return; }
+  }
+  tailCache[tailNext] = bid;
+  tailNext = ( tailNext + 1 ) % TAIL_CACHE;
+}
+
+// Find room for the last `bytes` of a file. Takes a new block (out of the
+// caller's reservation) when no cached tail block has room. Returns the
+// unit and sets *bid, -1 when no block is free.
+int AllocTail(uint64_t bytes, uint32_t *bid)
+{
+  int n = TailUnits(bytes);
+  pthread_mutex_lock(&allocLock);
+  for (int i = 0; i < TAIL_CACHE; ++i)
+  {
+    int unit = tailCache[i] ? TailFit(tailCache[i], n) : -1;
+    if (unit != -1)
+    {
+      *bid = tailCache[i];
+      TailMark(*bid, unit, n, 1);
+      pthread_mutex_unlock(&allocLock);
+      return unit;
+    }
+  }
+  pthread_mutex_unlock(&allocLock);
+
+  int fresh = AllocBlock();
+  if (fresh == -1) { return -1; }
+  memset(blocks[fresh], 0, BLOCK_SIZE);
+  Tail(fresh)->magic = TAIL_MAGIC;
+  pthread_mutex_lock(&allocLock);
+  TailMark(fresh, 0, 1 + n, 1);     // the header and this end
+  TailRemember(fresh);
+  pthread_mutex_unlock(&allocLock);
+  *bid = fresh;
+  return 1;
+}
+
+// give back the end of a file, callers hold allocLock
+void FreeTail(uint32_t bid, int unit, uint64_t bytes)
+{
+  TailMark(bid, unit, TailUnits(bytes), 0);
+  if (Tail(bid)->used > 1)
+  {
+    TailRemember(bid);
+    return;
+  }
+  for (int i = 0; i < TAIL_CACHE; ++i)
+  {
+    if (tailCache[i] == bid) { tailCache[i] = 0; }
+  }
+  FreeBlock(bid);
+}
+
+// Enter a command: nothing reachable from the file system now is freed
+// before the matching ReadEnd.
+void ReadBegin()
+{
+  if (readerSlot == -1)
+  {
+    for (int i = 0; i < MAX_THREADS && readerSlot == -1; ++i)
+    {
+      if (!__atomic_exchange_n(&readers[i].used, 1, __ATOMIC_ACQ_REL)) { readerSlot = i; }
+    }
+    assert(readerSlot != -1);
+  }
+  __atomic_store_n(&readers[readerSlot].epoch, __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ReadEnd()
+{
+  if (readerSlot == -1) { return; }
+  __atomic_store_n(&readers[readerSlot].epoch, 0, __ATOMIC_RELEASE);
+  // whatever this command retired is unreachable now, so commands that start
+  // from the next epoch on cannot see it
+  if (retiring)
+  {
+    __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    retiring = 0;
+  }
+}
+
+// give the reader slot back before a thread exits
+void ReadDone()
+{
+  ReadEnd();
+  if (readerSlot != -1)
+  {
+    __atomic_store_n(&readers[readerSlot].used, 0, __ATOMIC_RELEASE);
+    readerSlot = -1;
+  }
+}
+
+// Hand a block or inode that is no longer reachable to reclamation. Readers
+// that started before may still be using it.
+void Retire(uint32_t id, int inode)
+{
+  pthread_mutex_lock(&allocLock);
+  if (nretired == retiredCap)
+  {
+    retiredCap = retiredCap ? retiredCap * 2 : 256;
+    retired = realloc(retired, retiredCap * sizeof(*retired));
+    assert(retired);
+  }
+  retired[nretired].epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  retired[nretired].id = id;
+  retired[nretired].inode = inode;
+  ++nretired;
+  pthread_mutex_unlock(&allocLock);
+  retiring = 1;
+}
+
+void Erase(int nid);
+
+void CommandBegin()
+{
+  if (!commandHeld)
+  {
+    FlushThrottle();
+    pthread_rwlock_rdlock(&commandLock);
+  }
+  commandHeld = 1;
+}
+
+void CommandEnd()
+{
+  if (commandHeld) { pthread_rwlock_unlock(&commandLock); }
+  commandHeld = 0;
+}
+
+// when the oldest command still running started, UINT64_MAX if none is
+uint64_t OldestReader()
+{
+  uint64_t oldest = UINT64_MAX;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < MAX_THREADS; ++i)
+  {
+    uint64_t e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (e && e < oldest) { oldest = e; }
+  }
+  return oldest;
+}
+
+// free everything retired before epoch oldest
+void ReclaimBefore(uint64_t oldest)
+{
+  pthread_mutex_lock(&allocLock);
+  uint64_t t = SpanStart();
+  size_t keep = 0;
+  for (size_t i = 0; i < nretired; ++i)
+  {
+    if (retired[i].epoch < oldest)
+    {
+      if (retired[i].inode)
+      {
+        Erase(retired[i].id);
+        FreeInode(retired[i].id);
+      }
+      else
+      {
+        FreeBlock(retired[i].id);
+      }
+    }
+    else
+    {
+      retired[keep++] = retired[i];
+    }
+  }
+  SpanStop("reclaim", keep < nretired ? t : 0);
+  nretired = keep;
+  pthread_mutex_unlock(&allocLock);
+}
+
+// free everything retired before the oldest command still running started,
+// or everything with force set (no command may be running)
+void ReclaimFrom(int force)
+{
+  ReclaimBefore(force ? UINT64_MAX : OldestReader());
+}
+
+void Reclaim()
+{
+  ReclaimFrom(0);
+}
+
+// striped per-directory writer locks
+void LockDir(int dnid)
+{
+  pthread_mutex_lock(&dirLocks[dnid % DIR_LOCKS]);
+}
+
+void UnlockDir(int dnid)
+{
+  pthread_mutex_unlock(&dirLocks[dnid % DIR_LOCKS]);
+}
+
+// lock two directories, in stripe order so two threads cannot deadlock
+void LockDirs(int a, int b)
+{
+  int x = a % DIR_LOCKS, y = b % DIR_LOCKS;
+  if (x == y) { LockDir(a); return; }
+  pthread_mutex_lock(&dirLocks[x < y ? x : y]);
+  pthread_mutex_lock(&dirLocks[x < y ? y : x]);
+}
+
+void UnlockDirs(int a, int b)
+{
+  UnlockDir(a);
+  if (a % DIR_LOCKS != b % DIR_LOCKS) { UnlockDir(b); }
+}
+
+#define MAX_SPLIT_THREADS 64
+#define MIN_SPLIT         64        // items not worth a thread of their own
+
+typedef void (*Range_Fn)(void *ctx, uint64_t lo, uint64_t hi);
+
+struct Split_Job {
+  Range_Fn fn;
+  void    *ctx;
+  uint64_t lo;
+  uint64_t hi;
+};
+
+void *SplitRun(void *arg)
+{
+  struct Split_Job *job = arg;
+  job->fn(job->ctx, job->lo, job->hi);
+  return NULL;
+}
+
+// run fn over [0, count) cut into one range per CPU, the caller taking the first
+void ParallelFor(uint64_t count, Range_Fn fn, void *ctx)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > MAX_SPLIT_THREADS) { n = MAX_SPLIT_THREADS; }
+  if ((uint64_t) n > count / MIN_SPLIT) { n = count / MIN_SPLIT; }
+  if (n < 1) { n = 1; }
+  struct Split_Job jobs[MAX_SPLIT_THREADS];
+  pthread_t tid[MAX_SPLIT_THREADS];
+  for (long i = 0; i < n; ++i)
+  {
+    jobs[i].fn = fn;
+    jobs[i].ctx = ctx;
+    jobs[i].lo = count * i / n;
+    jobs[i].hi = count * ( i + 1 ) / n;
+    tid[i] = 0;
+    if (i > 0 && pthread_create(&tid[i], NULL, SplitRun, &jobs[i]) != 0)
+    {
+      SplitRun(&jobs[i]);
+      tid[i] = 0;
+    }
+  }
+  SplitRun(&jobs[0]);
+  for (long i = 1; i < n; ++i)
+  {
+    if (tid[i]) { pthread_join(tid[i], NULL); }
+  }
+}
+
+// number of indirect blocks needed to map n data blocks
+uint64_t IndirectBlocks(uint64_t n)
+{
+  uint64_t count = 0;
+  uint64_t span = 1; // data blocks covered by one pointer at this level
+  if (n <= DIRECT_NUM) { return 0; }
+  n -= DIRECT_NUM;
+  for (int level = 0; level < 3 && n > 0; ++level)
+  {
+    uint64_t cover = span * PTRS_PER_BLOCK; // covered by this level's top block
+    uint64_t used = n < cover ? n : cover;
+    // one pointer block per `span` data blocks at each layer below the top
+    for (uint64_t s = span; s > 1; s /= PTRS_PER_BLOCK)
+    {
+      count += ( used + s - 1 ) / s;
+    }
+    count += 1;
+    n -= used;
+    span = cover;
+  }
+  return count;
+}
+
+// Map block `index` of a file to the slot holding its block number.
+// With alloc set, missing indirect blocks are created on the way down,
+// otherwise NULL is returned for a hole.
+uint32_t *BlockSlot(int nid, uint64_t index, int alloc)
+{
+  struct Inode *inode = &inodes[nid];
+  if (index < DIRECT_NUM)
+  {
+    return &inode->direct[index];
+  }
+  index -= DIRECT_NUM;
+
+  uint64_t span = 1;
+  for (int level = 0; level < 3; ++level)
+  {
+    span *= PTRS_PER_BLOCK;
+    if (index >= span)
+    {
+      index -= span;
+      continue;
+    }
+    // walk down level + 1 pointer blocks
+    uint32_t *slot = &inode->indirect[level];
+    for (uint64_t s = span / PTRS_PER_BLOCK; ; s /= PTRS_PER_BLOCK)
+    {
+      if (*slot == 0)
+      {
+        if (!alloc) { return NULL; }
+        int bid = AllocBlock();
+        if (bid == -1) { return NULL; }
+        memset(blocks[bid], 0, BLOCK_SIZE);
+        *slot = bid;
+      }
+      uint32_t *table = (uint32_t *) blocks[*slot];
+      slot = &table[ index / s ];
+      index %= s;
+      if (s == 1) { return slot; }
+    }
+  }
+  return NULL; // beyond the triple indirect range
+}
+
+// block number holding block `index` of a file, 0 for a hole
+uint32_t BlockOf(int nid, uint64_t index)
+{
+  uint32_t *slot = BlockSlot(nid, index, 0);
+  return slot ? *slot : 0;
+}
+
+// Number of adjacent blocks, at most up to block `end`, holding the file from
+// block `index` on; the first is stored in *bid. A hole is a run of one.
+uint64_t RunOf(int nid, uint64_t index, uint64_t end, uint32_t *bid)
+{
+  *bid = BlockOf(nid, index);
+  uint64_t k = 1;
+  while (*bid && index + k < end && BlockOf(nid, index + k) == *bid + k) { ++k; }
+  return k;
+}
+
+// Blocks of a file mapped by its pointers: all of them, unless the end of
+// the file is inline or in a tail block.
+uint64_t MappedBlocks(int nid)
+{
+  struct Inode *inode = &inodes[nid];
+  if (inode->flags & INODE_INLINE) { return 0; }
+  if (inode->tail) { return inode->size / BLOCK_SIZE; }
+  return ( inode->size + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+}
+
+// blocks reserve mapped past the end of a file, none if the file is in its
+// inode, where its bytes take the place of the count
+uint32_t ReservedOf(int nid)
+{
+  return inodes[nid].flags & INODE_INLINE ? 0 : inodes[nid].reserved;
+}
+
+// the bytes of a file past its mapped blocks, NULL if there are none
+const uint8_t *FileEnd(int nid)
+{
+  struct Inode *inode = &inodes[nid];
+  if (inode->flags & INODE_INLINE) { return inode->data; }
+  if (inode->tail) { return blocks[inode->tail] + inode->tail_unit * TAIL_UNIT; }
+  return NULL;
+}
+
+// free a pointer block and everything below it, callers hold allocLock
+void FreeIndirect(uint32_t bid, int level)
+{
+  if (bid == 0) { return; }
+  if (level > 0)
+  {
+    uint32_t *table = (uint32_t *) blocks[bid];
+    for (uint32_t i = 0; i < PTRS_PER_BLOCK; ++i)
+    {
+      if (table[i]) { FreeIndirect(table[i], level - 1); }
+    }
+  }
+  FreeBlock(bid);
+}
+
+// release all blocks under an inode id, callers hold allocLock
+void Erase(int nid)
+{
+  if (inodes[nid].flags & INODE_INLINE)
+  {
+    memset(inodes[nid].data, 0, INLINE_MAX);
+    inodes[nid].flags &= ~INODE_INLINE;
+  }
+  else if (inodes[nid].tail)
+  {
+    FreeTail(inodes[nid].tail, inodes[nid].tail_unit, inodes[nid].size % BLOCK_SIZE);
+    inodes[nid].tail = 0;
+    inodes[nid].tail_unit = 0;
+  }
+  inodes[nid].size = 0;
+  for (int i = 0; i < DIRECT_NUM; ++i)
+  {
+    if (inodes[nid].direct[i]) { FreeBlock( inodes[nid].direct[i] ); }
+    inodes[nid].direct[i] = 0;
+  }
+  for (int level = 0; level < 3; ++level)
+  {
+    FreeIndirect(inodes[nid].indirect[level], level + 1);
+    inodes[nid].indirect[level] = 0;
+  }
+}
+
+// kinds of blocks an inode can point to
+#define BLOCK_DATA     0
+#define BLOCK_INDIRECT 1            // level: pointer levels below it, 1 = it points at data
+#define BLOCK_NODE     2            // level: depth in the directory tree, root = 0
+#define BLOCK_TAIL     3            // shared with other files, level: first unit of this one
+
+// Called with each slot holding a block number of an inode. Returns 0 to go
+// on, 1 to skip what is below a pointer block or node, -1 to stop the walk.
+typedef int (*Block_Visitor)(void *ctx, int nid, uint32_t *slot, int kind, int level);
+
+int VisitIndirect(int nid, uint32_t *slot, int level, Block_Visitor fn, void *ctx)
+{
+  int r = fn(ctx, nid, slot, BLOCK_INDIRECT, level);
+  if (r) { return r < 0 ? -1 : 0; }
+  uint32_t *table = (uint32_t *) blocks[*slot];
+  for (uint32_t i = 0; i < PTRS_PER_BLOCK; ++i)
+  {
+    if (!table[i]) { continue; }
+    r = level == 1 ? fn(ctx, nid, &table[i], BLOCK_DATA, 0) : VisitIndirect(nid, &table[i], level - 1, fn, ctx);
+    if (r < 0) { return -1; }
+  }
+  return 0;
+}
+
+int VisitNode(int nid, uint32_t *slot, int depth, Block_Visitor fn, void *ctx)
+{
+  int r = fn(ctx, nid, slot, BLOCK_NODE, depth);
+  if (r) { return r < 0 ? -1 : 0; }
+  struct BTree_Node *node = (struct BTree_Node *) blocks[*slot];
+  for (int i = 0; !node->leaf && i <= node->count; ++i)
+  {
+    uint32_t *child = i == 0 ? &node->child : &node->inode[i-1];
+    if (VisitNode(nid, child, depth + 1, fn, ctx) < 0) { return -1; }
+  }
+  return 0;
+}
+
+// the block a slot is in, 0 for the slots of an inode, which are metadata
+uint32_t SlotBlock(const uint32_t *slot)
+{
+  size_t off = (const uint8_t *) slot - blocks[0];
+  return off < (size_t) super->data_start * BLOCK_SIZE ? 0 : off / BLOCK_SIZE;
+}
+
+// Walk every block an inode owns, pointer blocks and directory nodes before
+// what they point to. -1 if the visitor stopped the walk.
+int VisitBlocks(int nid, Block_Visitor fn, void *ctx)
+{
+  struct Inode *inode = &inodes[nid];
+  if (inode->type == INODE_DIR)
+  {
+    return inode->direct[0] ? VisitNode(nid, &inode->direct[0], 0, fn, ctx) : 0;
+  }
+  if (inode->flags & INODE_INLINE) { return 0; }
+  if (inode->tail && fn(ctx, nid, &inode->tail, BLOCK_TAIL, inode->tail_unit) < 0) { return -1; }
+  for (int i = 0; i < DIRECT_NUM; ++i)
+  {
+    if (inode->direct[i] && fn(ctx, nid, &inode->direct[i], BLOCK_DATA, 0) < 0) { return -1; }
+  }
+  for (int level = 0; level < 3; ++level)
+  {
+    if (inode->indirect[level] && VisitIndirect(nid, &inode->indirect[level], level + 1, fn, ctx) < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Directory B+ tree
+//
+// Lookups descend from the root held in the directory inode, so resolving a
+// name costs O(log n) block visits. Nodes are kept at least half full.
+// A published node is never written again: updates work on copies and swap
+// the root when they are done, so a reader that loaded the root sees one
+// consistent version of the directory for as long as it likes.
+
+struct BTree_Node *Node(uint32_t bid)
+{
+  return (struct BTree_Node *) blocks[bid];
+}
+
+void InitNode(uint32_t bid, int leaf)
+{
+  struct BTree_Node *node = Node(bid);
+  memset(node, 0, BTREE_HEAP_START);
+  node->leaf = leaf;
+  node->heap = BLOCK_SIZE;
+}
+
+uint32_t NameHash(const char *name, int len)
+{
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < len; ++i)
+  {
+    h = ( h ^ (uint8_t) name[i] ) * 16777619u;
+  }
+  return h;
+}
+
+// keys are compared as byte strings, shorter first on a common prefix
+int KeyCmp(const char *a, int la, const char *b, int lb)
+{
+  int c = memcmp(a, b, la < lb ? la : lb);
+  return c ? c : la - lb;
+}
+
+const char *NodeName(struct BTree_Node *node, int i)
+{
+  return (const char *) node + node->off[i];
+}
+
+// child pointer left of key i (i == count is the rightmost child)
+uint32_t ChildAt(struct BTree_Node *node, int i)
+{
+  return i == 0 ? node->child : node->inode[i-1];
+}
+
+void SetChildAt(struct BTree_Node *node, int i, uint32_t bid)
+{
+  if (i == 0) { node->child = bid; }
+  else { node->inode[i-1] = bid; }
+}
+
+// the current version of a directory
+uint32_t Root(int dnid)
+{
+  return __atomic_load_n(&inodes[dnid].direct[0], __ATOMIC_ACQUIRE);
+}
+
+// make a new version of a directory visible, its nodes are written already
+void Publish(int dnid, uint32_t root)
+{
+  __atomic_store_n(&inodes[dnid].direct[0], root, __ATOMIC_RELEASE);
+}
+
+// index of the first key >= name, `found` is set if it is equal
+int LowerBound(struct BTree_Node *node, const char *name, int len, int *found)
+{
+  int lo = 0, hi = node->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (KeyCmp(NodeName(node, mid), node->len[mid], name, len) < 0) { lo = mid + 1; }
+    else { hi = mid; }
+  }
+  *found = lo < node->count && KeyCmp(NodeName(node, lo), node->len[lo], name, len) == 0;
+  return lo;
+}
+
+// number of keys <= name, i.e. the child index to descend into
+int UpperBound(struct BTree_Node *node, const char *name, int len)
+{
+  int lo = 0, hi = node->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (KeyCmp(NodeName(node, mid), node->len[mid], name, len) <= 0) { lo = mid + 1; }
+    else { hi = mid; }
+  }
+  return lo;
+}
+
+// exact match in a leaf by comparing BTREE_LANES hashes per step
+int LeafFind(struct BTree_Node *node, const char *name, int len, uint32_t hash)
+{
+#ifdef __SSE2__
+  __m128i h = _mm_set1_epi32(hash);
+#endif
+  for (int i = 0; i < node->count; i += BTREE_LANES)
+  {
+#ifdef __SSE2__
+    __m128i a = _mm_loadu_si128((const __m128i *) &node->hash[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &node->hash[i+4]);
+    unsigned mask = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(a, h) ) )
+                  | _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(b, h) ) ) << 4;
+#else
+    unsigned mask = 0;
+    for (int j = 0; j < BTREE_LANES; ++j)
+    {
+      mask |= (unsigned) ( node->hash[i+j] == hash ) << j;
+    }
+#endif
+    while (mask)
+    {
+      int k = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (k < node->count && node->len[k] == len && memcmp(NodeName(node, k), name, len) == 0)
+      {
+        return k;
+      }
+    }
+  }
+  return -1;
+}
+
+void NodeGet(struct BTree_Node *node, int i, struct Directory_Entry *e)
+{
+  e->hash = node->hash[i];
+  e->inode = node->inode[i];
+  e->time = node->time[i];
+  e->len = node->len[i];
+  memcpy(e->name, NodeName(node, i), e->len);
+  e->name[e->len] = 0;
+}
+
+// rewrite a node from a list of entries, which also compacts the heap
+void NodeFill(struct BTree_Node *node, const struct Directory_Entry *e, int n)
+{
+  node->count = 0;
+  node->heap = BLOCK_SIZE;
+  node->garbage = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    node->heap -= e[i].len + 1;
+    memcpy((char *) node + node->heap, e[i].name, e[i].len + 1);
+    node->hash[i] = e[i].hash;
+    node->inode[i] = e[i].inode;
+    node->time[i] = e[i].time;
+    node->off[i] = node->heap;
+    node->len[i] = e[i].len;
+  }
+  node->count = n;
+}
+
+// insert e at position i, -1 if the node has no room for it
+int NodeInsertAt(struct BTree_Node *node, int i, const struct Directory_Entry *e)
+{
+  int need = e->len + 1;
+  if (node->count == BTREE_SLOTS || node->heap - BTREE_HEAP_START + node->garbage < need)
+  {
+    return -1;
+  }
+  if (node->heap - BTREE_HEAP_START < need) // only fragmented space left
+  {
+    struct Directory_Entry tmp[BTREE_SLOTS];
+    for (int k = 0; k < node->count; ++k) { NodeGet(node, k, &tmp[k]); }
+    NodeFill(node, tmp, node->count);
+  }
+  int move = node->count - i;
+  memmove(&node->hash[i+1], &node->hash[i], move * sizeof(node->hash[0]));
+  memmove(&node->inode[i+1], &node->inode[i], move * sizeof(node->inode[0]));
+  memmove(&node->time[i+1], &node->time[i], move * sizeof(node->time[0]));
+  memmove(&node->off[i+1], &node->off[i], move * sizeof(node->off[0]));
+  memmove(&node->len[i+1], &node->len[i], move * sizeof(node->len[0]));
+  node->heap -= need;
+  memcpy((char *) node + node->heap, e->name, e->len);
+  ((char *) node)[node->heap + e->len] = 0;
+  node->hash[i] = e->hash;
+  node->inode[i] = e->inode;
+  node->time[i] = e->time;
+  node->off[i] = node->heap;
+  node->len[i] = e->len;
+  ++node->count;
+  return 0;
+}
+
+void NodeRemoveAt(struct BTree_Node *node, int i)
+{
+  node->garbage += node->len[i] + 1;
+  int move = node->count - i - 1;
+  memmove(&node->hash[i], &node->hash[i+1], move * sizeof(node->hash[0]));
+  memmove(&node->inode[i], &node->inode[i+1], move * sizeof(node->inode[0]));
+  memmove(&node->time[i], &node->time[i+1], move * sizeof(node->time[0]));
+  memmove(&node->off[i], &node->off[i+1], move * sizeof(node->off[0]));
+  memmove(&node->len[i], &node->len[i+1], move * sizeof(node->len[0]));
+  --node->count;
+}
+
+// live name bytes in a node
+int NodeBytes(struct BTree_Node *node)
+{
+  return BLOCK_SIZE - node->heap - node->garbage;
+}
+
+// a node is under half full when both its slots and its heap are
+int NodeUnderflow(struct BTree_Node *node)
+{
+  return node->count * 2 < BTREE_SLOTS && NodeBytes(node) * 2 < (int) BTREE_HEAP_SIZE;
+}
+
+// Pick where to cut n entries in two so that the fuller half, counting both
+// slots and heap bytes, is as empty as possible. Internal nodes lose the key
+// at the cut to the parent.
+int SplitPoint(const struct Directory_Entry *e, int n, int leaf)
+{
+  int total = 0;
+  for (int i = 0; i < n; ++i) { total += e[i].len + 1; }
+  int best = n / 2;
+  int64_t bestLoad = INT64_MAX;
+  int bytes = 0; // bytes left of i
+  for (int i = 1; i < n - !leaf; ++i)
+  {
+    bytes += e[i-1].len + 1;
+    int rcount = n - i - !leaf;
+    int rbytes = total - bytes - ( leaf ? 0 : e[i].len + 1 );
+    // compare count/SLOTS against bytes/HEAP_SIZE without dividing
+    int64_t l = (int64_t) i * BTREE_HEAP_SIZE > (int64_t) bytes * BTREE_SLOTS ?
+                (int64_t) i * BTREE_HEAP_SIZE : (int64_t) bytes * BTREE_SLOTS;
+    int64_t r = (int64_t) rcount * BTREE_HEAP_SIZE > (int64_t) rbytes * BTREE_SLOTS ?
+                (int64_t) rcount * BTREE_HEAP_SIZE : (int64_t) rbytes * BTREE_SLOTS;
+    int64_t load = l > r ? l : r;
+    if (load < bestLoad) { bestLoad = load; best = i; }
+  }
+  return best;
+}
+
+// find the leaf and slot of the entry called name in directory dnid
+struct BTree_Node *BTreeLookup(int dnid, const char *name, int *slot)
+{
+  int len = strlen(name);
+  struct BTree_Node *node = Node(Root(dnid));
+  while (!node->leaf)
+  {
+    node = Node( ChildAt(node, UpperBound(node, name, len)) );
+  }
+  *slot = LeafFind(node, name, len, NameHash(name, len));
+  return *slot == -1 ? NULL : node;
+}
+
+// An in-order scan of one version of a directory. The path down to the
+// current leaf is kept so the scan can climb to the next one.
+struct BTree_Cursor {
+  uint32_t path[BTREE_MAX_DEPTH];
+  int      slot[BTREE_MAX_DEPTH];   // child taken at path[d]
+  int      depth;                   // of the leaf
+  struct BTree_Node *leaf;
+  int      i;                       // current entry of the leaf
+};
+
+// go down the leftmost children from node bid at depth d
+void CursorDescend(struct BTree_Cursor *c, uint32_t bid, int d)
+{
+  while (!Node(bid)->leaf)
+  {
+    c->path[d] = bid;
+    c->slot[d] = 0;
+    bid = Node(bid)->child;
+    ++d;
+  }
+  c->depth = d;
+  c->leaf = Node(bid);
+  c->i = 0;
+}
+
+// position c on the first entry of a directory, 0 if it is empty
+int CursorFirst(struct BTree_Cursor *c, int dnid)
+{
+  CursorDescend(c, Root(dnid), 0);
+  return c->leaf->count > 0;
+}
+
+int CursorNext(struct BTree_Cursor *c);
+
+// position c on the first entry of a directory not below name, 0 if there
+// is none, so a scan from there meets the names starting with it first
+int CursorSeek(struct BTree_Cursor *c, int dnid, const char *name, int len)
+{
+  uint32_t bid = Root(dnid);
+  int d = 0;
+  for ( ; !Node(bid)->leaf; ++d)
+  {
+    c->path[d] = bid;
+    c->slot[d] = UpperBound(Node(bid), name, len);
+    bid = ChildAt(Node(bid), c->slot[d]);
+  }
+  c->depth = d;
+  c->leaf = Node(bid);
+  int lo = 0, hi = c->leaf->count;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (KeyCmp(NodeName(c->leaf, mid), c->leaf->len[mid], name, len) < 0) { lo = mid + 1; }
+    else { hi = mid; }
+  }
+  c->i = lo - 1;
+  return CursorNext(c);             // on to the next leaf if all of this one is below
+}
+
+// step to the next entry, 0 past the last one
+int CursorNext(struct BTree_Cursor *c)
+{
+  if (++c->i < c->leaf->count)
+  {
+    return 1;
+  }
+  // only a root leaf can be empty, so the next leaf has an entry
+  for (int d = c->depth - 1; d >= 0; --d)
+  {
+    struct BTree_Node *node = Node(c->path[d]);
+    if (c->slot[d] < node->count)
+    {
+      ++c->slot[d];
+      CursorDescend(c, ChildAt(node, c->slot[d]), d + 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// blocks an update of dnid may take: a copy of its path, plus a split or a
+// sibling copy at every level and a new root
+uint64_t TreeBlocks(int dnid)
+{
+  int height = 1;
+  for (uint32_t bid = Root(dnid); !Node(bid)->leaf; bid = Node(bid)->child) { ++height; }
+  return 3 * height + 1;
+}
+
+// copy a published node so an update can change it, the original is retired
+uint32_t CowNode(uint32_t bid)
+{
+  uint32_t nbid = AllocBlock(); // reserved by the update
+  memcpy(blocks[nbid], blocks[bid], BLOCK_SIZE);
+  Retire(bid, 0);
+  return nbid;
+}
+
+// Copy the path from the root of dnid down to the leaf where name belongs,
+// returning the leaf copy. path[0..depth-1] receive the copied ancestors,
+// slot[d] the child taken at path[d].
+uint32_t CowPath(int dnid, const char *name, int len, uint32_t *path, int *slot, int *depth)
+{
+  uint32_t bid = CowNode(Root(dnid));
+  *depth = 0;
+  while (!Node(bid)->leaf)
+  {
+    path[*depth] = bid;
+    slot[*depth] = UpperBound(Node(bid), name, len);
+    uint32_t child = CowNode( ChildAt(Node(bid), slot[*depth]) );
+    SetChildAt(Node(bid), slot[*depth], child);
+    bid = child;
+    ++*depth;
+  }
+  return bid;
+}
+
+// Insert e at position pos of node bid, whose ancestors are path[0..depth-1]
+// (slot[d] being the child taken at path[d]). For internal nodes `right` is
+// the child to the right of e. Full nodes split and push a key to the parent.
+// All of these nodes are copies private to the update, *root is its root.
+void InsertAt(uint32_t *root, uint32_t *path, int *slot, int depth, uint32_t bid, int pos,
+              struct Directory_Entry up, uint32_t right, int leaf)
+{
+  for (;;)
+  {
+    struct BTree_Node *node = Node(bid);
+    if (!leaf) { up.inode = right; }
+    if (NodeInsertAt(node, pos, &up) == 0)
+    {
+      return;
+    }
+
+    // full: unpack with the new entry in place, then split in two
+    struct Directory_Entry tmp[BTREE_SLOTS + 1];
+    for (int i = 0; i < node->count; ++i) { NodeGet(node, i, &tmp[i < pos ? i : i + 1]); }
+    tmp[pos] = up;
+    int total = node->count + 1;
+    int mid = SplitPoint(tmp, total, leaf);
+
+    uint32_t nbid = AllocBlock();
+    InitNode(nbid, leaf);
+    struct BTree_Node *sibling = Node(nbid);
+    NodeFill(node, tmp, mid);
+    if (leaf)
+    {
+      // leaves keep every entry, the separator is a copy of the right's first key
+      NodeFill(sibling, &tmp[mid], total - mid);
+    }
+    else
+    {
+      // internal nodes push the middle key up, its child becomes the leftmost
+      sibling->child = tmp[mid].inode;
+      NodeFill(sibling, &tmp[mid+1], total - mid - 1);
+    }
+    up = tmp[mid];
+    right = nbid;
+    leaf = 0;
+
+    if (depth == 0) // root split, grow the tree by one level
+    {
+      uint32_t rbid = AllocBlock();
+      InitNode(rbid, 0);
+      Node(rbid)->child = bid;
+      up.inode = right;
+      NodeInsertAt(Node(rbid), 0, &up);
+      *root = rbid;
+      return;
+    }
+    --depth;
+    bid = path[depth];
+    pos = slot[depth];
+  }
+}
+
+// insert an entry, return -1 if the name exists or the tree cannot grow
+// callers hold the directory's lock
+int BTreeInsert(int dnid, const char *name, uint32_t nid, int64_t time)
+{
+  struct Directory_Entry e;
+  e.len = strlen(name);
+  memcpy(e.name, name, e.len + 1);
+  e.hash = NameHash(name, e.len);
+  e.inode = nid;
+  e.time = time;
+
+  int i;
+  if ( BTreeLookup(dnid, name, &i) || ReserveBlocks(TreeBlocks(dnid)) == -1 )
+  {
+    return -1;
+  }
+
+  uint32_t path[BTREE_MAX_DEPTH];
+  int      slot[BTREE_MAX_DEPTH];
+  int      depth;
+  uint32_t bid = CowPath(dnid, e.name, e.len, path, slot, &depth);
+  uint32_t root = depth ? path[0] : bid;
+
+  int found;
+  int pos = LowerBound(Node(bid), e.name, e.len, &found);
+  InsertAt(&root, path, slot, depth, bid, pos, e, 0, 1);
+  Publish(dnid, root);
+  Unreserve();
+  return 0;
+}
+
+// point the entry called name at another inode, -1 if there is none
+// callers hold the directory's lock
+int BTreeReplace(int dnid, const char *name, uint32_t nid, int64_t time)
+{
+  int len = strlen(name);
+  int i;
+  if ( !BTreeLookup(dnid, name, &i) || ReserveBlocks(TreeBlocks(dnid)) == -1 )
+  {
+    return -1;
+  }
+
+  uint32_t path[BTREE_MAX_DEPTH];
+  int      slot[BTREE_MAX_DEPTH];
+  int      depth;
+  uint32_t bid = CowPath(dnid, name, len, path, slot, &depth);
+  struct BTree_Node *leaf = Node(bid);
+  i = LeafFind(leaf, name, len, NameHash(name, len));
+  leaf->inode[i] = nid;
+  leaf->time[i] = time;
+  Publish(dnid, depth ? path[0] : bid);
+  Unreserve();
+  return 0;
+}
+
+// remove the entry called name, rebalancing on the way up
+// callers hold the directory's lock
+int BTreeDelete(int dnid, const char *name)
+{
+  int len = strlen(name);
+  int i;
+  if ( !BTreeLookup(dnid, name, &i) || ReserveBlocks(TreeBlocks(dnid)) == -1 )
+  {
+    return -1;
+  }
+
+  uint32_t path[BTREE_MAX_DEPTH];
+  int      slot[BTREE_MAX_DEPTH];
+  int      depth;
+  uint32_t bid = CowPath(dnid, name, len, path, slot, &depth);
+  uint32_t root = depth ? path[0] : bid;
+
+  int found;
+  int pos = LowerBound(Node(bid), name, len, &found);
+  struct BTree_Node *node = Node(bid);
+  NodeRemoveAt(node, pos);
+
+  while (depth > 0 && NodeUnderflow(node))
+  {
+    --depth;
+    struct BTree_Node *parent = Node(path[depth]);
+    // s is the separator between the left and right node of the pair
+    int s = slot[depth] > 0 ? slot[depth] - 1 : 0;
+    uint32_t lbid = ChildAt(parent, s);
+    uint32_t rbid = ChildAt(parent, s + 1);
+    struct BTree_Node *l = Node(lbid);
+    struct BTree_Node *r = Node(rbid);
+
+    struct Directory_Entry tmp[2 * BTREE_SLOTS + 1];
+    int total = 0;
+    int bytes = 0;
+    for (int i = 0; i < l->count; ++i) { NodeGet(l, i, &tmp[total++]); }
+    if (!l->leaf)
+    {
+      NodeGet(parent, s, &tmp[total]);
+      tmp[total++].inode = r->child;
+    }
+    for (int i = 0; i < r->count; ++i) { NodeGet(r, i, &tmp[total++]); }
+    for (int i = 0; i < total; ++i) { bytes += tmp[i].len + 1; }
+
+    // the node on the path is a copy already, its sibling is still published
+    int merge = total <= BTREE_SLOTS && bytes <= (int) BTREE_HEAP_SIZE;
+    if (slot[depth] != s)
+    {
+      lbid = CowNode(lbid);
+      SetChildAt(parent, s, lbid);
+      l = Node(lbid);
+    }
+    else if (!merge)
+    {
+      rbid = CowNode(rbid);
+      SetChildAt(parent, s + 1, rbid);
+      r = Node(rbid);
+    }
+
+    if (merge) // merge right into left and drop the separator
+    {
+      NodeFill(l, tmp, total);
+      Retire(rbid, 0);
+      NodeRemoveAt(parent, s);
+      node = parent;
+    }
+    else // borrow: redistribute evenly and replace the separator
+    {
+      int mid = SplitPoint(tmp, total, l->leaf);
+      NodeFill(l, tmp, mid);
+      if (l->leaf)
+      {
+        NodeFill(r, &tmp[mid], total - mid);
+      }
+      else
+      {
+        r->child = tmp[mid].inode;
+        NodeFill(r, &tmp[mid+1], total - mid - 1);
+      }
+      // the new separator may be longer, so it goes in like any insert
+      NodeRemoveAt(parent, s);
+      InsertAt(&root, path, slot, depth, path[depth], s, tmp[mid], rbid, 0);
+      break;
+    }
+  }
+
+  // an internal root left without keys hands over to its only child
+  if (!Node(root)->leaf && Node(root)->count == 0)
+  {
+    Retire(root, 0);
+    root = Node(root)->child;
+  }
+  Publish(dnid, root);
+  Unreserve();
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Encryption at rest
+//
+// An encrypted image keeps its super block readable and stores every other
+// block encrypted with AES-256-XTS, the block number being the tweak. The
+// keys are derived from a passphrase with PBKDF2-HMAC-SHA256 when the image
+// is opened; the block store in memory holds plain data, so blocks are
+// decrypted as they are loaded and encrypted as they are written back.
+// Blocks are spread over one thread per CPU and encrypted 16 (VAES) or 8
+// (AES-NI) AES blocks at a time, with a portable fallback for other CPUs.
+
+#define KDF_ROUNDS        200000
+#define AES_ROUNDS        14            // AES-256
+#define AES_PER_BLOCK     ( BLOCK_SIZE / 16 )
+#define CRYPT_CHUNK       1024          // blocks encrypted per write when saving
+
+struct Sha256 {
+  uint32_t h[8];
+  uint64_t len;                         // bytes hashed
+  uint8_t  buf[64];
+};
+
+struct Aes_Key {
+  uint8_t enc[16 * ( AES_ROUNDS + 1 )];
+  uint8_t dec[16 * ( AES_ROUNDS + 1 )]; // for the equivalent inverse cipher
+};
+
+// Encrypt or decrypt n AES blocks, each whitened with its tweak before and
+// after. rk is the enc or dec schedule of a key.
+typedef void (*Xex_Kernel)(const uint8_t *rk, int decrypt, uint8_t *dst, const uint8_t *src,
+                           const uint8_t *tweaks, size_t n);
+
+struct Image_Key {
+  int            on;                    // the open image is encrypted
+  struct Aes_Key data;
+  struct Aes_Key tweak;
+  Xex_Kernel     xex;
+  int            decSchedule;           // xex decrypts with the dec schedule
+};
+
+struct Image_Key imageKey;
+
+static const uint32_t sha256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+void Sha256Init(struct Sha256 *s)
+{
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(s->h, h0, sizeof(h0));
+  s->len = 0;
+}
+
+void Sha256Block(struct Sha256 *s, const uint8_t *p)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i)
+  {
+    w[i] = (uint32_t) p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 | p[4*i+3];
+  }
+  for (int i = 16; i < 64; ++i)
+  {
+    uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ ( w[i-15] >> 3 );
+    uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ ( w[i-2] >> 10 );
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+  uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+  for (int i = 0; i < 64; ++i)
+  {
+    uint32_t t1 = h + ( ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25) ) + ( ( e & f ) ^ ( ~e & g ) ) + sha256K[i] + w[i];
+    uint32_t t2 = ( ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+  s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void Sha256Update(struct Sha256 *s, const void *data, size_t n)
+{
+  const uint8_t *p = data;
+  while (n > 0)
+  {
+    size_t used = s->len % 64;
+    size_t take = 64 - used < n ? 64 - used : n;
+    memcpy(s->buf + used, p, take);
+    s->len += take;
+    p += take;
+    n -= take;
+    if (s->len % 64 == 0) { Sha256Block(s, s->buf); }
+  }
+}
+
+void Sha256Final(struct Sha256 *s, uint8_t *digest)
+{
+  uint64_t bits = s->len * 8;
+  uint8_t pad[72] = { 0x80 };
+  size_t padLen = ( s->len % 64 < 56 ? 56 : 120 ) - s->len % 64;
+  for (int i = 0; i < 8; ++i) { pad[padLen + i] = bits >> ( 56 - 8 * i ); }
+  Sha256Update(s, pad, padLen + 8);
+  for (int i = 0; i < 32; ++i) { digest[i] = s->h[i/4] >> ( 24 - 8 * ( i % 4 ) ); }
+}
+
+// PBKDF2-HMAC-SHA256, the padded key is hashed once for all rounds
+void Pbkdf2(const char *pass, const uint8_t *salt, size_t saltLen, uint32_t rounds, uint8_t *key, size_t keyLen)
+{
+  uint8_t pad[64] = { 0 };
+  size_t passLen = strlen(pass);
+  if (passLen > 64)
+  {
+    struct Sha256 s;
+    Sha256Init(&s);
+    Sha256Update(&s, pass, passLen);
+    Sha256Final(&s, pad);
+  }
+  else
+  {
+    memcpy(pad, pass, passLen);
+  }
+  struct Sha256 inner, outer;
+  Sha256Init(&inner);
+  Sha256Init(&outer);
+  for (int i = 0; i < 64; ++i) { pad[i] ^= 0x36; }
+  Sha256Update(&inner, pad, 64);
+  for (int i = 0; i < 64; ++i) { pad[i] ^= 0x36 ^ 0x5c; }
+  Sha256Update(&outer, pad, 64);
+
+  for (uint32_t block = 1; keyLen > 0; ++block)
+  {
+    uint8_t u[32], t[32];
+    uint8_t be[4] = { block >> 24, block >> 16, block >> 8, block };
+    struct Sha256 s = inner;
+    Sha256Update(&s, salt, saltLen);
+    Sha256Update(&s, be, 4);
+    Sha256Final(&s, u);
+    s = outer;
+    Sha256Update(&s, u, 32);
+    Sha256Final(&s, u);
+    memcpy(t, u, 32);
+    for (uint32_t r = 1; r < rounds; ++r)
+    {
+      s = inner;
+      Sha256Update(&s, u, 32);
+      Sha256Final(&s, u);
+      s = outer;
+      Sha256Update(&s, u, 32);
+      Sha256Final(&s, u);
+      for (int i = 0; i < 32; ++i) { t[i] ^= u[i]; }
+    }
+    size_t take = keyLen < 32 ? keyLen : 32;
+    memcpy(key, t, take);
+    key += take;
+    keyLen -= take;
+    explicit_bzero(t, sizeof(t));
+    explicit_bzero(u, sizeof(u));
+  }
+  explicit_bzero(pad, sizeof(pad));
+}
+
+uint8_t aesSbox[256];
+uint8_t aesInvSbox[256];
+
+uint8_t Xtime(uint8_t x)
+{
+  return x << 1 ^ ( x & 0x80 ? 0x1b : 0 );
+}
+
+// the S-box from its definition: inverse in GF(2^8), then the affine map
+void AesTables()
+{
+  uint8_t p = 1, q = 1;
+  do
+  {
+    p = p ^ Xtime(p);                   // times 3
+    q ^= q << 1;                        // divided by 3
+    q ^= q << 2;
+    q ^= q << 4;
+    if (q & 0x80) { q ^= 0x09; }
+    uint8_t x = q ^ ( q << 1 | q >> 7 ) ^ ( q << 2 | q >> 6 ) ^ ( q << 3 | q >> 5 ) ^ ( q << 4 | q >> 4 );
+    aesSbox[p] = x ^ 0x63;
+  } while (p != 1);
+  aesSbox[0] = 0x63;
+  for (int i = 0; i < 256; ++i) { aesInvSbox[aesSbox[i]] = i; }
+}
+
+void AesMixColumn(uint8_t *c, int inverse)
+{
+  if (inverse) // InvMixColumns is MixColumns after this
+  {
+    uint8_t u = Xtime(Xtime(c[0] ^ c[2]));
+    uint8_t v = Xtime(Xtime(c[1] ^ c[3]));
+    c[0] ^= u; c[1] ^= v; c[2] ^= u; c[3] ^= v;
+  }
+  uint8_t a[4];
+  memcpy(a, c, 4);
+  for (int i = 0; i < 4; ++i)
+  {
+    c[i] = Xtime(a[i]) ^ Xtime(a[(i+1)%4]) ^ a[(i+1)%4] ^ a[(i+2)%4] ^ a[(i+3)%4];
+  }
+}
+
+void AesExpand(struct Aes_Key *k, const uint8_t *key)
+{
+  if (!aesSbox[0]) { AesTables(); }
+  uint8_t *w = k->enc;
+  uint8_t rcon = 1;
+  memcpy(w, key, 32);
+  for (int i = 8; i < 4 * ( AES_ROUNDS + 1 ); ++i)
+  {
+    uint8_t t[4];
+    memcpy(t, w + 4 * ( i - 1 ), 4);
+    if (i % 8 == 0)
+    {
+      uint8_t t0 = t[0];
+      t[0] = aesSbox[t[1]] ^ rcon;
+      t[1] = aesSbox[t[2]];
+      t[2] = aesSbox[t[3]];
+      t[3] = aesSbox[t0];
+      rcon = Xtime(rcon);
+    }
+    else if (i % 8 == 4)
+    {
+      for (int j = 0; j < 4; ++j) { t[j] = aesSbox[t[j]]; }
+    }
+    for (int j = 0; j < 4; ++j) { w[4*i+j] = w[4*(i-8)+j] ^ t[j]; }
+  }
+  // reversed, with the inner round keys through InvMixColumns
+  for (int r = 0; r <= AES_ROUNDS; ++r)
+  {
+    memcpy(k->dec + 16 * r, k->enc + 16 * ( AES_ROUNDS - r ), 16);
+    for (int c = 0; r > 0 && r < AES_ROUNDS && c < 4; ++c) { AesMixColumn(k->dec + 16 * r + 4 * c, 1); }
+  }
+}
+
+// one block with the plain definition of the cipher, s in place
+void AesBlockSoft(const uint8_t *enc, int decrypt, uint8_t *s)
+{
+  uint8_t t[16];
+  for (int i = 0; i < 16; ++i) { s[i] ^= enc[ decrypt ? 16 * AES_ROUNDS + i : i ]; }
+  for (int r = 1; r <= AES_ROUNDS; ++r)
+  {
+    int round = decrypt ? AES_ROUNDS - r : r;
+    // shift rows (byte i is row i % 4 of column i / 4) and substitute
+    for (int i = 0; i < 16; ++i)
+    {
+      int row = i % 4;
+      int col = decrypt ? ( i / 4 + row ) % 4 : ( i / 4 + 4 - row ) % 4;
+      t[ col * 4 + row ] = decrypt ? aesInvSbox[s[i]] : aesSbox[s[i]];
+    }
+    memcpy(s, t, 16);
+    if (!decrypt && r < AES_ROUNDS)
+    {
+      for (int c = 0; c < 4; ++c) { AesMixColumn(s + 4 * c, 0); }
+    }
+    for (int i = 0; i < 16; ++i) { s[i] ^= enc[16 * round + i]; }
+    if (decrypt && r < AES_ROUNDS)
+    {
+      for (int c = 0; c < 4; ++c) { AesMixColumn(s + 4 * c, 1); }
+    }
+  }
+}
+
+// the fallback kernel wants the enc schedule for both directions
+void XexSoft(const uint8_t *rk, int decrypt, uint8_t *dst, const uint8_t *src, const uint8_t *tweaks, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    uint8_t s[16];
+    for (int j = 0; j < 16; ++j) { s[j] = src[16*i+j] ^ tweaks[16*i+j]; }
+    AesBlockSoft(rk, decrypt, s);
+    for (int j = 0; j < 16; ++j) { dst[16*i+j] = s[j] ^ tweaks[16*i+j]; }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XEX_NI_LANES 8
+
+__attribute__((target("aes,sse2")))
+static inline __m128i AesNi1(const __m128i *k, int decrypt, __m128i x)
+{
+  for (int r = 1; r < AES_ROUNDS; ++r) { x = decrypt ? _mm_aesdec_si128(x, k[r]) : _mm_aesenc_si128(x, k[r]); }
+  return decrypt ? _mm_aesdeclast_si128(x, k[AES_ROUNDS]) : _mm_aesenclast_si128(x, k[AES_ROUNDS]);
+}
+
+__attribute__((target("aes,sse2")))
+void XexNi(const uint8_t *rk, int decrypt, uint8_t *dst, const uint8_t *src, const uint8_t *tweaks, size_t n)
+{
+  __m128i k[AES_ROUNDS + 1];
+  for (int r = 0; r <= AES_ROUNDS; ++r) { k[r] = _mm_loadu_si128((const __m128i *) ( rk + 16 * r )); }
+  const __m128i *in = (const __m128i *) src;
+  const __m128i *tw = (const __m128i *) tweaks;
+  __m128i *to = (__m128i *) dst;
+  size_t i = 0;
+  // independent blocks keep the AES unit busy while each round waits on the last
+  for (; i + XEX_NI_LANES <= n; i += XEX_NI_LANES)
+  {
+    __m128i x[XEX_NI_LANES];
+    for (int j = 0; j < XEX_NI_LANES; ++j)
+    {
+      x[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(in + i + j), _mm_loadu_si128(tw + i + j)), k[0]);
+    }
+    if (decrypt)
+    {
+      for (int r = 1; r < AES_ROUNDS; ++r)
+      {
+        for (int j = 0; j < XEX_NI_LANES; ++j) { x[j] = _mm_aesdec_si128(x[j], k[r]); }
+      }
+      for (int j = 0; j < XEX_NI_LANES; ++j) { x[j] = _mm_aesdeclast_si128(x[j], k[AES_ROUNDS]); }
+    }
+    else
+    {
+      for (int r = 1; r < AES_ROUNDS; ++r)
+      {
+        for (int j = 0; j < XEX_NI_LANES; ++j) { x[j] = _mm_aesenc_si128(x[j], k[r]); }
+      }
+      for (int j = 0; j < XEX_NI_LANES; ++j) { x[j] = _mm_aesenclast_si128(x[j], k[AES_ROUNDS]); }
+    }
+    for (int j = 0; j < XEX_NI_LANES; ++j)
+    {
+      _mm_storeu_si128(to + i + j, _mm_xor_si128(x[j], _mm_loadu_si128(tw + i + j)));
+    }
+  }
+  for (; i < n; ++i)
+  {
+    __m128i t = _mm_loadu_si128(tw + i);
+    __m128i x = AesNi1(k, decrypt, _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(in + i), t), k[0]));
+    _mm_storeu_si128(to + i, _mm_xor_si128(x, t));
+  }
+}
+
+// four AES blocks per register, four registers at a time
+__attribute__((target("vaes,avx512f,aes,sse2")))
+void XexVaes(const uint8_t *rk, int decrypt, uint8_t *dst, const uint8_t *src, const uint8_t *tweaks, size_t n)
+{
+  __m512i k[AES_ROUNDS + 1];
+  for (int r = 0; r <= AES_ROUNDS; ++r) { k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) ( rk + 16 * r ))); }
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m512i x[4], t[4];
+    for (int j = 0; j < 4; ++j)
+    {
+      t[j] = _mm512_loadu_si512(tweaks + 16 * i + 64 * j);
+      x[j] = _mm512_xor_si512(_mm512_xor_si512(_mm512_loadu_si512(src + 16 * i + 64 * j), t[j]), k[0]);
+    }
+    if (decrypt)
+    {
+      for (int r = 1; r < AES_ROUNDS; ++r)
+      {
+        for (int j = 0; j < 4; ++j) { x[j] = _mm512_aesdec_epi128(x[j], k[r]); }
+      }
+      for (int j = 0; j < 4; ++j) { x[j] = _mm512_aesdeclast_epi128(x[j], k[AES_ROUNDS]); }
+    }
+    else
+    {
+      for (int r = 1; r < AES_ROUNDS; ++r)
+      {
+        for (int j = 0; j < 4; ++j) { x[j] = _mm512_aesenc_epi128(x[j], k[r]); }
+      }
+      for (int j = 0; j < 4; ++j) { x[j] = _mm512_aesenclast_epi128(x[j], k[AES_ROUNDS]); }
+    }
+    for (int j = 0; j < 4; ++j) { _mm512_storeu_si512(dst + 16 * i + 64 * j, _mm512_xor_si512(x[j], t[j])); }
+  }
+  if (i < n) { XexNi(rk, decrypt, dst + 16 * i, src + 16 * i, tweaks + 16 * i, n - i); }
+}
+#endif
+
+// the fastest kernel this CPU has, and whether it wants the dec schedule
+Xex_Kernel PickXex(int *decSchedule)
+{
+  *decSchedule = 1;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f")) { return XexVaes; }
+  if (__builtin_cpu_supports("aes")) { return XexNi; }
+#endif
+  *decSchedule = 0;
+  return XexSoft;
+}
+
+// XTS over one file system block, from src to dst (which may be the same)
+void XtsBlock(uint32_t bid, uint8_t *dst, const uint8_t *src, int decrypt)
+{
+  uint64_t tweaks[2 * AES_PER_BLOCK];
+  const uint8_t *rk = decrypt && imageKey.decSchedule ? imageKey.data.dec : imageKey.data.enc;
+
+  // the first tweak is the encrypted block number, each next one that times x in GF(2^128)
+  tweaks[0] = bid;
+  tweaks[1] = 0;
+  uint8_t zero[16] = { 0 };
+  imageKey.xex(imageKey.tweak.enc, 0, (uint8_t *) tweaks, (uint8_t *) tweaks, zero, 1);
+  for (int i = 1; i < AES_PER_BLOCK; ++i)
+  {
+    uint64_t lo = tweaks[2*i-2], hi = tweaks[2*i-1];
+    tweaks[2*i] = lo << 1 ^ ( hi >> 63 ? 0x87 : 0 );
+    tweaks[2*i+1] = hi << 1 | lo >> 63;
+  }
+  imageKey.xex(rk, decrypt, dst, src, (const uint8_t *) tweaks, AES_PER_BLOCK);
+}
+
+struct Crypt_Job {
+  uint8_t *dst;                         // NULL = in place
+  uint32_t first;
+  int      decrypt;
+};
+
+void CryptRange(void *ctx, uint64_t lo, uint64_t hi)
+{
+  struct Crypt_Job *job = ctx;
+  for (uint64_t i = lo; i < hi; ++i)
+  {
+    uint32_t bid = job->first + i;
+    XtsBlock(bid, job->dst ? job->dst + i * BLOCK_SIZE : blocks[bid], blocks[bid], job->decrypt);
+  }
+}
+
+// en- or decrypt count blocks from first on, into dst or in place, on one thread per CPU
+void CryptBlocks(uint8_t *dst, uint32_t first, uint32_t count, int decrypt)
+{
+  uint64_t t = SpanStart();
+  struct Crypt_Job job = { dst, first, decrypt };
+  ParallelFor(count, CryptRange, &job);
+  SpanStop(decrypt ? "decrypt" : "encrypt", t);
+}
+
+// the passphrase of an image: $DROPBOX_PASSPHRASE, else asked for on the terminal
+int ReadPassphrase(const char *prompt, char *buf, size_t size)
+{
+  const char *env = getenv("DROPBOX_PASSPHRASE");
+  if (env)
+  {
+    snprintf(buf, size, "%s", env);
+    return buf[0] ? 0 : -1;
+  }
+  FILE *tty = fopen("/dev/tty", "r+");
+  if (!tty) { return -1; }
+  struct termios saved, quiet;
+  int echoOff = tcgetattr(fileno(tty), &saved) == 0;
+  if (echoOff)
+  {
+    quiet = saved;
+    quiet.c_lflag &= ~ECHO;
+    tcsetattr(fileno(tty), TCSAFLUSH, &quiet);
+  }
+  fprintf(tty, "%s", prompt);
+  fflush(tty);
+  char *ok = fgets(buf, size, tty);
+  if (echoOff) { tcsetattr(fileno(tty), TCSAFLUSH, &saved); }
+  fprintf(tty, "\n");
+  fclose(tty);
+  if (!ok) { return -1; }
+  buf[strcspn(buf, "\n")] = 0;
+  return buf[0] ? 0 : -1;
+}
+
+// Derive the keys of an image from its super block and a passphrase. With
+// create set, a new salt is drawn and the check value stored, otherwise the
+// passphrase must match it. -1 with a message if not.
+int UnlockImage(struct Super_Block *sb, int create, const char *cmd)
+{
+  char pass[256];
+  if (ReadPassphrase("Passphrase: ", pass, sizeof(pass)) == -1)
+  {
+    fprintf(out, "%s error: No passphrase (set DROPBOX_PASSPHRASE or use a terminal).\n", cmd);
+    return -1;
+  }
+  if (create)
+  {
+    if (getrandom(sb->salt, sizeof(sb->salt), 0) != sizeof(sb->salt))
+    {
+      explicit_bzero(pass, sizeof(pass));
+      fprintf(out, "%s error: No random numbers for the salt.\n", cmd);
+      return -1;
+    }
+    sb->kdf_rounds = KDF_ROUNDS;
+  }
+  uint8_t key[64], check[32];
+  Pbkdf2(pass, sb->salt, sizeof(sb->salt), sb->kdf_rounds, key, sizeof(key));
+  explicit_bzero(pass, sizeof(pass));
+  struct Sha256 s;
+  Sha256Init(&s);
+  Sha256Update(&s, key, sizeof(key));
+  Sha256Final(&s, check);
+  if (!create && memcmp(check, sb->key_check, sizeof(check)) != 0)
+  {
+    explicit_bzero(key, sizeof(key));
+    fprintf(out, "%s error: Wrong passphrase.\n", cmd);
+    return -1;
+  }
+  memcpy(sb->key_check, check, sizeof(check));
+  sb->flags |= SUPER_ENCRYPTED;
+
+  imageKey.xex = PickXex(&imageKey.decSchedule);
+  AesExpand(&imageKey.data, key);
+  AesExpand(&imageKey.tweak, key + 32);
+  imageKey.on = 1;
+  explicit_bzero(key, sizeof(key));
+  return 0;
+}
+
+void ForgetKey()
+{
+  explicit_bzero(&imageKey, sizeof(imageKey));
+}
+
+// write the whole store to fp, every block but the super block encrypted if the image is
+size_t WriteBlocks(FILE *fp)
+{
+  SealParity();
+  uint64_t t = SpanStart();
+  if (!imageKey.on)
+  {
+    size_t done = fwrite(&blocks[0], BLOCK_SIZE, super->block_num, fp);
+    SpanStop("write image", t);
+    return done;
+  }
+  uint8_t *stage = malloc((size_t) CRYPT_CHUNK * BLOCK_SIZE);
+  if (!stage) { return 0; }
+  size_t done = fwrite(&blocks[0], BLOCK_SIZE, 1, fp);
+  for (uint32_t b = 1; b < super->block_num && done == b; b += CRYPT_CHUNK)
+  {
+    uint32_t n = super->block_num - b < CRYPT_CHUNK ? super->block_num - b : CRYPT_CHUNK;
+    CryptBlocks(stage, b, n, 0);
+    uint64_t w = SpanStart();
+    done += fwrite(stage, BLOCK_SIZE, n, fp);
+    SpanStop("write", w);
+  }
+  free(stage);
+  SpanStop("write image", t);
+  return done;
+}
+
+// blocks b .. b + n - 1 as WriteBlocks stores them, in stage if they are encrypted
+const uint8_t *StoredBlocks(uint8_t *stage, uint32_t b, uint32_t n)
+{
+  if (!imageKey.on) { return blocks[b]; }
+  uint32_t skip = b == 0;           // the super block is stored plain
+  if (skip) { memcpy(stage, blocks[0], BLOCK_SIZE); }
+  if (n > skip) { CryptBlocks(stage + (size_t) skip * BLOCK_SIZE, b + skip, n - skip, 0); }
+  return stage;
+}
+
+// what an image saved before needs written again: the metadata, the
+// segments changed since and the checksums
+int SaveWanted(uint32_t b)
+{
+  return b < super->data_start || segDirty[b / SEGMENT_BLOCKS] || ( super->csum_start && b >= super->csum_start );
+}
+
+// Write the store over the image file it was read from, only the blocks that
+// changed, in runs of adjacent blocks. 0, or -1 if a write failed.
+int SaveBlocks(int fd)
+{
+  SealParity();
+  uint64_t t = SpanStart();
+  uint8_t *stage = imageKey.on ? malloc((size_t) CRYPT_CHUNK * BLOCK_SIZE) : NULL;
+  int ok = !imageKey.on || stage;
+  for (uint32_t b = 0; ok && b < super->block_num; )
+  {
+    if (!SaveWanted(b)) { ++b; continue; }
+    uint32_t n = 1;
+    while (n < CRYPT_CHUNK && b + n < super->block_num && SaveWanted(b + n)) { ++n; }
+    const uint8_t *src = StoredBlocks(stage, b, n);
+    uint64_t w = SpanStart();
+    ok = pwrite(fd, src, (size_t) n * BLOCK_SIZE, (off_t) b * BLOCK_SIZE) == (ssize_t) n * BLOCK_SIZE;
+    SpanStop("write", w);
+    b += n;
+  }
+  free(stage);
+  if (ok) { memset(segDirty, 0, ( super->block_num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS); }
+  SpanStop("write image", t);
+  return ok ? 0 : -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Parity
+//
+// An image made with `createfs ... -p N+M` ends in a redundancy region: M
+// parity blocks for every stripe of N blocks, then a CRC32C of every block.
+// Stripes are interleaved (block b is in stripe b % stripes), so a run of
+// bad sectors hits many stripes once rather than one stripe many times.
+// Parity 0 is the XOR of the stripe, the others are Reed-Solomon rows of a
+// Cauchy matrix scaled to make row 0 all ones, so any M lost blocks of a
+// stripe can be rebuilt. Checksums and parity cover the plain blocks;
+// encryption, if any, applies to the region like to any other block.
+//
+// Data blocks are only written right after they are allocated (directories
+// are copy-on-write, put writes a new inode), so allocation marks a stripe
+// dirty and freeing needs nothing; the few writes to blocks in place mark
+// them themselves. The metadata region is compared against its checksums
+// instead. Dirty stripes are encoded when the image is saved; blocks are
+// verified, and rebuilt if need be, when they are loaded.
+
+#define MAX_STRIPE_DATA   64
+#define MAX_STRIPE_PARITY 4
+#define CSUMS_PER_BLOCK   ( BLOCK_SIZE / sizeof(uint32_t) - 1 )  // the last one covers the block itself
+
+uint8_t *stripeDirty = NULL;        // per stripe: changed since it was encoded
+uint32_t stripeCount;
+uint8_t  parityCoef[MAX_STRIPE_PARITY][MAX_STRIPE_DATA];
+
+uint8_t gfExp[512];
+uint8_t gfLog[256];
+
+// multiply n bytes of src by c in GF(2^8) and add them to dst
+typedef void (*Gf_Kernel)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+Gf_Kernel gfMulAdd;
+uint32_t (*crc32c)(const uint8_t *p, size_t n);
+uint32_t crcTable[256];
+
+uint8_t GfMul(uint8_t a, uint8_t b)
+{
+  return a && b ? gfExp[ gfLog[a] + gfLog[b] ] : 0;
+}
+
+uint8_t GfInv(uint8_t a)
+{
+  return gfExp[ 255 - gfLog[a] ];
+}
+
+void GfMulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n)
+{
+  if (c == 1)
+  {
+    for (size_t i = 0; i < n; i += 8)
+    {
+      uint64_t a, b;
+      memcpy(&a, dst + i, 8);
+      memcpy(&b, src + i, 8);
+      a ^= b;
+      memcpy(dst + i, &a, 8);
+    }
+    return;
+  }
+  uint8_t row[256];
+  for (int x = 0; x < 256; ++x) { row[x] = GfMul(c, x); }
+  for (size_t i = 0; i < n; ++i) { dst[i] ^= row[src[i]]; }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// c * x = c * low nibble ^ c * high nibble, each a 16 entry table lookup
+__attribute__((target("ssse3")))
+void GfMulAddSsse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n)
+{
+  uint8_t lo[16], hi[16];
+  for (int x = 0; x < 16; ++x)
+  {
+    lo[x] = GfMul(c, x);
+    hi[x] = GfMul(c, x << 4);
+  }
+  __m128i tl = _mm_loadu_si128((const __m128i *) lo);
+  __m128i th = _mm_loadu_si128((const __m128i *) hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  for (size_t i = 0; i < n; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) ( src + i ));
+    __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tl, _mm_and_si128(v, mask)),
+                              _mm_shuffle_epi8(th, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+    _mm_storeu_si128((__m128i *) ( dst + i ), _mm_xor_si128(_mm_loadu_si128((const __m128i *) ( dst + i )), p));
+  }
+}
+
+__attribute__((target("avx2")))
+void GfMulAddAvx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n)
+{
+  uint8_t lo[16], hi[16];
+  for (int x = 0; x < 16; ++x)
+  {
+    lo[x] = GfMul(c, x);
+    hi[x] = GfMul(c, x << 4);
+  }
+  // the shuffle works within 128-bit lanes, so both lanes get the tables
+  __m256i tl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lo));
+  __m256i th = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) hi));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  for (size_t i = 0; i < n; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *) ( src + i ));
+    __m256i p = c == 1 ? v : _mm256_xor_si256(_mm256_shuffle_epi8(tl, _mm256_and_si256(v, mask)),
+                                              _mm256_shuffle_epi8(th, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+    _mm256_storeu_si256((__m256i *) ( dst + i ), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) ( dst + i )), p));
+  }
+}
+
+__attribute__((target("sse4.2")))
+uint32_t Crc32cHw(const uint8_t *p, size_t n)
+{
+  uint64_t crc = 0xffffffff;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    crc = _mm_crc32_u64(crc, v);
+  }
+  for (; i < n; ++i) { crc = _mm_crc32_u8(crc, p[i]); }
+  return ~crc;
+}
+#endif
+
+uint32_t Crc32cSoft(const uint8_t *p, size_t n)
+{
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < n; ++i) { crc = crcTable[ ( crc ^ p[i] ) & 0xff ] ^ crc >> 8; }
+  return ~crc;
+}
+
+// tables and the fastest kernels of this CPU, the first time
+void KernelsInit()
+{
+  if (!gfMulAdd)
+  {
+    for (int i = 0, x = 1; i < 255; ++i, x = x << 1 ^ ( x & 0x80 ? 0x11d : 0 ))
+    {
+      gfExp[i] = gfExp[i + 255] = x;
+      gfLog[x] = i;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) { c = c >> 1 ^ ( c & 1 ? 0x82f63b78 : 0 ); }
+      crcTable[i] = c;
+    }
+    gfMulAdd = GfMulAddScalar;
+    crc32c = Crc32cSoft;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")) { gfMulAdd = GfMulAddSsse3; }
+    if (__builtin_cpu_supports("avx2")) { gfMulAdd = GfMulAddAvx2; }
+    if (__builtin_cpu_supports("sse4.2")) { crc32c = Crc32cHw; }
+#endif
+  }
+}
+
+// tables, kernels and the coding matrix for n + m stripes
+void ParityInit(int n, int m)
+{
+  KernelsInit();
+  // Cauchy entries 1 / (x_j + y_i) with x_j = j, y_i = m + i, each column
+  // scaled by its row 0 entry; scaling keeps every square submatrix regular
+  for (int j = 0; j < m; ++j)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      uint8_t y = m + i;
+      parityCoef[j][i] = GfMul(y, GfInv(j ^ y));
+    }
+  }
+}
+
+uint32_t *CsumSlot(uint32_t bid)
+{
+  return (uint32_t *) blocks[ super->csum_start + bid / CSUMS_PER_BLOCK ] + bid % CSUMS_PER_BLOCK;
+}
+
+// block at position i of a stripe, positions from N on are its parity; 0 if past the end
+uint32_t StripeBlock(uint32_t s, int i)
+{
+  if (i >= super->stripe_data) { return super->parity_start + s * super->stripe_parity + i - super->stripe_data; }
+  uint64_t bid = s + (uint64_t) i * stripeCount;
+  return bid < super->parity_start ? bid : 0;
+}
+
+uint32_t StripeOf(uint32_t bid)
+{
+  return bid < super->parity_start ? bid % stripeCount : ( bid - super->parity_start ) / super->stripe_parity;
+}
+
+// called with allocLock held, before the block is written
+void MarkDirty(uint32_t bid, uint32_t n)
+{
+  for (uint32_t s = bid / SEGMENT_BLOCKS; s <= ( bid + n - 1 ) / SEGMENT_BLOCKS; ++s)
+  {
+    segsDirtied += !segDirty[s];
+    segDirty[s] = 1;
+  }
+  if (segsDirtied >= flushKickAt)
+  {
+    flushKickAt = UINT64_MAX;       // until the next checkpoint
+    FlushKick();
+  }
+  if (!stripeDirty) { return; }
+  for (uint32_t i = 0; i < n && i < stripeCount; ++i) { stripeDirty[ ( bid + i ) % stripeCount ] = 1; }
+}
+
+// recompute the parity and checksums of one stripe
+void EncodeStripe(uint32_t s)
+{
+  int n = super->stripe_data, m = super->stripe_parity;
+  for (int j = 0; j < m; ++j) { memset(blocks[StripeBlock(s, n + j)], 0, BLOCK_SIZE); }
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t bid = StripeBlock(s, i);
+    if (bid == 0 && i > 0) { break; }       // past the end, zeros
+    *CsumSlot(bid) = crc32c(blocks[bid], BLOCK_SIZE);
+    for (int j = 0; j < m; ++j) { gfMulAdd(blocks[StripeBlock(s, n + j)], blocks[bid], parityCoef[j][i], BLOCK_SIZE); }
+  }
+  for (int j = 0; j < m; ++j)
+  {
+    uint32_t bid = StripeBlock(s, n + j);
+    *CsumSlot(bid) = crc32c(blocks[bid], BLOCK_SIZE);
+    segDirty[bid / SEGMENT_BLOCKS] = 1;
+  }
+}
+
+void EncodeRange(void *ctx, uint64_t lo, uint64_t hi)
+{
+  for (uint64_t s = lo; s < hi; ++s)
+  {
+    if (stripeDirty[s])
+    {
+      EncodeStripe(s);
+      stripeDirty[s] = 0;
+    }
+  }
+}
+
+void SealCsums(void *ctx, uint64_t lo, uint64_t hi)
+{
+  for (uint64_t b = super->csum_start + lo; b < super->csum_start + hi; ++b)
+  {
+    uint32_t *c = (uint32_t *) blocks[b];
+    c[CSUMS_PER_BLOCK] = crc32c(blocks[b], CSUMS_PER_BLOCK * sizeof(uint32_t));
+  }
+}
+
+// bring parity and checksums up to date before the image is written
+void SealParity()
+{
+  if (!stripeDirty) { return; }
+  uint64_t t = SpanStart();
+  for (uint32_t b = 0; b < super->data_start; ++b)
+  {
+    if (*CsumSlot(b) != crc32c(blocks[b], BLOCK_SIZE)) { stripeDirty[ StripeOf(b) ] = 1; }
+  }
+  ParallelFor(stripeCount, EncodeRange, NULL);
+  ParallelFor(super->block_num - super->csum_start, SealCsums, NULL);
+  SpanStop("seal parity", t);
+}
+
+// Rebuild the blocks of stripe s marked in bad (by position) from the rest.
+// -1 if more are lost than there is parity, or the result fails its checksum.
+int RepairStripe(uint32_t s, const uint8_t *bad)
+{
+  int n = super->stripe_data, m = super->stripe_parity;
+  int lost[MAX_STRIPE_PARITY], rows[MAX_STRIPE_PARITY];
+  int e = 0, r = 0;
+  for (int i = 0; i < n + m; ++i)
+  {
+    if (!bad[i]) { continue; }
+    if (i >= n) { continue; }               // parity is simply encoded again
+    if (e == m) { return -1; }
+    lost[e++] = i;
+  }
+  for (int j = 0; j < m && r < e; ++j)
+  {
+    if (!bad[n + j]) { rows[r++] = j; }
+  }
+  if (r < e) { return -1; }
+
+  if (e > 0)
+  {
+    // syndromes: a parity row minus the blocks still there leaves the lost ones
+    uint8_t *syn = malloc((size_t) e * BLOCK_SIZE);
+    if (!syn) { return -1; }
+    for (int k = 0; k < e; ++k)
+    {
+      uint8_t *y = syn + (size_t) k * BLOCK_SIZE;
+      memcpy(y, blocks[StripeBlock(s, n + rows[k])], BLOCK_SIZE);
+      for (int i = 0; i < n; ++i)
+      {
+        uint32_t bid = StripeBlock(s, i);
+        if (bad[i] || ( bid == 0 && i > 0 )) { continue; }
+        gfMulAdd(y, blocks[bid], parityCoef[rows[k]][i], BLOCK_SIZE);
+      }
+    }
+    // invert the e x e matrix of the lost columns in those rows
+    uint8_t a[MAX_STRIPE_PARITY][2 * MAX_STRIPE_PARITY];
+    for (int k = 0; k < e; ++k)
+    {
+      for (int l = 0; l < e; ++l)
+      {
+        a[k][l] = parityCoef[rows[k]][lost[l]];
+        a[k][e + l] = k == l;
+      }
+    }
+    for (int col = 0; col < e; ++col)
+    {
+      int piv = col;
+      while (piv < e && !a[piv][col]) { ++piv; }
+      if (piv == e) { free(syn); return -1; }
+      for (int l = 0; l < 2 * e; ++l)
+      {
+        uint8_t t = a[col][l]; a[col][l] = a[piv][l]; a[piv][l] = t;
+      }
+      uint8_t inv = GfInv(a[col][col]);
+      for (int l = 0; l < 2 * e; ++l) { a[col][l] = GfMul(a[col][l], inv); }
+      for (int k = 0; k < e; ++k)
+      {
+        uint8_t f = a[k][col];
+        if (k == col || !f) { continue; }
+        for (int l = 0; l < 2 * e; ++l) { a[k][l] ^= GfMul(f, a[col][l]); }
+      }
+    }
+    for (int l = 0; l < e; ++l)
+    {
+      uint8_t *d = blocks[StripeBlock(s, lost[l])];
+      memset(d, 0, BLOCK_SIZE);
+      for (int k = 0; k < e; ++k) { gfMulAdd(d, syn + (size_t) k * BLOCK_SIZE, a[l][e + k], BLOCK_SIZE); }
+    }
+    free(syn);
+  }
+  for (int l = 0; l < e; ++l)
+  {
+    uint32_t bid = StripeBlock(s, lost[l]);
+    if (*CsumSlot(bid) != crc32c(blocks[bid], BLOCK_SIZE)) { return -1; }
+    segDirty[bid / SEGMENT_BLOCKS] = 1; // to be written back
+  }
+  for (int j = 0; j < m; ++j)
+  {
+    if (bad[n + j]) { EncodeStripe(s); break; }
+  }
+  return 0;
+}
+
+struct Verify {
+  uint8_t *bad;                     // per block
+  uint64_t count;
+  int      dataOnly;                // skip the metadata region, it changes without a trace
+};
+
+void VerifyRange(void *ctx, uint64_t lo, uint64_t hi)
+{
+  struct Verify *v = ctx;
+  uint64_t count = 0;
+  for (uint64_t b = lo; b < hi; ++b)
+  {
+    if (v->dataOnly && ( b < super->data_start || stripeDirty[ StripeOf(b) ] )) { continue; }
+    if (*CsumSlot(b) != crc32c(blocks[b], BLOCK_SIZE))
+    {
+      v->bad[b] = 1;
+      ++count;
+    }
+  }
+  __atomic_add_fetch(&v->count, count, __ATOMIC_RELAXED);
+}
+
+// Check the blocks in memory against their checksums and rebuild the bad
+// ones. Returns how many could not be rebuilt.
+uint64_t VerifyBlocks(int dataOnly, const char *cmd)
+{
+  uint32_t bad_csums = 0;
+  for (uint32_t b = super->csum_start; b < super->block_num; ++b)
+  {
+    uint32_t *c = (uint32_t *) blocks[b];
+    if (c[CSUMS_PER_BLOCK] != crc32c(blocks[b], CSUMS_PER_BLOCK * sizeof(uint32_t)))
+    {
+      // nothing to check its blocks against, so trust them
+      ++bad_csums;
+      uint32_t first = ( b - super->csum_start ) * CSUMS_PER_BLOCK;
+      for (uint32_t i = 0; i < CSUMS_PER_BLOCK && first + i < super->csum_start; ++i)
+      {
+        c[i] = crc32c(blocks[first + i], BLOCK_SIZE);
+      }
+      c[CSUMS_PER_BLOCK] = crc32c(blocks[b], CSUMS_PER_BLOCK * sizeof(uint32_t));
+    }
+  }
+  if (bad_csums)
+  {
+    fprintf(out, "%s: %u damaged checksum blocks were recomputed from the data.\n", cmd, bad_csums);
+  }
+
+  struct Verify v = { calloc(super->csum_start, 1), 0, dataOnly };
+  if (!v.bad)
+  {
+    fprintf(out, "%s error: Out of memory.\n", cmd);
+    return 0;
+  }
+  ParallelFor(super->csum_start, VerifyRange, &v);
+  uint64_t lost = 0, fixed = 0;
+  uint8_t pos[MAX_STRIPE_DATA + MAX_STRIPE_PARITY];
+  for (uint32_t b = 0; b < super->csum_start && v.count; ++b)
+  {
+    if (!v.bad[b]) { continue; }
+    uint32_t s = StripeOf(b);
+    int n = 0;
+    for (int i = 0; i < super->stripe_data + super->stripe_parity; ++i)
+    {
+      uint32_t bid = StripeBlock(s, i);
+      pos[i] = ( bid || i == 0 ) && v.bad[bid];
+      n += pos[i];
+      if (pos[i]) { v.bad[bid] = 0; }
+    }
+    v.count -= n;
+    if (RepairStripe(s, pos) == 0) { fixed += n; }
+    else
+    {
+      lost += n;
+      fprintf(out, "%s error: Stripe %u has %d damaged blocks and cannot be rebuilt.\n", cmd, s, n);
+    }
+  }
+  if (fixed) { fprintf(out, "%s: Rebuilt %" PRIu64 " damaged blocks from parity.\n", cmd, fixed); }
+  free(v.bad);
+  return lost;
+}
+
+// the largest area of an image of total blocks whose n + m parity and
+// checksums still fit after it
+uint32_t ParityCovered(uint64_t total, int n, int m)
+{
+  uint64_t covered = total * n / ( n + m );
+  for (;;)
+  {
+    uint64_t parity = ( covered + n - 1 ) / n * m;
+    uint64_t csums = ( covered + parity + CSUMS_PER_BLOCK - 1 ) / CSUMS_PER_BLOCK;
+    if (covered + parity + csums <= total) { return covered; }
+    --covered;
+  }
+}
+
+// Add a redundancy region of m parity blocks per n blocks at the end of a
+// new, empty file system. All stripes are encoded when it is written.
+int SetupParity(const char *spec)
+{
+  int n, m;
+  if (sscanf(spec, "%d+%d", &n, &m) != 2 || n < 1 || n > MAX_STRIPE_DATA || m < 1 || m > MAX_STRIPE_PARITY)
+  {
+    fprintf(out, "createfs error: Parity is N+M with N up to %d and M up to %d, e.g. 8+2.\n",
+            MAX_STRIPE_DATA, MAX_STRIPE_PARITY);
+    return -1;
+  }
+  uint32_t total = super->block_num;
+  uint32_t covered = ParityCovered(total, n, m);
+  if (covered <= super->data_start + 1)
+  {
+    fprintf(out, "createfs error: The image is too small for parity.\n");
+    return -1;
+  }
+  super->stripe_data = n;
+  super->stripe_parity = m;
+  super->parity_start = covered;
+  super->csum_start = covered + ( covered + n - 1 ) / n * m;
+  memset(&blockMap[covered], 1, total - covered);
+  MapMetadata();
+  memset(stripeDirty, 1, stripeCount);
+  return 0;
+}
+
+// `scrub`: check the image file against the checksums of what was last saved,
+// rewrite blocks that read back wrong, then check the blocks in memory
+int Scrub()
+{
+  if (!super->parity_start)
+  {
+    fprintf(out, "scrub error: This image has no parity.\n");
+    return -1;
+  }
+  uint64_t rewritten = 0, unreadable = 0;
+  // the image file has to be the last checkpoint, not part of one
+  if (image && FlushSync() == -1)
+  {
+    fprintf(out, "scrub error: Failed to write a checkpoint first.\n");
+    return -1;
+  }
+  if (image)
+  {
+    uint8_t *chunk = malloc((size_t) CRYPT_CHUNK * BLOCK_SIZE);
+    uint8_t *plain = malloc(BLOCK_SIZE);
+    if (!chunk || !plain)
+    {
+      free(chunk);
+      free(plain);
+      fprintf(out, "scrub error: Out of memory.\n");
+      return -1;
+    }
+    int fd = fileno(image);
+    for (uint32_t b = 0; b < super->block_num; b += CRYPT_CHUNK)
+    {
+      uint32_t k = super->block_num - b < CRYPT_CHUNK ? super->block_num - b : CRYPT_CHUNK;
+      ssize_t got = pread(fd, chunk, (size_t) k * BLOCK_SIZE, (off_t) b * BLOCK_SIZE);
+      for (uint32_t i = 0; i < k; ++i)
+      {
+        uint32_t bid = b + i;
+        if (bid >= super->csum_start) { continue; }
+        uint8_t *p = chunk + (size_t) i * BLOCK_SIZE;
+        if (got >= (ssize_t) ( ( i + 1 ) * BLOCK_SIZE ))
+        {
+          if (imageKey.on && bid) { XtsBlock(bid, plain, p, 1); p = plain; } // the super block is plain
+          if (crc32c(p, BLOCK_SIZE) == *CsumSlot(bid)) { continue; }
+        }
+        // unless it changed since the last save, the copy in memory is what belongs there
+        if (crc32c(blocks[bid], BLOCK_SIZE) != *CsumSlot(bid)) { continue; }
+        p = blocks[bid];
+        if (imageKey.on && bid) { XtsBlock(bid, plain, blocks[bid], 0); p = plain; }
+        if (pwrite(fd, p, BLOCK_SIZE, (off_t) bid * BLOCK_SIZE) == BLOCK_SIZE) { ++rewritten; }
+        else { ++unreadable; }
+      }
+    }
+    free(chunk);
+    free(plain);
+  }
+  uint64_t lost = VerifyBlocks(1, "scrub");
+  fprintf(out, "Scrubbed %u blocks: %" PRIu64 " rewritten in the image file, %" PRIu64 " could not be written, "
+          "%" PRIu64 " lost.\n", super->block_num, rewritten, unreadable, lost);
+  return lost || unreadable ? -1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Path resolution
+//
+// Paths are absolute ("/a/b") or relative to cwd, "." and ".." are understood.
+// Each component is one B+ tree lookup, so resolution costs O(depth * log n).
+
+// resolve path to an inode id, -1 if any component is missing
+int Namei(const char *path)
+{
+  char buf[MAX_PATH_LEN];
+  snprintf(buf, sizeof(buf), "%s", path);
+  int nid = path[0] == '/' ? ROOT_INODE : cwd;
+  char *save;
+  for (char *c = strtok_r(buf, "/", &save); c; c = strtok_r(NULL, "/", &save))
+  {
+    if (inodes[nid].type != INODE_DIR) { return -1; }
+    if (strcmp(c, ".") == 0) { continue; }
+    if (strcmp(c, "..") == 0) { nid = inodes[nid].parent; continue; }
+    int i;
+    struct BTree_Node *leaf = BTreeLookup(nid, c, &i);
+    if (!leaf) { return -1; }
+    nid = leaf->inode[i];
+  }
+  return nid;
+}
+
+// resolve the directory holding the last component of path, which is copied to name
+int NameiParent(const char *path, char *name)
+{
+  char buf[MAX_PATH_LEN];
+  snprintf(buf, sizeof(buf), "%s", path);
+  // drop trailing slashes
+  size_t len = strlen(buf);
+  while (len > 1 && buf[len-1] == '/') { buf[--len] = 0; }
+
+  char *last = strrchr(buf, '/');
+  int dnid;
+  if (last)
+  {
+    *last = 0;
+    dnid = last == buf ? ROOT_INODE : Namei(buf);
+    ++last;
+  }
+  else
+  {
+    dnid = cwd;
+    last = buf;
+  }
+  if (dnid == -1 || inodes[dnid].type != INODE_DIR) { return -1; }
+  size_t n = strlen(last);
+  if (n > MAX_NAME_LEN || n == 0 || strcmp(last, ".") == 0 || strcmp(last, "..") == 0)
+  {
+    return -2;
+  }
+  memcpy(name, last, n + 1);
+  return dnid;
+}
+
+// last component of a path, used as the default name on the other side of put/get
+const char *BaseName(const char *path)
+{
+  const char *p = strrchr(path, '/');
+  return p ? p + 1 : path;
+}
+
+static inline int WritePermission(int nid)
+{
+  return ! ATTRIBUTE_GET_R( __atomic_load_n(&inodes[nid].attribute, __ATOMIC_RELAXED) );
+}
+
+// an existing entry a new file would replace must be a writable file
+int PutCheck(int nid, const char *name, const char *cmd)
+{
+  if (inodes[nid].type == INODE_DIR)
+  {
+    fprintf(out, "%s error: \"%s\" is a directory.\n", cmd, name);
+    return -1;
+  }
+  if ( !WritePermission(nid) )
+  {
+    fprintf(out, "%s error: No permission to write file \"%s\"\n", cmd, name);
+    return -1;
+  }
+  return 0;
+}
+
+// drop a file that was never linked, with what is left of the reservation
+void Discard(int nid)
+{
+  pthread_mutex_lock(&allocLock);
+  Erase(nid);
+  FreeInode(nid);
+  pthread_mutex_unlock(&allocLock);
+  Unreserve();
+}
+
+// Where the contents of a new file come from: fill buf with n bytes,
+// returning 0 on a read error.
+typedef int (*Source)(void *ctx, void *buf, size_t n);
+
+// read from a host file, a file that got shorter reads as zeros
+int FileSource(void *ctx, void *buf, size_t n)
+{
+  FILE *ifp = ctx;
+  size_t got = fread(buf, 1, n, ifp);
+  if (got < n)
+  {
+    if ( ferror(ifp) ) { return 0; }
+    memset((char *) buf + got, 0, n - got);
+  }
+  return 1;
+}
+
+// read from memory, ctx points at the cursor
+int BufferSource(void *ctx, void *buf, size_t n)
+{
+  const uint8_t **from = ctx;
+  memcpy(buf, *from, n);
+  *from += n;
+  return 1;
+}
+
+// Map blocks at positions id .. num_blocks - 1 of file nid, taking them in
+// runs of adjacent blocks from near on. Callers have reserved them and their
+// pointer blocks. Returns the first position left unmapped.
+uint64_t GrowFile(int nid, uint64_t id, uint64_t num_blocks, uint32_t near)
+{
+  while (id < num_blocks)
+  {
+    uint32_t len = 0;
+    uint64_t t = SpanStart();
+    int start = AllocRun(num_blocks - id, near, &len);
+    // map the run first, so the pointer blocks it needs go after it
+    uint32_t k = 0, marked = 0;
+    for ( ; start != -1 && k < len; ++k)
+    {
+      uint32_t *slot = BlockSlot(nid, id + k, 1);
+      if (!slot) { break; }
+      *slot = start + k;
+      // a pointer block the file had already is written again
+      uint32_t at = SlotBlock(slot);
+      if (at && at != marked)
+      {
+        pthread_mutex_lock(&allocLock);
+        MarkDirty(at, 1);
+        pthread_mutex_unlock(&allocLock);
+        marked = at;
+      }
+    }
+    if (start == -1 || k < len)
+    {
+      // this should not happen because of the reservation
+      fprintf(out, "No more empty blocks found!!!!!!!!!!!\n");
+      pthread_mutex_lock(&allocLock);
+      for (uint32_t i = k; i < len; ++i) { FreeBlock(start + i); }
+      pthread_mutex_unlock(&allocLock);
+      return id + k;
+    }
+    SpanStop("allocate", t);
+    id += len;
+    near = start + len;
+  }
+  return id;
+}
+
+// Read size bytes from src into the blocks of file nid from position first
+// on, a run of adjacent blocks at a time, zeroing the rest of the last block.
+// 0 on a read error.
+int FillBlocks(int nid, uint64_t first, Source src, void *ctx, uint64_t size)
+{
+  uint64_t num_blocks = first + ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint64_t left = size;
+  for (uint64_t id = first; id < num_blocks; )
+  {
+    uint32_t bid;
+    uint64_t k = RunOf(nid, id, num_blocks, &bid);
+    uint64_t room = k * BLOCK_SIZE;
+    uint64_t bytes = room < left ? room : left;
+    uint64_t t = SpanStart();
+    int read = src(ctx, blocks[bid], bytes);
+    SpanStop("read input", t);
+    if (!read) { return 0; }
+    memset(blocks[bid] + bytes, 0, room - bytes);
+    left -= bytes;
+    id += k;
+  }
+  return 1;
+}
+
+// Mark the blocks of file nid from position first on: written up to its
+// size, reserved past it. Counts the reserved ones in the inode.
+void MarkReserved(int nid, uint64_t first, uint64_t num_blocks)
+{
+  uint64_t written = MappedBlocks(nid);
+  pthread_mutex_lock(&allocLock);
+  for (uint64_t id = first; id < num_blocks; ++id)
+  {
+    blockMap[ BlockOf(nid, id) ] = id < written ? 1 : 2;
+  }
+  inodes[ nid ].reserved = num_blocks > written ? num_blocks - written : 0;
+  pthread_mutex_unlock(&allocLock);
+}
+
+// Copy size bytes from src into a new inode under pnid that nobody can see
+// until it is linked. Blocks are taken in runs of adjacent blocks, which are
+// adjacent in the store as well, so a single read fills a whole run. A small
+// file goes into the inode, the partial last block of a bigger one into a
+// tail block. With room past size, blocks are reserved up to room instead.
+// Returns the inode, -1 with a message on failure.
+int NewFile(Source src, void *ctx, uint64_t size, uint64_t room, int pnid, const char *cmd)
+{
+  uint64_t end = size <= INLINE_MAX ? size : size % BLOCK_SIZE;
+  if (end > TAIL_MAX || room > size) { end = 0; }
+  uint64_t data_blocks = ( size - end + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint64_t num_blocks = room > size ? ( room + BLOCK_SIZE - 1 ) / BLOCK_SIZE : data_blocks;
+  int packed = end > 0 && size > INLINE_MAX;
+  uint64_t t = SpanStart();
+  // an overwritten file keeps its blocks until readers are done with it
+  if ( ReserveBlocks(num_blocks + IndirectBlocks(num_blocks) + packed) == -1 )
+  {
+    fprintf(out, "%s error: Not enough disk space.\n", cmd);
+    return -1;
+  }
+  int nid = AllocInode();
+  if (nid == -1)
+  {
+    Unreserve();
+    fprintf(out, "%s error: No more empty Inode.\n", cmd);
+    return -1;
+  }
+  inodes[ nid ].type = INODE_FILE;
+  inodes[ nid ].attribute = 0;
+  inodes[ nid ].parent = pnid;
+  inodes[ nid ].size = size;
+  SpanStop("reserve", t);
+
+  if (GrowFile(nid, 0, num_blocks, 0) < num_blocks)
+  {
+    Discard(nid);
+    return -1;
+  }
+  if ( !FillBlocks(nid, 0, src, ctx, size - end) )
+  {
+    fprintf(out, "An error occured reading from the input file.\n");
+    Discard(nid);
+    return -1;
+  }
+  if (num_blocks > data_blocks) { MarkReserved(nid, data_blocks, num_blocks); }
+
+  if (end > 0)
+  {
+    uint8_t *data = inodes[ nid ].data;
+    uint64_t room = INLINE_MAX;
+    if (packed)
+    {
+      uint32_t tail;
+      int unit = AllocTail(end, &tail);
+      if (unit == -1)
+      {
+        fprintf(out, "No more empty blocks found!!!!!!!!!!!\n");
+        Discard(nid);
+        return -1;
+      }
+      inodes[ nid ].tail = tail;
+      inodes[ nid ].tail_unit = unit;
+      data = blocks[tail] + unit * TAIL_UNIT;
+      room = TailUnits(end) * TAIL_UNIT;
+    }
+    else
+    {
+      inodes[ nid ].flags |= INODE_INLINE;
+    }
+    t = SpanStart();
+    int read = src(ctx, data, end);
+    SpanStop("read input", t);
+    if (!read)
+    {
+      fprintf(out, "An error occured reading from the input file.\n");
+      Discard(nid);
+      return -1;
+    }
+    memset(data + end, 0, room - end);
+  }
+  Unreserve();
+  return nid;
+}
+
+// LinkFile with the lock of pnid held, the file is left to the caller on failure
+int LinkEntry(int pnid, const char *name, int nid, int64_t time, const char *cmd)
+{
+  int ret = -1;
+  int slot;
+  struct BTree_Node *entry;
+  if (inodes[pnid].flags & INODE_REMOVED)
+  {
+    fprintf(out, "%s error: No such directory.\n", cmd);
+  }
+  else if ( ( entry = BTreeLookup(pnid, name, &slot) ) )
+  {
+    int old = entry->inode[slot];
+    if (PutCheck(old, name, cmd) == 0)
+    {
+      inodes[ nid ].attribute = __atomic_load_n(&inodes[old].attribute, __ATOMIC_RELAXED);
+      ret = BTreeReplace(pnid, name, nid, time);
+      if (ret == 0) { Retire(old, 1); }
+      else { fprintf(out, "%s error: Not enough disk space.\n", cmd); }
+    }
+  }
+  else if ( ( ret = BTreeInsert(pnid, name, nid, time) ) == -1 )
+  {
+    fprintf(out, "%s error: Failed to add directory entry.\n", cmd);
+  }
+  return ret;
+}
+
+// Link a new file as name under pnid, replacing whatever the name refers to
+// by now. The file is discarded if that fails.
+int LinkFile(int pnid, const char *name, int nid, int64_t time, const char *cmd)
+{
+  uint64_t t = SpanStart();
+  LockDir(pnid);
+  int ret = LinkEntry(pnid, name, nid, time, cmd);
+  UnlockDir(pnid);
+  SpanStop("link", t);
+  if (ret == -1)
+  {
+    Discard(nid);
+  }
+  return ret;
+}
+
+// Write size bytes from ifp over file nid in its own blocks, adding blocks if
+// it needs more than it has mapped. What goes over the blocks written so far
+// is read aside first and copied in once the whole input is read, so a failed
+// put leaves the file as it was. -1 with a message on failure, -2 before
+// anything is read if there is no memory to read it aside.
+int WriteInPlace(int nid, FILE *ifp, uint64_t size)
+{
+  uint64_t written = MappedBlocks(nid);
+  uint64_t have = written + ReservedOf(nid);
+  uint64_t num_blocks = ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint64_t over = written < num_blocks ? written : num_blocks;
+  uint64_t aside = size < over * BLOCK_SIZE ? size : over * BLOCK_SIZE;
+  uint8_t *stage = aside ? malloc(aside) : NULL;
+  if (aside && !stage) { return -2; }
+  if (num_blocks > have)
+  {
+    if ( ReserveBlocks(num_blocks - have + IndirectBlocks(num_blocks)) == -1 )
+    {
+      free(stage);
+      fprintf(out, "put error: Not enough disk space.\n");
+      return -1;
+    }
+    uint64_t got = GrowFile(nid, have, num_blocks, have ? BlockOf(nid, have - 1) + 1 : 0);
+    Unreserve();
+    MarkReserved(nid, have, got); // past the end until it is written
+    if (got < num_blocks)
+    {
+      free(stage);
+      return -1;
+    }
+    have = got;
+  }
+
+  pthread_mutex_lock(&allocLock);
+  for (uint64_t id = 0; id < num_blocks; )
+  {
+    uint32_t bid;
+    uint64_t k = RunOf(nid, id, num_blocks, &bid);
+    MarkDirty(bid, k);
+    id += k;
+  }
+  pthread_mutex_unlock(&allocLock);
+  // the rest goes straight into blocks past the end, which hold nothing yet
+  const uint8_t *from = stage;
+  int read = FileSource(ifp, stage, aside) && FillBlocks(nid, over, FileSource, ifp, size - aside);
+  if (read) { FillBlocks(nid, 0, BufferSource, &from, aside); }
+  free(stage);
+  if (!read)
+  {
+    fprintf(out, "put error: Failed to read the input file.\n");
+    return -1;
+  }
+  __atomic_store_n(&inodes[nid].size, size, __ATOMIC_RELEASE);
+  MarkReserved(nid, written < num_blocks ? written : num_blocks, have);
+  return 0;
+}
+
+// Put over a file with blocks reserved past its end (see Reserve): it is
+// written in place rather than replaced by a new file, so a get of it at the
+// same time may see part of the new contents. Returns the file, -1 with a
+// message on failure, -2 if the file is not reserved (any more) or there is
+// no memory to write it in place.
+int PutInPlace(FILE *ifp, uint64_t size, int pnid, const char *name)
+{
+  LockDir(pnid);
+  int slot;
+  struct BTree_Node *entry = BTreeLookup(pnid, name, &slot);
+  int nid = entry ? (int) entry->inode[slot] : -1;
+  int ret = -2;
+  if (nid != -1 && inodes[nid].type == INODE_FILE && ReservedOf(nid))
+  {
+    ret = PutCheck(nid, name, "put") == -1 ? -1 : WriteInPlace(nid, ifp, size);
+    // only the time of the entry changes
+    if (ret == 0 && BTreeReplace(pnid, name, nid, time(NULL)) == -1)
+    {
+      fprintf(out, "put error: Not enough disk space.\n");
+      ret = -1;
+    }
+    else if (ret == 0)
+    {
+      ret = nid;
+    }
+  }
+  UnlockDir(pnid);
+  return ret;
+}
+
+// copy size bytes from ifp into the file system, as `fname` in cwd or at dest
+// if exists an entry with same name, then overwrite
+// else create a new entry
+int PutStream(FILE *ifp, int64_t size, const char *fname, const char *dest)
+{
+  // store under the host file's name in cwd unless a destination is given
+  char name[MAX_NAME_LEN + 1];
+  uint64_t t = SpanStart();
+  int pnid = NameiParent(dest ? dest : fname, name);
+  if (dest)
+  {
+    // putting into an existing directory keeps the host file's name
+    int target = Namei(dest);
+    if (target != -1 && inodes[target].type == INODE_DIR)
+    {
+      pnid = target;
+      snprintf(name, sizeof(name), "%s", fname);
+      if (strlen(fname) > MAX_NAME_LEN) { pnid = -2; }
+    }
+  }
+  SpanStop("lookup", t);
+  if (pnid == -2)
+  {
+    fprintf(out, "put error: File name too long.\n");
+    return -1;
+  }
+  if (pnid == -1)
+  {
+    fprintf(out, "put error: No such directory.\n");
+    return -1;
+  }
+
+  // fail early, the entry is checked again when the new file is linked
+  int slot;
+  struct BTree_Node *entry = BTreeLookup(pnid, name, &slot);
+  if (entry && PutCheck(entry->inode[slot], name, "put") == -1)
+  {
+    return -1;
+  }
+
+  int nid = entry && ReservedOf(entry->inode[slot]) ? PutInPlace(ifp, size, pnid, name) : -2;
+  if (nid == -2)
+  {
+    nid = NewFile(FileSource, ifp, size, 0, pnid, "put");
+    if (nid != -1 && LinkFile(pnid, name, nid, time(NULL), "put") == -1) { nid = -1; }
+  }
+  if (nid == -1)
+  {
+    return -1;
+  }
+
+  // debug
+  fprintf(out, "Put file: %s (size=%" PRIu64 "), node #%d\n", name, inodes[nid].size, nid);
+
+  return 0;
+}
+
+int Put(const char *fname, const char *dest)
+{
+  // Open the input file read-only 
+  uint64_t t = SpanStart();
+  FILE *ifp = fopen ( fname, "r" ); 
+  if (!ifp) // cannot open file
+  {
+    fprintf(out, "put error: File does not exist.\n");
+    return -1;
+  }
+  int    status;                   // Hold the status of all return values.
+  struct stat buf;                 // stat struct to hold the returns from the stat call
+  status =  stat( fname, &buf ); 
+  SpanStop("open input", t);
+  if (status == -1)
+  {
+    perror("put error: stat");
+    fclose( ifp );
+    return -1;
+  }
+
+  fprintf(out, "Reading %" PRId64 " bytes from %s\n", (int64_t) buf . st_size, fname );
+  int ret = PutStream(ifp, buf . st_size, BaseName(fname), dest);
+
+  // We are done copying from the input file so close it out.
+  fclose( ifp );
+  return ret;
+}
+
+// reads a file of the image from the start, to copy it
+struct File_Reader {
+  int      nid;
+  uint64_t pos;
+};
+
+int InodeSource(void *ctx, void *buf, size_t n)
+{
+  struct File_Reader *r = ctx;
+  uint8_t *dst = buf;
+  uint64_t mapped = MappedBlocks(r->nid) * BLOCK_SIZE;
+  while (n > 0)
+  {
+    const uint8_t *src = NULL;
+    size_t take = n;
+    if (r->pos < mapped)
+    {
+      uint32_t bid = BlockOf(r->nid, r->pos / BLOCK_SIZE);
+      uint64_t off = r->pos % BLOCK_SIZE;
+      if (take > BLOCK_SIZE - off) { take = BLOCK_SIZE - off; }
+      if (bid) { src = blocks[bid] + off; }
+    }
+    else if (FileEnd(r->nid))
+    {
+      src = FileEnd(r->nid) + ( r->pos - mapped );
+    }
+    if (src) { memcpy(dst, src, take); }
+    else { memset(dst, 0, take); }
+    dst += take;
+    r->pos += take;
+    n -= take;
+  }
+  return 1;
+}
+
+// `reserve file size`: give a file, a new empty one if there is none, blocks
+// for size bytes in as few runs as free space allows. Those past its end are
+// marked reserved, so they count as used, and puts of the file fill them in
+// place (see PutInPlace) until it outgrows them.
+int Reserve(const char *fname, const char *size_str)
+{
+  uint64_t room = ParseSize(size_str);
+  if (room == 0)
+  {
+    fprintf(out, "reserve error: Invalid size \"%s\".\n", size_str);
+    return -1;
+  }
+  char name[MAX_NAME_LEN + 1];
+  int pnid = NameiParent(fname, name);
+  if (pnid < 0)
+  {
+    fprintf(out, "reserve error: %s.\n", pnid == -2 ? "File name too long" : "No such directory");
+    return -1;
+  }
+  // the directory stays locked while the file is copied, as for a put in
+  // place, so no put replaces or writes into it meanwhile
+  LockDir(pnid);
+  int slot;
+  struct BTree_Node *entry = BTreeLookup(pnid, name, &slot);
+  int old = entry ? (int) entry->inode[slot] : -1;
+  if (old != -1 && PutCheck(old, name, "reserve") == -1)
+  {
+    UnlockDir(pnid);
+    return -1;
+  }
+  uint64_t size = old != -1 ? inodes[old].size : 0;
+  if (old != -1 && ( room <= size || ( MappedBlocks(old) + ReservedOf(old) ) * BLOCK_SIZE >= room ))
+  {
+    UnlockDir(pnid);
+    fprintf(out, "reserve: \"%s\" already has room for %" PRIu64 " bytes.\n", name, room);
+    return 0;
+  }
+
+  // a copy of the file in a fresh run, taking the place of the old one
+  struct File_Reader r = { old, 0 };
+  int nid = NewFile(InodeSource, &r, size, room, pnid, "reserve");
+  int linked = nid != -1 && LinkEntry(pnid, name, nid, old != -1 ? entry->time[slot] : time(NULL), "reserve") == 0;
+  UnlockDir(pnid);
+  if (!linked)
+  {
+    if (nid != -1) { Discard(nid); }
+    return -1;
+  }
+  uint64_t num_blocks = MappedBlocks(nid) + ReservedOf(nid), runs = 0;
+  for (uint64_t id = 0; id < num_blocks; ++runs)
+  {
+    uint32_t bid;
+    id += RunOf(nid, id, num_blocks, &bid);
+  }
+  fprintf(out, "Reserved %" PRIu64 " bytes for %s in %" PRIu64 " run%s.\n", num_blocks * BLOCK_SIZE, name, runs,
+          runs == 1 ? "" : "s");
+  return 0;
+}
+
+// find the file a get refers to, -1 with a message if there is none
+int GetInode(const char* fname)
+{
+  uint64_t t = SpanStart();
+  int nid = Namei(fname);
+  SpanStop("lookup", t);
+  if (nid == -1)
+  {
+    fprintf(out, "get error: File not found.\n");
+    return -1;
+  }
+  if (inodes[nid].type == INODE_DIR)
+  {
+    fprintf(out, "get error: \"%s\" is a directory.\n", fname);
+    return -1;
+  }
+  return nid;
+}
+
+// Copy the contents of file fname out to ofp. Files bigger than a pipe chunk
+// go through a pipe (see Archives) so that gathering the next chunk from the
+// image overlaps writing the last one; smaller ones are written here, each run
+// of adjacent blocks in one piece.
+int GetStream(const char* fname, FILE *ofp)
+{
+  int nid = GetInode(fname);
+  if (nid == -1)
+  {
+    return -1;
+  }
+
+  uint64_t size = inodes[nid].size;
+  if (pipeDepth > 0 && size > PIPE_CHUNK)
+  {
+    return GetPiped(nid, ofp);
+  }
+
+  static const uint8_t zero[BLOCK_SIZE];
+  uint64_t num_blocks = MappedBlocks(nid);
+  for (uint64_t id = 0; id < num_blocks; )
+  {
+    uint32_t bid;
+    uint64_t k = RunOf(nid, id, num_blocks, &bid);
+    uint64_t bytes = size - id * BLOCK_SIZE < k * BLOCK_SIZE ? size - id * BLOCK_SIZE : k * BLOCK_SIZE;
+    uint64_t t = SpanStart();
+    size_t wrote = fwrite(bid ? blocks[bid] : zero, 1, bytes, ofp);
+    SpanStop("write output", t);
+    if (wrote != bytes)
+    {
+      fprintf(out, "get error: Failed to write the output.\n");
+      return -1;
+    }
+    id += k;
+  }
+  // an inline file is copied straight out of its inode
+  if (num_blocks * BLOCK_SIZE < size)
+  {
+    uint64_t rest = size - num_blocks * BLOCK_SIZE;
+    if ( fwrite(FileEnd(nid), 1, rest, ofp) != rest )
+    {
+      fprintf(out, "get error: Failed to write the output.\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int GetDest(const char* fname, const char* dest)
+{
+  int nid = GetInode(fname);
+  if (nid == -1)
+  {
+    return -1;
+  }
+
+  FILE *ofp;
+  ofp = fopen(dest, "w");
+
+  if( ofp == NULL )
+  {
+    fprintf(out, "Could not open output file: %s\n", dest );
+    perror("Opening output file returned");
+    return -1;
+  }
+
+  fprintf(out, "Writing %" PRIu64 " bytes to %s\n", inodes[nid].size, dest );
+  int ret = GetStream(fname, ofp);
+
+  // Close the output file, we're done. 
+  fclose( ofp );
+  return ret;
+}
+
+// without a destination the file lands in the host's cwd under its own name
+int Get(const char* fname)
+{
+  return GetDest(fname, BaseName(fname));
+}
+
+int Del(const char * fname)
+{
+  char name[MAX_NAME_LEN + 1];
+  int pnid = NameiParent(fname, name);
+  if (pnid < 0)
+  {
+    fprintf(out, "del error: File not found.\n");
+    return -1;
+  }
+  LockDir(pnid);
+  int slot;
+  struct BTree_Node *entry = BTreeLookup(pnid, name, &slot);
+  if (!entry) 
+  {
+    fprintf(out, "del error: File not found.\n");
+  }
+  else 
+  {
+    int nid = entry->inode[slot];
+    if (inodes[nid].type == INODE_DIR)
+    {
+      fprintf(out, "del error: \"%s\" is a directory, use rmdir.\n", fname);
+      UnlockDir(pnid);
+      return -1;
+    }
+    if ( WritePermission(nid) )
+    {
+      // the tree copy may need blocks when the disk is completely full
+      if (BTreeDelete(pnid, name) == 0) { Retire(nid, 1); }
+      else { fprintf(out, "del error: Not enough disk space.\n"); }
+    }
+    else
+    {
+      fprintf(out, "del error: No permission to delete file \"%s\"\n", fname);
+    }
+  }
+  UnlockDir(pnid);
+  return entry ? 0 : -1;
+}
+
+// create an empty directory called name under pnid, which callers hold locked
+// returns its inode, -1 when out of inodes, -2 when out of space
+int MakeDir(int pnid, const char *name, int64_t time)
+{
+  int nid = AllocInode();
+  if (nid == -1)
+  {
+    return -1;
+  }
+  int root = AllocBlock();
+  if (root != -1)
+  {
+    InitNode(root, 1);
+    inodes[nid].type = INODE_DIR;
+    inodes[nid].attribute = 0;
+    inodes[nid].parent = pnid;
+    inodes[nid].size = 0;
+    inodes[nid].direct[0] = root;
+  }
+  if (root == -1 || BTreeInsert(pnid, name, nid, time) == -1)
+  {
+    pthread_mutex_lock(&allocLock);
+    Erase(nid);
+    FreeInode(nid);
+    pthread_mutex_unlock(&allocLock);
+    return -2;
+  }
+  return nid;
+}
+
+int Mkdir(const char *path)
+{
+  char name[MAX_NAME_LEN + 1];
+  int pnid = NameiParent(path, name);
+  if (pnid == -2)
+  {
+    fprintf(out, "mkdir error: Invalid directory name.\n");
+    return -1;
+  }
+  if (pnid == -1)
+  {
+    fprintf(out, "mkdir error: No such directory.\n");
+    return -1;
+  }
+  LockDir(pnid);
+  int slot;
+  int ret = -1;
+  if (inodes[pnid].flags & INODE_REMOVED)
+  {
+    fprintf(out, "mkdir error: No such directory.\n");
+  }
+  else if (BTreeLookup(pnid, name, &slot))
+  {
+    fprintf(out, "mkdir error: \"%s\" already exists.\n", path);
+  }
+  else
+  {
+    int nid = MakeDir(pnid, name, time(NULL));
+    if (nid == -1)
+    {
+      fprintf(out, "mkdir error: No more empty Inode.\n");
+    }
+    else if (nid == -2)
+    {
+      fprintf(out, "mkdir error: Not enough disk space.\n");
+    }
+    else
+    {
+      ret = 0;
+    }
+  }
+  UnlockDir(pnid);
+  return ret;
+}
+
+int Rmdir(const char *path)
+{
+  char name[MAX_NAME_LEN + 1];
+  int pnid = NameiParent(path, name);
+  int slot;
+  struct BTree_Node *entry = pnid < 0 ? NULL : BTreeLookup(pnid, name, &slot);
+  if (!entry)
+  {
+    fprintf(out, "rmdir error: Directory not found.\n");
+    return -1;
+  }
+  int nid = entry->inode[slot];
+  if (inodes[nid].type != INODE_DIR)
+  {
+    fprintf(out, "rmdir error: \"%s\" is not a directory.\n", path);
+    return -1;
+  }
+  if (nid == cwd)
+  {
+    fprintf(out, "rmdir error: Cannot remove the current directory.\n");
+    return -1;
+  }
+
+  // hold the directory too, so nothing is added to it while it goes
+  LockDirs(pnid, nid);
+  int ret = -1;
+  entry = BTreeLookup(pnid, name, &slot);
+  struct BTree_Node *root = Node(Root(nid));
+  if (!entry || entry->inode[slot] != (uint32_t) nid)
+  {
+    fprintf(out, "rmdir error: Directory not found.\n");
+  }
+  else if (!root->leaf || root->count > 0)
+  {
+    fprintf(out, "rmdir error: Directory not empty.\n");
+  }
+  else if ( !WritePermission(nid) )
+  {
+    fprintf(out, "rmdir error: No permission to delete directory \"%s\"\n", path);
+  }
+  else if (BTreeDelete(pnid, name) == -1)
+  {
+    fprintf(out, "rmdir error: Not enough disk space.\n");
+  }
+  else
+  {
+    inodes[nid].flags |= INODE_REMOVED;
+    Retire(nid, 1); // its root leaf goes with it
+    ret = 0;
+  }
+  UnlockDirs(pnid, nid);
+  return ret;
+}
+
+int Cd(const char *path)
+{
+  int nid = Namei(path);
+  if (nid == -1 || inodes[nid].type != INODE_DIR)
+  {
+    fprintf(out, "cd error: No such directory \"%s\"\n", path);
+    return -1;
+  }
+  // keep a lexically normalized copy of the path for pwd
+  char buf[MAX_PATH_LEN];
+  size_t at = path[0] == '/' ? 0 : strlen(cwdPath) + 1, plen = strlen(path);
+  if (at + plen >= sizeof(buf))
+  {
+    fprintf(out, "cd error: Path too long.\n");
+    return -1;
+  }
+  if (at)
+  {
+    memcpy(buf, cwdPath, at - 1);
+    buf[at - 1] = '/';
+  }
+  memcpy(buf + at, path, plen + 1);
+
+  char out[MAX_PATH_LEN] = "";
+  size_t len = 0;
+  char *save;
+  for (char *c = strtok_r(buf, "/", &save); c; c = strtok_r(NULL, "/", &save))
+  {
+    if (strcmp(c, ".") == 0) { continue; }
+    if (strcmp(c, "..") == 0)
+    {
+      while (len > 0 && out[len-1] != '/') { --len; }
+      if (len > 0) { --len; }
+      out[len] = 0;
+      continue;
+    }
+    len += snprintf(out + len, sizeof(out) - len, "/%s", c);
+    if (len >= sizeof(out)) { len = sizeof(out) - 1; }
+  }
+  snprintf(cwdPath, sizeof(cwdPath), "%s", len ? out : "/");
+  cwd = nid;
+  return 0;
+}
+
+// parse a size like 4096, 64K, 512M or 2G into bytes, 0 on error
+uint64_t ParseSize(const char *str)
+{
+  char *end;
+  uint64_t size = strtoull(str, &end, 10);
+  switch (*end)
+  {
+    case 'G': case 'g': size <<= 30; ++end; break;
+    case 'M': case 'm': size <<= 20; ++end; break;
+    case 'K': case 'k': size <<= 10; ++end; break;
+  }
+  return *end ? 0 : size;
+}
+
+// write the in-memory file system out as an image, with a size given
+// a fresh empty file system of that size is created first
+int Createfs(const char* fname, const char* size_str, int encrypt, const char *parity) 
+{
+  if (encrypt && image)
+  {
+    fprintf(out, "createfs error: Close the opened image first.\n");
+    return -1;
+  }
+  if (parity && !size_str)
+  {
+    fprintf(out, "createfs error: Parity needs a size, it is laid out with a new file system.\n");
+    return -1;
+  }
+  if (size_str)
+  {
+    uint64_t size = ParseSize(size_str);
+    uint64_t num = size / BLOCK_SIZE;
+    if (size == 0 || num > UINT32_MAX)
+    {
+      fprintf(out, "createfs error: Invalid size \"%s\".\n", size_str);
+      return -1;
+    }
+    if (image)
+    {
+      fprintf(out, "createfs error: Close the opened image first.\n");
+      return -1;
+    }
+    if ( Initialize(num) == -1 || ( parity && SetupParity(parity) == -1 ) )
+    {
+      Initialize(BLOCK_NUM);
+      return -1;
+    }
+  }
+
+  if (encrypt && UnlockImage(super, 1, "createfs") == -1)
+  {
+    return -1;
+  }
+
+  FILE *ofp;
+  ofp = fopen(fname, "w");
+
+  if( ofp == NULL )
+  {
+    fprintf(out, "Could not open output file: %s\n", fname );
+    perror("Opening output file returned");
+    return -1;
+  }
+
+  ReclaimFrom(1); // nothing else runs while the shell writes an image
+  size_t size = WriteBlocks(ofp);
+  if (size != super->block_num)
+  {
+    perror("createfs error: Failed to write all blocks.");
+    fclose(ofp);
+    return -1;
+  }
+  fclose(ofp);
+  return 0;
+}
+
+// list orders besides the name order of the tree
+enum List_Sort { SORT_NAME, SORT_SIZE, SORT_TIME };
+
+struct List_Entry {
+  struct BTree_Node *leaf;          // of the version being listed, kept until the command ends
+  int      i;
+  uint64_t size;                    // as it was when the entry was reached
+};
+
+// largest first, equal sizes by name
+int CompareListSize(const void *a, const void *b)
+{
+  const struct List_Entry *x = a, *y = b;
+  if (x->size != y->size) { return x->size > y->size ? -1 : 1; }
+  return KeyCmp(NodeName(x->leaf, x->i), x->leaf->len[x->i], NodeName(y->leaf, y->i), y->leaf->len[y->i]);
+}
+
+// newest first, equal times by name
+int CompareListTime(const void *a, const void *b)
+{
+  const struct List_Entry *x = a, *y = b;
+  int64_t tx = x->leaf->time[x->i], ty = y->leaf->time[y->i];
+  if (tx != ty) { return tx > ty ? -1 : 1; }
+  return KeyCmp(NodeName(x->leaf, x->i), x->leaf->len[x->i], NodeName(y->leaf, y->i), y->leaf->len[y->i]);
+}
+
+void PrintDir(struct BTree_Node *leaf, int i)
+{
+  int nid = leaf->inode[i];
+  time_t t = leaf->time[i];
+  char when[32];
+  uint8_t attribute = __atomic_load_n(&inodes[nid].attribute, __ATOMIC_RELAXED);
+  char attr[5];
+  attr[0] = 'h';
+  attr[1] = PLUSMINUS( ATTRIBUTE_GET_H(attribute) );
+  //fprintf(out, "(%d) converted to (%c)\n", inodes[nid].attribute, attr[1]);
+  attr[2] = 'r';
+  attr[3] = PLUSMINUS( ATTRIBUTE_GET_R(attribute) );
+  attr[4] = 0;
+
+  fprintf(out, "%" PRIu64 " | %s | %s | %s%s\n", inodes[nid].size, ctime_r(&t, when),
+                                          attr, NodeName(leaf, i), inodes[nid].type == INODE_DIR ? "/" : "");
+}
+
+// createfs with the options after the file name, -2 if they make no sense
+int CreatefsArgs(const char *fname, char **arg, int argc)
+{
+  int encrypt = 0;
+  const char *size = NULL, *parity = NULL;
+  for (int i = 0; i < argc; ++i)
+  {
+    if (strcmp("-e", arg[i]) == 0) { encrypt = 1; }
+    else if (strcmp("-p", arg[i]) == 0 && i + 1 < argc) { parity = arg[++i]; }
+    else if (!size && arg[i][0] != '-') { size = arg[i]; }
+    else { return -2; }
+  }
+  return Createfs(fname, size, encrypt, parity);
+}
+
+// List a directory, or the entries of one whose names match a glob pattern
+// (a path that does not name a directory). Entries come out of the tree
+// already sorted by name, all from one version of the directory however it
+// changes meanwhile, so a pattern starting with a plain prefix, like build-*,
+// only visits the entries with that prefix. By size or time the matches are
+// sorted after.
+int List(int showAll, const char *path, int sort) // if show then print all hidden files
+{
+  int dnid = path ? Namei(path) : cwd;
+  const char *pattern = NULL;
+  if (path && ( dnid == -1 || inodes[dnid].type != INODE_DIR ))
+  {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    pattern = slash ? path + ( slash - dir ) + 1 : path;
+    if (slash == dir) { dir[1] = 0; }   // a pattern in the root
+    else if (slash) { *slash = 0; }
+    dnid = slash ? Namei(dir) : cwd;
+  }
+  if (dnid == -1 || inodes[dnid].type != INODE_DIR)
+  {
+    fprintf(out, "list error: No such directory \"%s\"\n", path);
+    return -1;
+  }
+
+  int found = 0;
+  size_t count = 0, cap = 0;
+  struct List_Entry *sorted = NULL;
+  int plen = pattern ? strcspn(pattern, "*?[\\") : 0;
+  struct BTree_Cursor c;
+  int more = plen ? CursorSeek(&c, dnid, pattern, plen) : CursorFirst(&c, dnid);
+  for ( ; more; more = CursorNext(&c))
+  {
+    struct BTree_Node *leaf = c.leaf;
+    int i = c.i;
+    if (plen && ( leaf->len[i] < plen || memcmp(NodeName(leaf, i), pattern, plen) != 0 )) { break; } // past the prefix
+    if (pattern && fnmatch(pattern, NodeName(leaf, i), 0) != 0) { continue; }
+    uint32_t nid = leaf->inode[i];
+    if (nid >= super->inode_num) // this should not happen
+    {
+      fprintf(out, "list error: Illegal inode index(%d) found in file '%s'\n", nid, NodeName(leaf, i));
+      return -1;
+    }
+    int hidden = ATTRIBUTE_GET_H( __atomic_load_n(&inodes[nid].attribute, __ATOMIC_RELAXED) );
+    if ( !showAll && hidden ) { continue; }
+    found = 1;
+    if (sort == SORT_NAME)
+    {
+      PrintDir(leaf, i);
+    }
+    else
+    {
+      if (count == cap)
+      {
+        cap = cap ? cap * 2 : 64;
+        sorted = realloc(sorted, cap * sizeof(*sorted));
+        assert(sorted);
+      }
+      sorted[count].leaf = leaf;
+      sorted[count].i = i;
+      sorted[count++].size = __atomic_load_n(&inodes[nid].size, __ATOMIC_ACQUIRE);
+    }
+  }
+  if (count > 0)
+  {
+    qsort(sorted, count, sizeof(*sorted), sort == SORT_SIZE ? CompareListSize : CompareListTime);
+    for (size_t k = 0; k < count; ++k) { PrintDir(sorted[k].leaf, sorted[k].i); }
+  }
+  free(sorted);
+
+  if (!found)
+  {
+    fprintf(out, "list: No files found.\n");
+  }
+
+  return 0;
+}
+
+// list with its options: [-a] [--sort name|size|time] [path | pattern]
+int ListArgs(char **arg, int argc)
+{
+  int showAll = 0, sort = SORT_NAME;
+  const char *path = NULL;
+  for (int i = 0; i < argc; ++i)
+  {
+    const char *by = strcmp("--sort", arg[i]) == 0 && i + 1 < argc ? arg[i+1] : "";
+    if (strcmp("-a", arg[i]) == 0) { showAll = 1; }
+    else if (strcmp("name", by) == 0) { sort = SORT_NAME; ++i; }
+    else if (strcmp("size", by) == 0) { sort = SORT_SIZE; ++i; }
+    else if (strcmp("time", by) == 0) { sort = SORT_TIME; ++i; }
+    else if (!path && arg[i][0] != '-') { path = arg[i]; }
+    else
+    {
+      fprintf(out, "Usage: list [-a] [--sort name|size|time] [path | pattern]\n");
+      return -1;
+    }
+  }
+  return List(showAll, path, sort);
+}
+
+int Open(const char *fname)
+{
+  // the open image would be dropped with its changes, its lock and its flusher
+  if (image)
+  {
+    fprintf(out, "open error: \"%s\" is open, close it first.\n", imagePath);
+    return -1;
+  }
+  // Open the input file for read and write
+  image = fopen ( fname, "r+" ); 
+  snprintf(imagePath, sizeof(imagePath), "%s", fname);
+
+  int    status;                   // Hold the status of all return values.
+  struct stat buf;                 // stat struct to hold the returns from the stat call
+  status =  stat( fname , &buf ); 
+  if (status == -1 || image == NULL)
+  {
+    perror("open error: File not found.");
+    if (image) { fclose(image); image = NULL; }
+    return -1;
+  }
+  // another shell or server working on the image would overwrite our changes
+  if (flock(fileno(image), LOCK_EX | LOCK_NB) == -1)
+  {
+    fprintf(out, "open error: Image is in use by another process.\n");
+    fclose(image);
+    image = NULL;
+    return -1;
+  }
+  // a checkpoint committed to the journal but not all written in place
+  if (JournalReplay(fileno(image), buf.st_size) == -1)
+  {
+    fprintf(out, "open error: Failed to finish the last checkpoint from its journal.\n");
+    fclose(image);
+    image = NULL;
+    return -1;
+  }
+
+  // the super block tells how large the rest of the image is
+  struct Super_Block sb;
+  if ( fread(&sb, sizeof(sb), 1, image) != 1 || sb.magic != FS_MAGIC || sb.version < 3 || sb.version > FS_VERSION)
+  {
+    fprintf(out, "open error: Not an image of this file system version.\n");
+    fclose(image);
+    image = NULL;
+    return -1;
+  }
+  // quick check the file size
+  if (buf.st_size != (off_t) sb.block_num * BLOCK_SIZE)
+  {
+    fprintf(out, "open error: Wrong file size.\n");
+    fclose(image);
+    image = NULL;
+    return -1;
+  }
+  if ( ( sb.flags & SUPER_ENCRYPTED ) && UnlockImage(&sb, 0, "open") == -1 )
+  {
+    fclose(image);
+    image = NULL;
+    return -1;
+  }
+
+  rewind(image);
+  uint64_t t = SpanStart();
+  int loaded = AllocStore(sb.block_num) == 0 && fread(&blocks[0], BLOCK_SIZE, sb.block_num, image) == sb.block_num;
+  SpanStop("read image", t);
+  if (!loaded)
+  {
+    fprintf(out, "open error: Failed to read blocks.\n");
+    fclose(image);
+    image = NULL;
+    Initialize(BLOCK_NUM);
+    return -1;
+  }
+  if (imageKey.on) { CryptBlocks(NULL, 1, sb.block_num - 1, 1); }
+  t = SpanStart();
+  MapMetadata();
+  SpanStop("map", t);
+  t = SpanStart();
+  uint64_t lost = super->parity_start ? VerifyBlocks(0, "open") : 0;
+  SpanStop("verify", t);
+  if (lost > 0)
+  {
+    fprintf(out, "open: Some damaged blocks are lost, run fsck.\n");
+  }
+  MapMetadata(); // the maps may have been rebuilt
+  super->version = FS_VERSION; // version 3 is read as it is, but may not stay readable by old builds
+  cwd = super->root;
+  strcpy(cwdPath, "/");
+  FlushStart(lost == 0);
+  
+  return 0;
+}
+
+int Close()
+{
+  if (image == NULL)
+  {
+    fprintf(out, "close error: No opened image file.\n");
+    return -1;
+  }
+  else
+  {
+    // callers make sure no other command is running; with write-back on the
+    // last changes go through the journal too, so a crash leaves a checkpoint
+    ReclaimFrom(1);
+    int saved = flushStarted ? FlushSync() : -1;
+    FlushStop();
+    fflush(image);
+    if (saved == -1) { saved = SaveBlocks(fileno(image)); }
+    // an image resized in memory only may have been bigger
+    if (saved == -1 || ftruncate(fileno(image), (off_t) super->block_num * BLOCK_SIZE) == -1)
+    {
+      fprintf(out, "close error: Failed to write all blocks.\n");
+      perror("error");
+      return -1;
+    }
+    JournalRemove();
+    fclose(image);
+    image = NULL;
+    Initialize(BLOCK_NUM); // reset the metadata
+    return 0;
+  }
+}
+
+int Attrib(char attr, char sign, const char* fname)
+{
+  int nid = Namei(fname);
+  if (nid == -1)
+  {
+    fprintf(out, "attrib error: No such file \"%s\"\n",fname);
+    return -1;
+  }
+  // a put replacing the file holds its directory, so look again under the lock
+  int pnid = inodes[nid].parent;
+  LockDir(pnid);
+  while (Namei(fname) != nid)
+  {
+    UnlockDir(pnid);
+    nid = Namei(fname);
+    if (nid == -1)
+    {
+      fprintf(out, "attrib error: No such file \"%s\"\n",fname);
+      return -1;
+    }
+    pnid = inodes[nid].parent;
+    LockDir(pnid);
+  }
+  // fprintf(out, "inode #%d, attr = %d\n", nid, inodes[nid].attribute);
+  uint8_t *a = &inodes[nid].attribute;
+  if (attr == 'h')
+  {
+    if (sign == '+') { __atomic_xor_fetch(a, 2, __ATOMIC_RELAXED); }       // attr ^= 0b10
+    else if (sign == '-') { __atomic_and_fetch(a, 1, __ATOMIC_RELAXED); }  // attr &= 0b01
+  }
+  else if (attr == 'r')
+  {
+    if (sign == '+') { __atomic_xor_fetch(a, 1, __ATOMIC_RELAXED); }
+    else if (sign == '-') { __atomic_and_fetch(a, 2, __ATOMIC_RELAXED); }
+  }
+  UnlockDir(pnid);
+  
+  // fprintf(out, "inode #%d, attr = %d\n", nid, inodes[nid].attribute);
+  return 0;
+}
+
+int AttribHelper(const char* str, const char* fname)
+{
+  // fprintf(out, "ahelper len = %zu|%s\n", strlen(str), str);
+  // fprintf(out, "(%c)(%c)\n", str[0], str[1]);
+  if (strlen(str) != 2 || ( str[1] != 'h' && str[1] != 'r' ) || ( str[0] != '+' && str[0] != '-'))
+  {
+    fprintf(out, "attrib error: Wrong command format.\n");
+    return -1;
+  }
+  else
+  {
+    int ret = Attrib(str[1],str[0], fname);
+    return ret;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Consistency check
+//
+// `fsck [-r]` walks the tree from the root on several threads, each taking
+// the next inode found in a directory, and claims every block it reaches for
+// its inode. Tail blocks are claimed by all their files, unit by unit. Blocks
+// or units claimed twice, pointers out of range, broken directory nodes and
+// inodes named by more than one entry are reported. The threads then compare
+// their share of the maps, tail block headers included, to what was reached,
+// and with -r rebuild them from it. It needs the image to itself, so the server does not
+// offer it.
+
+#define MAX_FSCK_THREADS 64
+#define FSCK_MAX_REPORTS 50
+#define FSCK_TAIL UINT32_MAX        // owner of a tail block
+
+struct Fsck {
+  FILE     *out;                    // the caller's, out is per thread
+  int       rebuild;
+  int       nthreads;
+  uint32_t *owner;                  // per block: inode that reached it + 1, 0 = none
+  uint8_t (*units)[TAIL_UNITS / 8]; // per block: tail units reached
+  uint32_t *refs;                   // per inode: directory entries naming it
+  uint32_t *from;                   // per inode: directory it was found in
+  uint32_t *stack;                  // found, not walked yet
+  uint32_t  top;
+  int       busy;                   // threads walking an inode
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  pthread_barrier_t barrier;
+  uint64_t  problems;
+};
+
+struct Fsck_Thread {
+  struct Fsck *f;
+  int      index;
+  int      leafDepth;               // of the directory being walked, -1 = no leaf yet
+  uint64_t inodes;                  // reached
+  uint64_t blocks;
+  uint64_t metaFree;                // metadata blocks marked free
+  uint64_t leaked;                  // marked in use, not reached
+  uint64_t unmarked;                // reached, marked free
+  uint64_t orphans;                 // inodes marked in use, not reached
+  uint64_t lost;                    // inodes reached, marked free
+  uint64_t tails;                   // tail blocks whose header is wrong
+};
+
+void FsckReport(struct Fsck *f, const char *fmt, ...)
+{
+  va_list ap;
+  pthread_mutex_lock(&f->lock);
+  if (++f->problems <= FSCK_MAX_REPORTS)
+  {
+    va_start(ap, fmt);
+    fprintf(f->out, "fsck: ");
+    vfprintf(f->out, fmt, ap);
+    va_end(ap);
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+// a found inode for some thread to walk
+void FsckPush(struct Fsck *f, uint32_t nid, uint32_t dnid)
+{
+  f->from[nid] = dnid;
+  pthread_mutex_lock(&f->lock);
+  f->stack[f->top++] = nid;
+  pthread_cond_signal(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+// next inode to walk, -1 once none is left and nobody can find more
+int FsckPop(struct Fsck *f)
+{
+  int nid = -1;
+  pthread_mutex_lock(&f->lock);
+  while (f->top == 0 && f->busy > 0) { pthread_cond_wait(&f->cond, &f->lock); }
+  if (f->top > 0)
+  {
+    nid = f->stack[--f->top];
+    ++f->busy;
+  }
+  else
+  {
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return nid;
+}
+
+void FsckDone(struct Fsck *f)
+{
+  pthread_mutex_lock(&f->lock);
+  if (--f->busy == 0 && f->top == 0) { pthread_cond_broadcast(&f->cond); }
+  pthread_mutex_unlock(&f->lock);
+}
+
+// a directory node is sane enough to follow
+int FsckNodeOk(struct BTree_Node *node, int depth)
+{
+  if (node->leaf > 1 || node->count > BTREE_SLOTS || depth >= BTREE_MAX_DEPTH) { return 0; }
+  if (node->heap < BTREE_HEAP_START || node->heap > BLOCK_SIZE) { return 0; }
+  for (int i = 0; i < node->count; ++i)
+  {
+    if (node->off[i] < node->heap || node->off[i] + node->len[i] > BLOCK_SIZE) { return 0; }
+    if (node->hash[i] != NameHash(NodeName(node, i), node->len[i])) { return 0; }
+    if (i > 0 && KeyCmp(NodeName(node, i-1), node->len[i-1], NodeName(node, i), node->len[i]) >= 0) { return 0; }
+  }
+  return 1;
+}
+
+// claim the units holding the end of file nid in tail block bid
+int FsckTail(struct Fsck_Thread *t, int nid, uint32_t bid, int unit)
+{
+  struct Fsck *f = t->f;
+  int n = TailUnits(inodes[nid].size % BLOCK_SIZE);
+  if (Tail(bid)->magic != TAIL_MAGIC || unit < 1 || n == 0 || unit + n > TAIL_UNITS)
+  {
+    FsckReport(f, "Inode %d has a broken tail in block %u.\n", nid, bid);
+    return 1;
+  }
+  for (int u = unit; u < unit + n; ++u)
+  {
+    if (__atomic_fetch_or(&f->units[bid][u / 8], 1 << ( u % 8 ), __ATOMIC_RELAXED) & ( 1 << ( u % 8 ) ))
+    {
+      FsckReport(f, "Inode %d shares unit %d of tail block %u with another file.\n", nid, u, bid);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int FsckBlock(void *ctx, int nid, uint32_t *slot, int kind, int level)
+{
+  struct Fsck_Thread *t = ctx;
+  struct Fsck *f = t->f;
+  uint32_t bid = *slot;
+  if (bid < super->data_start || bid >= DataEnd())
+  {
+    FsckReport(f, "Inode %d points to block %u, outside the data area.\n", nid, bid);
+    return 1;
+  }
+  uint32_t none = 0;
+  uint32_t claim = kind == BLOCK_TAIL ? FSCK_TAIL : (uint32_t) nid + 1;
+  if (!__atomic_compare_exchange_n(&f->owner[bid], &none, claim, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+      ( none != FSCK_TAIL || claim != FSCK_TAIL ))
+  {
+    if (none == FSCK_TAIL || claim == FSCK_TAIL)
+    {
+      FsckReport(f, "Block %u is a tail block and a block of inode %u.\n", bid, none == FSCK_TAIL ? nid : none - 1);
+    }
+    else
+    {
+      FsckReport(f, "Block %u is used by inodes %u and %d.\n", bid, none - 1, nid);
+    }
+    return 1;
+  }
+  if (none == 0) { ++t->blocks; }
+  if (kind == BLOCK_TAIL) { return FsckTail(t, nid, bid, level); }
+  if (kind != BLOCK_NODE) { return 0; }
+
+  struct BTree_Node *node = Node(bid);
+  if (!FsckNodeOk(node, level))
+  {
+    FsckReport(f, "Directory %d has a broken node in block %u.\n", nid, bid);
+    return 1;
+  }
+  if (!node->leaf) { return 0; }
+  if (t->leafDepth == -1) { t->leafDepth = level; }
+  if (t->leafDepth != level)
+  {
+    FsckReport(f, "Directory %d has leaves at depth %d and %d.\n", nid, t->leafDepth, level);
+  }
+  for (int i = 0; i < node->count; ++i)
+  {
+    uint32_t child = node->inode[i];
+    if (child >= super->inode_num || child == super->root)
+    {
+      FsckReport(f, "Entry \"%.*s\" in directory %d names inode %u.\n", node->len[i], NodeName(node, i), nid, child);
+    }
+    else if (__atomic_fetch_add(&f->refs[child], 1, __ATOMIC_RELAXED) == 0)
+    {
+      FsckPush(f, child, nid);
+    }
+    else
+    {
+      FsckReport(f, "Inode %u is named again by \"%.*s\" in directory %d.\n", child, node->len[i], NodeName(node, i), nid);
+    }
+  }
+  return 0;
+}
+
+void *FsckThread(void *arg)
+{
+  struct Fsck_Thread *t = arg;
+  struct Fsck *f = t->f;
+
+  // reach everything from the root
+  for (int nid; ( nid = FsckPop(f) ) != -1; FsckDone(f))
+  {
+    struct Inode *inode = &inodes[nid];
+    ++t->inodes;
+    if (inode->type != INODE_FILE && inode->type != INODE_DIR)
+    {
+      FsckReport(f, "Inode %d has an unknown type %d.\n", nid, inode->type);
+      continue;
+    }
+    if (inode->type == INODE_DIR && inode->parent != f->from[nid])
+    {
+      FsckReport(f, "Directory %d is in directory %u but names %u as its parent.\n", nid, f->from[nid], inode->parent);
+    }
+    t->leafDepth = -1;
+    VisitBlocks(nid, FsckBlock, t);
+  }
+  pthread_barrier_wait(&f->barrier);
+
+  // compare this thread's share of the maps
+  uint32_t lo = (uint64_t) super->block_num * t->index / f->nthreads;
+  uint32_t hi = (uint64_t) super->block_num * ( t->index + 1 ) / f->nthreads;
+  for (uint32_t b = lo; b < hi; ++b)
+  {
+    int reserved = b < super->data_start || b >= DataEnd();
+    int used = reserved || f->owner[b] != 0;
+    if (reserved) { t->metaFree += blockMap[b] == 0; }
+    else if (blockMap[b] && !used) { ++t->leaked; }
+    else if (!blockMap[b] && used) { ++t->unmarked; }
+    if (f->rebuild) { blockMap[b] = !used ? 0 : blockMap[b] == 2 && !reserved ? 2 : 1; }
+    if (f->owner[b] != FSCK_TAIL) { continue; }
+
+    // a tail block's header lists exactly the units reached
+    struct Tail_Header *h = Tail(b);
+    f->units[b][0] |= 1;
+    int used_units = 0;
+    for (int i = 0; i < TAIL_UNITS / 8; ++i) { used_units += __builtin_popcount(f->units[b][i]); }
+    if (memcmp(h->map, f->units[b], sizeof(h->map)) != 0 || h->used != used_units)
+    {
+      ++t->tails;
+      if (f->rebuild)
+      {
+        memcpy(h->map, f->units[b], sizeof(h->map));
+        h->used = used_units;
+        MarkDirty(b, 1);
+      }
+    }
+  }
+  lo = (uint64_t) super->inode_num * t->index / f->nthreads;
+  hi = (uint64_t) super->inode_num * ( t->index + 1 ) / f->nthreads;
+  for (uint32_t i = lo; i < hi; ++i)
+  {
+    int reached = f->refs[i] != 0 || i == super->root;
+    if (inodeMap[i] && !reached)
+    {
+      ++t->orphans;
+      if (f->rebuild) { memset(&inodes[i], 0, sizeof(struct Inode)); }
+    }
+    else if (!inodeMap[i] && reached) { ++t->lost; }
+    if (f->rebuild) { inodeMap[i] = reached; }
+  }
+  return NULL;
+}
+
+// runs as the only command on the image
+int Fsck(int rebuild)
+{
+  ReclaimFrom(1); // retired blocks are still marked in use
+  struct Fsck f;
+  memset(&f, 0, sizeof(f));
+  f.out = out;
+  f.rebuild = rebuild;
+  f.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (f.nthreads < 1) { f.nthreads = 1; }
+  if (f.nthreads > MAX_FSCK_THREADS) { f.nthreads = MAX_FSCK_THREADS; }
+  f.owner = calloc(super->block_num, sizeof(uint32_t));
+  f.units = calloc(super->block_num, sizeof(*f.units));
+  f.refs = calloc(super->inode_num, sizeof(uint32_t));
+  f.from = calloc(super->inode_num, sizeof(uint32_t));
+  f.stack = malloc(super->inode_num * sizeof(uint32_t));
+  if (!f.owner || !f.units || !f.refs || !f.from || !f.stack)
+  {
+    fprintf(out, "fsck error: Out of memory.\n");
+    free(f.owner); free(f.units); free(f.refs); free(f.from); free(f.stack);
+    return -1;
+  }
+  pthread_mutex_init(&f.lock, NULL);
+  pthread_cond_init(&f.cond, NULL);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (super->root >= super->inode_num || inodes[super->root].type != INODE_DIR)
+  {
+    FsckReport(&f, "The root inode is not a directory.\n");
+  }
+  else
+  {
+    f.stack[f.top++] = super->root;
+    f.from[super->root] = super->root;
+  }
+  struct Fsck_Thread t[MAX_FSCK_THREADS];
+  pthread_t tid[MAX_FSCK_THREADS];
+  memset(t, 0, sizeof(t));
+  // the threads wait for the lock in their first FsckPop, so none reaches
+  // the barrier before it is set up for as many as could be started
+  pthread_mutex_lock(&f.lock);
+  int started = 1;
+  for ( ; started < f.nthreads; ++started)
+  {
+    t[started].f = &f;
+    t[started].index = started;
+    if (pthread_create(&tid[started], NULL, FsckThread, &t[started]) != 0) { break; }
+  }
+  t[0].f = &f;
+  f.nthreads = started;
+  pthread_barrier_init(&f.barrier, NULL, f.nthreads);
+  pthread_mutex_unlock(&f.lock);
+  FsckThread(&t[0]);
+  for (int i = 1; i < f.nthreads; ++i) { pthread_join(tid[i], NULL); }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  struct Fsck_Thread sum;
+  memset(&sum, 0, sizeof(sum));
+  for (int i = 0; i < f.nthreads; ++i)
+  {
+    sum.inodes += t[i].inodes;
+    sum.blocks += t[i].blocks;
+    sum.metaFree += t[i].metaFree;
+    sum.leaked += t[i].leaked;
+    sum.unmarked += t[i].unmarked;
+    sum.orphans += t[i].orphans;
+    sum.lost += t[i].lost;
+    sum.tails += t[i].tails;
+  }
+  uint64_t structural = f.problems;
+  if (sum.metaFree) { fprintf(out, "fsck: %" PRIu64 " metadata blocks are marked free.\n", sum.metaFree); }
+  if (sum.leaked) { fprintf(out, "fsck: %" PRIu64 " blocks are marked in use but unreachable.\n", sum.leaked); }
+  if (sum.unmarked) { fprintf(out, "fsck: %" PRIu64 " blocks are in use but marked free.\n", sum.unmarked); }
+  if (sum.orphans) { fprintf(out, "fsck: %" PRIu64 " inodes are marked in use but unreachable.\n", sum.orphans); }
+  if (sum.lost) { fprintf(out, "fsck: %" PRIu64 " inodes are in use but marked free.\n", sum.lost); }
+  if (sum.tails) { fprintf(out, "fsck: %" PRIu64 " tail blocks list the wrong units.\n", sum.tails); }
+  uint64_t maps = sum.metaFree + sum.leaked + sum.unmarked + sum.orphans + sum.lost + sum.tails;
+  fprintf(out, "Checked %" PRIu64 " inodes and %" PRIu64 " blocks in %.3f s on %d thread%s: ",
+          sum.inodes, sum.blocks, ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9,
+          f.nthreads, f.nthreads > 1 ? "s" : "");
+  if (structural + maps == 0) { fprintf(out, "no problems.\n"); }
+  else { fprintf(out, "%" PRIu64 " problems in the tree, %" PRIu64 " wrong map entries.\n", structural, maps); }
+
+  if (rebuild && maps)
+  {
+    MapMetadata(); // recount the free blocks and restart the hints
+    fprintf(out, "Rebuilt the inode and block maps.\n");
+  }
+  if (rebuild && structural)
+  {
+    fprintf(out, "fsck: The other problems are in the tree itself and were left alone.\n");
+  }
+  else if (!rebuild && maps)
+  {
+    fprintf(out, "Run \"fsck -r\" to rebuild the maps.\n");
+  }
+
+  pthread_barrier_destroy(&f.barrier);
+  pthread_cond_destroy(&f.cond);
+  pthread_mutex_destroy(&f.lock);
+  free(f.owner); free(f.units); free(f.refs); free(f.from); free(f.stack);
+  return structural + maps ? -1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Archives
+//
+// `import archive [path]` and `export archive [path]` move a whole tree in or
+// out as a tar archive (ustar, GNU long names, pax paths when reading); "-" is
+// standard input or output. The archive streams through a pipeline: a thread
+// on the host side reads or writes it in large chunks, the command copies
+// between those chunks and runs of adjacent blocks, and a bounded queue in
+// between lets both work at the same time.
+
+#define PIPE_MAX_DEPTH 64
+#define TAR_BLOCK  512
+
+// chunks the host side of a pipe may be behind or ahead of the command, 0
+// copies a get on the calling thread (`readahead`)
+int pipeDepth = 4;
+
+struct Tar_Header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+// a bounded queue of chunks between a command and a thread doing host I/O
+struct Pipe {
+  FILE    *fp;
+  int      writing;                 // the thread writes to fp, else it reads from it
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int      depth;                   // chunks in the ring
+  char    *buf[PIPE_MAX_DEPTH];
+  size_t   len[PIPE_MAX_DEPTH];
+  int      head;                    // oldest full chunk
+  int      count;                   // full chunks
+  int      done;                    // no chunk follows
+  int      error;
+  size_t   pos;                     // command side: bytes used of its chunk
+  uint64_t total;                   // command side: bytes passed through
+};
+
+// host side of an import: read the archive ahead into free chunks
+void *PipeFill(void *arg)
+{
+  struct Pipe *p = arg;
+  pthread_mutex_lock(&p->lock);
+  while (!p->done)
+  {
+    if (p->count == p->depth)
+    {
+      pthread_cond_wait(&p->cond, &p->lock);
+      continue;
+    }
+    int slot = ( p->head + p->count ) % p->depth;
+    pthread_mutex_unlock(&p->lock);
+    uint64_t t = SpanStart();
+    size_t n = fread(p->buf[slot], 1, PIPE_CHUNK, p->fp);
+    SpanStop("read input", t);
+    int error = ferror(p->fp);
+    pthread_mutex_lock(&p->lock);
+    p->len[slot] = n;
+    if (n > 0) { ++p->count; }
+    if (n < PIPE_CHUNK)
+    {
+      p->done = 1;
+      p->error = error;
+    }
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// host side of an export: write out full chunks until the command is done
+void *PipeDrain(void *arg)
+{
+  struct Pipe *p = arg;
+  pthread_mutex_lock(&p->lock);
+  for (;;)
+  {
+    while (p->count == 0 && !p->done) { pthread_cond_wait(&p->cond, &p->lock); }
+    if (p->count == 0) { break; }
+    int slot = p->head;
+    pthread_mutex_unlock(&p->lock);
+    // after an error chunks are still taken, so the command does not stall
+    uint64_t t = SpanStart();
+    size_t n = p->error ? p->len[slot] : fwrite(p->buf[slot], 1, p->len[slot], p->fp);
+    SpanStop("write output", t);
+    pthread_mutex_lock(&p->lock);
+    if (n < p->len[slot]) { p->error = 1; }
+    p->head = ( p->head + 1 ) % p->depth;
+    --p->count;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+int PipeOpen(struct Pipe *p, FILE *fp, int writing)
+{
+  memset(p, 0, sizeof(*p));
+  p->fp = fp;
+  p->writing = writing;
+  p->depth = pipeDepth > 0 ? pipeDepth : 1;
+  for (int i = 0; i < p->depth; ++i)
+  {
+    p->buf[i] = malloc(PIPE_CHUNK);
+    if (!p->buf[i])
+    {
+      while (i-- > 0) { free(p->buf[i]); }
+      return -1;
+    }
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  if (pthread_create(&p->thread, NULL, writing ? PipeDrain : PipeFill, p) != 0)
+  {
+    for (int i = 0; i < p->depth; ++i) { free(p->buf[i]); }
+    return -1;
+  }
+  return 0;
+}
+
+// Copy n bytes out of an import pipe, or skip them if dst is NULL.
+// Returns 0 if the archive ends first. Fits the Source of NewFile.
+int PipeRead(void *ctx, void *dst, size_t n)
+{
+  struct Pipe *p = ctx;
+  char *d = dst;
+  while (n > 0)
+  {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == 0 && !p->done) { pthread_cond_wait(&p->cond, &p->lock); }
+    int slot = p->count ? p->head : -1;
+    pthread_mutex_unlock(&p->lock);
+    if (slot == -1) { return 0; }
+
+    size_t take = p->len[slot] - p->pos < n ? p->len[slot] - p->pos : n;
+    if (d)
+    {
+      memcpy(d, p->buf[slot] + p->pos, take);
+      d += take;
+    }
+    n -= take;
+    p->pos += take;
+    p->total += take;
+    if (p->pos == p->len[slot]) // hand the chunk back to the reader
+    {
+      pthread_mutex_lock(&p->lock);
+      p->head = ( p->head + 1 ) % p->depth;
+      --p->count;
+      p->pos = 0;
+      pthread_cond_broadcast(&p->cond);
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+  return 1;
+}
+
+// queue the chunk being filled for the writer
+void PipePush(struct Pipe *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->len[ ( p->head + p->count ) % p->depth ] = p->pos;
+  ++p->count;
+  p->pos = 0;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// copy n bytes into an export pipe, zeros if src is NULL, -1 once writing failed
+int PipeWrite(struct Pipe *p, const void *src, size_t n)
+{
+  const char *s = src;
+  while (n > 0)
+  {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == p->depth) { pthread_cond_wait(&p->cond, &p->lock); }
+    int slot = ( p->head + p->count ) % p->depth;
+    int error = p->error;
+    pthread_mutex_unlock(&p->lock);
+    if (error) { return -1; }
+
+    size_t take = PIPE_CHUNK - p->pos < n ? PIPE_CHUNK - p->pos : n;
+    if (s)
+    {
+      memcpy(p->buf[slot] + p->pos, s, take);
+      s += take;
+    }
+    else
+    {
+      memset(p->buf[slot] + p->pos, 0, take);
+    }
+    n -= take;
+    p->pos += take;
+    p->total += take;
+    if (p->pos == PIPE_CHUNK) { PipePush(p); }
+  }
+  return 0;
+}
+
+// stop the host side thread, -1 if its reads or writes failed
+int PipeClose(struct Pipe *p)
+{
+  if (p->writing && p->pos > 0) { PipePush(p); }
+  pthread_mutex_lock(&p->lock);
+  p->done = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+  if (p->writing && fflush(p->fp) == EOF) { p->error = 1; }
+  for (int i = 0; i < p->depth; ++i) { free(p->buf[i]); }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  return p->error ? -1 : 0;
+}
+
+// header numbers are octal, or base-256 with the top bit set when too large
+uint64_t TarNumber(const char *field, int width)
+{
+  uint64_t v = 0;
+  if ( (uint8_t) field[0] & 0x80 )
+  {
+    v = field[0] & 0x7f;
+    for (int i = 1; i < width; ++i) { v = v << 8 | (uint8_t) field[i]; }
+    return v;
+  }
+  for (int i = 0; i < width && field[i] != 0; ++i)
+  {
+    if (field[i] >= '0' && field[i] <= '7') { v = v * 8 + field[i] - '0'; }
+  }
+  return v;
+}
+
+void TarSetNumber(char *field, int width, uint64_t v)
+{
+  if ( v >> ( 3 * ( width - 1 ) ) )
+  {
+    memset(field, 0, width);
+    for (int i = width - 1; i > 0; --i, v >>= 8) { field[i] = v & 0xff; }
+    field[0] = (char) 0x80;
+    return;
+  }
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), "%0*" PRIo64, width - 1, v);
+  memcpy(field, tmp, width);
+}
+
+// sum of the header bytes, counting the checksum field as spaces
+unsigned TarChecksum(const struct Tar_Header *h)
+{
+  const uint8_t *b = (const uint8_t *) h;
+  unsigned sum = 8 * ' ';
+  for (size_t i = 0; i < sizeof(*h); ++i)
+  {
+    if (i < offsetof(struct Tar_Header, chksum) || i >= offsetof(struct Tar_Header, type)) { sum += b[i]; }
+  }
+  return sum;
+}
+
+// zeros up to the next 512 byte record
+int TarPad(struct Pipe *p, uint64_t size)
+{
+  return PipeWrite(p, NULL, ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK);
+}
+
+// write the header of one entry, preceded by a GNU long name record if the
+// path does not fit into prefix and name
+int TarWriteHeader(struct Pipe *p, const char *path, char type, uint64_t size, int64_t mtime, int mode)
+{
+  struct Tar_Header h;
+  memset(&h, 0, sizeof(h));
+  size_t len = strlen(path);
+  if (len <= sizeof(h.name))
+  {
+    memcpy(h.name, path, len);
+  }
+  else
+  {
+    // split at a slash so that both halves fit
+    const char *slash = NULL;
+    for (const char *c = path + len - sizeof(h.name) - 1; c < path + len && !slash; ++c)
+    {
+      if (*c == '/' && c > path && c - path <= (ptrdiff_t) sizeof(h.prefix)) { slash = c; }
+    }
+    if (slash)
+    {
+      memcpy(h.prefix, path, slash - path);
+      memcpy(h.name, slash + 1, len - ( slash - path ) - 1);
+    }
+    else
+    {
+      if ( TarWriteHeader(p, "././@LongLink", 'L', len + 1, 0, 0) == -1 ||
+           PipeWrite(p, path, len + 1) == -1 || TarPad(p, len + 1) == -1 )
+      {
+        return -1;
+      }
+      memcpy(h.name, path, sizeof(h.name));
+    }
+  }
+  TarSetNumber(h.mode, sizeof(h.mode), mode);
+  TarSetNumber(h.uid, sizeof(h.uid), 0);
+  TarSetNumber(h.gid, sizeof(h.gid), 0);
+  TarSetNumber(h.size, sizeof(h.size), size);
+  TarSetNumber(h.mtime, sizeof(h.mtime), mtime < 0 ? 0 : mtime);
+  h.type = type;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  snprintf(h.chksum, sizeof(h.chksum), "%06o", TarChecksum(&h));
+  h.chksum[7] = ' ';
+  return PipeWrite(p, &h, sizeof(h));
+}
+
+struct Tar_Count {
+  uint64_t files;
+  uint64_t dirs;
+  uint64_t bytes;
+};
+
+// the contents of a file, each run of adjacent blocks in one piece
+int ExportData(struct Pipe *p, int nid, uint64_t size)
+{
+  uint64_t num_blocks = MappedBlocks(nid);
+  for (uint64_t id = 0; id < num_blocks; )
+  {
+    uint32_t bid;
+    uint64_t k = RunOf(nid, id, num_blocks, &bid);
+    uint64_t bytes = size - id * BLOCK_SIZE < k * BLOCK_SIZE ? size - id * BLOCK_SIZE : k * BLOCK_SIZE;
+    if ( PipeWrite(p, bid ? blocks[bid] : NULL, bytes) == -1 )
+    {
+      return -1;
+    }
+    id += k;
+  }
+  if (num_blocks * BLOCK_SIZE < size)
+  {
+    return PipeWrite(p, FileEnd(nid), size - num_blocks * BLOCK_SIZE);
+  }
+  return 0;
+}
+
+// the get of a big file: the pipe's thread writes chunk k to ofp while this
+// one gathers chunk k+1 from the image
+int GetPiped(int nid, FILE *ofp)
+{
+  struct Pipe p;
+  if (PipeOpen(&p, ofp, 1) == -1)
+  {
+    fprintf(out, "get error: Cannot start the pipeline.\n");
+    return -1;
+  }
+  int ret = ExportData(&p, nid, inodes[nid].size);
+  if (PipeClose(&p) == -1) { ret = -1; }
+  if (ret == -1)
+  {
+    fprintf(out, "get error: Failed to write the output.\n");
+  }
+  return ret;
+}
+
+// write the entries under dnid, named path[0..plen-1] followed by their names
+int ExportDir(struct Pipe *p, int dnid, char *path, size_t plen, struct Tar_Count *n)
+{
+  struct BTree_Cursor c;
+  for (int more = CursorFirst(&c, dnid); more; more = CursorNext(&c))
+  {
+    struct BTree_Node *leaf = c.leaf;
+    int nid = leaf->inode[c.i];
+    size_t len = plen + leaf->len[c.i] + 1; // with a slash or the terminating 0
+    if (len >= MAX_PATH_LEN)
+    {
+      fprintf(out, "export error: Path too long, skipping \"%.*s\".\n", leaf->len[c.i], NodeName(leaf, c.i));
+      continue;
+    }
+    memcpy(path + plen, NodeName(leaf, c.i), leaf->len[c.i]);
+    int mode = WritePermission(nid) ? 0644 : 0444;
+    if (inodes[nid].type == INODE_DIR)
+    {
+      path[len-1] = '/';
+      path[len] = 0;
+      if ( TarWriteHeader(p, path, '5', 0, leaf->time[c.i], mode | 0111) == -1 ||
+           ExportDir(p, nid, path, len, n) == -1 )
+      {
+        return -1;
+      }
+      ++n->dirs;
+    }
+    else
+    {
+      uint64_t size = inodes[nid].size;
+      path[len-1] = 0;
+      if ( TarWriteHeader(p, path, '0', size, leaf->time[c.i], mode) == -1 ||
+           ExportData(p, nid, size) == -1 || TarPad(p, size) == -1 )
+      {
+        return -1;
+      }
+      ++n->files;
+      n->bytes += size;
+    }
+  }
+  return 0;
+}
+
+// write the tree under path (cwd by default) as an archive to ofp
+int ExportStream(FILE *ofp, const char *path)
+{
+  int dnid = path ? Namei(path) : cwd;
+  if (dnid == -1 || inodes[dnid].type != INODE_DIR)
+  {
+    fprintf(out, "export error: No such directory \"%s\"\n", path);
+    return -1;
+  }
+  struct Pipe p;
+  if (PipeOpen(&p, ofp, 1) == -1)
+  {
+    fprintf(out, "export error: Cannot start the pipeline.\n");
+    return -1;
+  }
+  char name[MAX_PATH_LEN];
+  struct Tar_Count n = { 0, 0, 0 };
+  int ret = ExportDir(&p, dnid, name, 0, &n);
+  // the archive ends with two empty records
+  if (ret == 0) { ret = PipeWrite(&p, NULL, 2 * TAR_BLOCK); }
+  if (PipeClose(&p) == -1) { ret = -1; }
+  if (ret == -1)
+  {
+    fprintf(out, "export error: Failed to write the archive.\n");
+    return -1;
+  }
+  fprintf(out, "Exported %" PRIu64 " files and %" PRIu64 " directories (%" PRIu64 " bytes).\n",
+          n.files, n.dirs, n.bytes);
+  return 0;
+}
+
+int Export(const char *archive, const char *path)
+{
+  int toStdout = strcmp(archive, "-") == 0;
+  FILE *ofp = toStdout ? stdout : fopen(archive, "w");
+  if (!ofp)
+  {
+    fprintf(out, "Could not open output file: %s\n", archive );
+    return -1;
+  }
+  // messages would end up inside the archive
+  FILE *saved = out;
+  if (toStdout)
+  {
+    fflush(stdout);
+    out = stderr;
+  }
+  int ret = ExportStream(ofp, path);
+  out = saved;
+  if (!toStdout)
+  {
+    fclose(ofp);
+    if (ret == -1) { unlink(archive); }
+  }
+  return ret;
+}
+
+// the directory called name under dnid, made if it is missing, -1 with a message
+int ImportDir(int dnid, const char *name, int64_t time)
+{
+  int slot;
+  int nid = -1;
+  LockDir(dnid);
+  struct BTree_Node *leaf = BTreeLookup(dnid, name, &slot);
+  if (leaf)
+  {
+    nid = leaf->inode[slot];
+    if (inodes[nid].type != INODE_DIR)
+    {
+      fprintf(out, "import error: \"%s\" is not a directory.\n", name);
+      nid = -1;
+    }
+  }
+  else if (inodes[dnid].flags & INODE_REMOVED)
+  {
+    fprintf(out, "import error: No such directory.\n");
+  }
+  else
+  {
+    nid = MakeDir(dnid, name, time);
+    if (nid < 0)
+    {
+      fprintf(out, "import error: %s.\n", nid == -1 ? "No more empty Inode" : "Not enough disk space");
+      nid = -1;
+    }
+  }
+  UnlockDir(dnid);
+  return nid;
+}
+
+// an archived path must stay below the directory it is imported into
+int TarPathOk(const char *path)
+{
+  for (const char *c = path; *c; )
+  {
+    size_t len = strcspn(c, "/");
+    if ( ( len == 2 && strncmp(c, "..", 2) == 0 ) || len > MAX_NAME_LEN ) { return 0; }
+    c += len;
+    while (*c == '/') { ++c; }
+  }
+  return 1;
+}
+
+// Create one archive entry under dnid. Directories on the way are made as
+// needed. The data of a file is read from p, the caller skips what is left.
+void ImportEntry(struct Pipe *p, int dnid, char *path, const struct Tar_Header *h, struct Tar_Count *n)
+{
+  int dir = h->type == '5';
+  int64_t mtime = TarNumber(h->mtime, sizeof(h->mtime));
+  uint64_t size = TarNumber(h->size, sizeof(h->size));
+  if (!TarPathOk(path))
+  {
+    fprintf(out, "import error: Skipping \"%s\", bad path.\n", path);
+    return;
+  }
+  char *save;
+  char *next = NULL;
+  for (char *c = strtok_r(path, "/", &save); c; c = next)
+  {
+    next = strtok_r(NULL, "/", &save);
+    if (strcmp(c, ".") == 0) { continue; }
+    if (next || dir)
+    {
+      dnid = ImportDir(dnid, c, next ? time(NULL) : mtime);
+      if (dnid == -1) { return; }
+      if (!next) { ++n->dirs; }
+      continue;
+    }
+
+    // a file: check the entry before its data is read
+    int slot;
+    struct BTree_Node *entry = BTreeLookup(dnid, c, &slot);
+    if (entry && PutCheck(entry->inode[slot], c, "import") == -1)
+    {
+      return;
+    }
+    int nid = NewFile(PipeRead, p, size, 0, dnid, "import");
+    if (nid == -1 || LinkFile(dnid, c, nid, mtime, "import") == -1)
+    {
+      return;
+    }
+    // an archived file without write permission comes in read-only
+    if ( !( TarNumber(h->mode, sizeof(h->mode)) & 0200 ) )
+    {
+      __atomic_or_fetch(&inodes[nid].attribute, 1, __ATOMIC_RELAXED);
+    }
+    ++n->files;
+    n->bytes += size;
+  }
+}
+
+// read an archive from ifp into the directory at path (cwd by default)
+int ImportStream(FILE *ifp, const char *path)
+{
+  int dnid = path ? Namei(path) : cwd;
+  if (dnid == -1 || inodes[dnid].type != INODE_DIR)
+  {
+    fprintf(out, "import error: No such directory \"%s\"\n", path);
+    return -1;
+  }
+  struct Pipe p;
+  if (PipeOpen(&p, ifp, 0) == -1)
+  {
+    fprintf(out, "import error: Cannot start the pipeline.\n");
+    return -1;
+  }
+
+  struct Tar_Header h;
+  static const struct Tar_Header zero;
+  char name[MAX_PATH_LEN];
+  int longName = 0;                 // name came from a record before the header
+  int ret = -1;
+  struct Tar_Count n = { 0, 0, 0 };
+  while (PipeRead(&p, &h, sizeof(h)))
+  {
+    if (memcmp(&h, &zero, sizeof(h)) == 0) // end of archive
+    {
+      ret = 0;
+      break;
+    }
+    if (TarChecksum(&h) != TarNumber(h.chksum, sizeof(h.chksum)))
+    {
+      fprintf(out, "import error: Bad header checksum.\n");
+      break;
+    }
+    uint64_t size = TarNumber(h.size, sizeof(h.size));
+    uint64_t end = p.total + ( size + TAR_BLOCK - 1 ) / TAR_BLOCK * TAR_BLOCK;
+
+    if (h.type == 'L' || h.type == 'x')
+    {
+      // a long name or pax record for the next entry
+      char *rec = size < 65536 ? malloc(size + 1) : NULL;
+      if (rec && PipeRead(&p, rec, size))
+      {
+        rec[size] = 0;
+        if (h.type == 'L')
+        {
+          snprintf(name, sizeof(name), "%s", rec);
+          longName = 1;
+        }
+        // pax records are "length key=value\n"
+        for (char *r = rec; h.type == 'x' && r < rec + size; )
+        {
+          long rlen = strtol(r, NULL, 10);
+          char *kv = strchr(r, ' ');
+          if (rlen <= 0 || !kv || r + rlen > rec + size) { break; }
+          if (strncmp(kv + 1, "path=", 5) == 0)
+          {
+            snprintf(name, sizeof(name), "%.*s", (int) ( r + rlen - 1 - ( kv + 6 ) ), kv + 6);
+            longName = 1;
+          }
+          r += rlen;
+        }
+      }
+      free(rec);
+    }
+    else if (h.type == '0' || h.type == '\0' || h.type == '7' || h.type == '5')
+    {
+      if (!longName)
+      {
+        int plen = strnlen(h.prefix, sizeof(h.prefix));
+        int nlen = strnlen(h.name, sizeof(h.name));
+        snprintf(name, sizeof(name), "%.*s%s%.*s", plen, h.prefix, plen ? "/" : "", nlen, h.name);
+      }
+      longName = 0;
+      ImportEntry(&p, dnid, name, &h, &n);
+    }
+    else if (h.type != 'g')
+    {
+      fprintf(out, "import: Skipping \"%.*s\", unsupported type '%c'.\n", (int) strnlen(h.name, sizeof(h.name)), h.name, h.type);
+      longName = 0;
+    }
+
+    // skip the data nobody read, and the padding
+    if (end < p.total || !PipeRead(&p, NULL, end - p.total))
+    {
+      break;
+    }
+  }
+  if (PipeClose(&p) == -1 || ret == -1)
+  {
+    fprintf(out, "import error: Failed to read the archive.\n");
+    ret = -1;
+  }
+  fprintf(out, "Imported %" PRIu64 " files and %" PRIu64 " directories (%" PRIu64 " bytes).\n",
+          n.files, n.dirs, n.bytes);
+  return ret;
+}
+
+int Import(const char *archive, const char *path)
+{
+  FILE *ifp = strcmp(archive, "-") == 0 ? stdin : fopen(archive, "r");
+  if (!ifp)
+  {
+    fprintf(out, "import error: Cannot open \"%s\".\n", archive);
+    return -1;
+  }
+  int ret = ImportStream(ifp, path);
+  if (ifp != stdin) { fclose(ifp); }
+  return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Backups
+//
+// `diff base patch` writes the blocks in which the image, as `close` would
+// save it, differs from the image file base, and `patch patch image` writes
+// them into a copy of base to make it that image. Blocks are compared as they
+// are stored, encrypted or not, so a patch applies without the passphrase.
+// The comparison runs in parallel over chunks of the two; every block in the
+// patch carries a CRC32C of its contents and one of the block it replaces, and
+// an image is only written once all of those check out.
+
+#define PATCH_MAGIC   0x48435450    // "PTCH"
+#define PATCH_VERSION 1
+
+struct Patch_Header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t base_blocks;             // size of the image the patch applies to
+  uint32_t block_num;               // and after it is applied
+  uint32_t changed;                 // blocks in the patch
+  uint32_t base_super;              // CRC32C of the base's super block
+};
+
+struct Patch_Block {
+  uint32_t bid;
+  uint32_t base_crc;                // of the block replaced, 0 past the end of the base
+  uint32_t crc;                     // of the contents that follow
+  uint32_t pad;
+};
+
+struct Diff_Job {
+  const uint8_t *base;              // the base's blocks of a chunk
+  const uint8_t *now;               // and the image's
+  uint32_t       first;             // block number of the chunk
+  uint32_t       base_blocks;
+  uint8_t       *changed;
+  struct Patch_Block *recs;         // of the changed blocks
+};
+
+void DiffRange(void *ctx, uint64_t lo, uint64_t hi)
+{
+  struct Diff_Job *job = ctx;
+  for (uint64_t i = lo; i < hi; ++i)
+  {
+    const uint8_t *now = job->now + i * BLOCK_SIZE;
+    const uint8_t *base = job->base + i * BLOCK_SIZE;
+    uint32_t bid = job->first + i;
+    job->changed[i] = bid >= job->base_blocks || memcmp(base, now, BLOCK_SIZE) != 0;
+    if (!job->changed[i]) { continue; }
+    job->recs[i].bid = bid;
+    job->recs[i].base_crc = bid < job->base_blocks ? crc32c(base, BLOCK_SIZE) : 0;
+    job->recs[i].crc = crc32c(now, BLOCK_SIZE);
+    job->recs[i].pad = 0;
+  }
+}
+
+int Diff(const char *bname, const char *pname)
+{
+  if (!image)
+  {
+    fprintf(out, "diff error: No opened image file.\n");
+    return -1;
+  }
+  KernelsInit();
+  FILE *bfp = fopen(bname, "r");
+  struct stat st;
+  if (!bfp || fstat(fileno(bfp), &st) == -1 || st.st_size % BLOCK_SIZE || st.st_size < BLOCK_SIZE)
+  {
+    fprintf(out, "diff error: \"%s\" is not an image file.\n", bname);
+    if (bfp) { fclose(bfp); }
+    return -1;
+  }
+  FILE *pfp = fopen(pname, "w");
+  if (!pfp)
+  {
+    fprintf(out, "diff error: Cannot create \"%s\".\n", pname);
+    fclose(bfp);
+    return -1;
+  }
+  size_t chunk = (size_t) CRYPT_CHUNK * BLOCK_SIZE;
+  uint8_t *base = malloc(chunk);
+  uint8_t *stage = imageKey.on ? malloc(chunk) : NULL;
+  struct Patch_Block *recs = malloc(CRYPT_CHUNK * sizeof(*recs));
+  uint8_t *changed = malloc(CRYPT_CHUNK);
+  if (!base || ( imageKey.on && !stage ) || !recs || !changed)
+  {
+    free(base); free(stage); free(recs); free(changed);
+    fclose(bfp); fclose(pfp);
+    fprintf(out, "diff error: Out of memory.\n");
+    return -1;
+  }
+
+  SealParity();
+  struct Patch_Header h = { PATCH_MAGIC, PATCH_VERSION, st.st_size / BLOCK_SIZE, super->block_num, 0, 0 };
+  int ok = fwrite(&h, sizeof(h), 1, pfp) == 1;
+  int fd = fileno(bfp);
+  for (uint32_t b = 0; b < super->block_num && ok; b += CRYPT_CHUNK)
+  {
+    uint32_t n = super->block_num - b < CRYPT_CHUNK ? super->block_num - b : CRYPT_CHUNK;
+    uint32_t have = b < h.base_blocks ? ( h.base_blocks - b < n ? h.base_blocks - b : n ) : 0;
+    if (have && pread(fd, base, (size_t) have * BLOCK_SIZE, (off_t) b * BLOCK_SIZE) != (ssize_t) have * BLOCK_SIZE)
+    {
+      fprintf(out, "diff error: Failed to read \"%s\".\n", bname);
+      ok = 0;
+      break;
+    }
+    if (b == 0) { h.base_super = crc32c(base, BLOCK_SIZE); }
+    struct Diff_Job job = { base, StoredBlocks(stage, b, n), b, h.base_blocks, changed, recs };
+    ParallelFor(n, DiffRange, &job);
+    for (uint32_t i = 0; i < n && ok; ++i)
+    {
+      if (!changed[i]) { continue; }
+      ok = fwrite(&recs[i], sizeof(recs[i]), 1, pfp) == 1 &&
+           fwrite(job.now + (size_t) i * BLOCK_SIZE, BLOCK_SIZE, 1, pfp) == 1;
+      ++h.changed;
+    }
+  }
+  free(base); free(stage); free(recs); free(changed);
+  fclose(bfp);
+  // the header goes again at the front with the count
+  if (ok) { ok = fseek(pfp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, pfp) == 1; }
+  if (fclose(pfp) == EOF) { ok = 0; }
+  if (!ok)
+  {
+    fprintf(out, "diff error: Failed to write \"%s\".\n", pname);
+    return -1;
+  }
+  fprintf(out, "%u of %u blocks differ from %s, the patch is %" PRIu64 " bytes.\n", h.changed, super->block_num,
+          bname, sizeof(h) + (uint64_t) h.changed * ( sizeof(struct Patch_Block) + BLOCK_SIZE ));
+  return 0;
+}
+
+// read the next block of a patch into data, 0 at its end or if it is damaged
+int PatchNext(FILE *pfp, struct Patch_Header *h, struct Patch_Block *rec, uint8_t *data, uint32_t *last)
+{
+  if (fread(rec, sizeof(*rec), 1, pfp) != 1 || fread(data, BLOCK_SIZE, 1, pfp) != 1) { return 0; }
+  if (rec->bid >= h->block_num || ( *last != UINT32_MAX && rec->bid <= *last )) { return 0; }
+  *last = rec->bid;
+  return crc32c(data, BLOCK_SIZE) == rec->crc;
+}
+
+// check a patch against the image file fd, then apply it
+int PatchFile(FILE *pfp, struct Patch_Header *h, int fd, off_t size, const char *pname, const char *iname)
+{
+  uint8_t data[BLOCK_SIZE], old[BLOCK_SIZE];
+  struct Patch_Block rec;
+  uint32_t last = UINT32_MAX;
+  if (size != (off_t) h->base_blocks * BLOCK_SIZE || pread(fd, old, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+      crc32c(old, BLOCK_SIZE) != h->base_super)
+  {
+    fprintf(out, "patch error: \"%s\" is not the image the patch was made from.\n", iname);
+    return -1;
+  }
+  // check everything first, so a wrong or damaged patch leaves the image as it was
+  for (uint32_t i = 0; i < h->changed; ++i)
+  {
+    if (!PatchNext(pfp, h, &rec, data, &last))
+    {
+      fprintf(out, "patch error: \"%s\" is damaged.\n", pname);
+      return -1;
+    }
+    if (rec.bid < h->base_blocks &&
+        ( pread(fd, old, BLOCK_SIZE, (off_t) rec.bid * BLOCK_SIZE) != BLOCK_SIZE || crc32c(old, BLOCK_SIZE) != rec.base_crc ))
+    {
+      fprintf(out, "patch error: \"%s\" is not the image the patch was made from (block #%u).\n", iname, rec.bid);
+      return -1;
+    }
+  }
+  fseek(pfp, sizeof(*h), SEEK_SET);
+  last = UINT32_MAX;
+  for (uint32_t i = 0; i < h->changed; ++i)
+  {
+    if (!PatchNext(pfp, h, &rec, data, &last) ||
+        pwrite(fd, data, BLOCK_SIZE, (off_t) rec.bid * BLOCK_SIZE) != BLOCK_SIZE)
+    {
+      fprintf(out, "patch error: Failed to write \"%s\", it is partly patched.\n", iname);
+      return -1;
+    }
+  }
+  if (h->block_num != h->base_blocks && ftruncate(fd, (off_t) h->block_num * BLOCK_SIZE) == -1)
+  {
+    fprintf(out, "patch error: Failed to resize \"%s\", it is partly patched.\n", iname);
+    return -1;
+  }
+  fprintf(out, "Patched %s: %u blocks written, %u blocks in all.\n", iname, h->changed, h->block_num);
+  return 0;
+}
+
+int Patch(const char *pname, const char *iname)
+{
+  KernelsInit();
+  FILE *pfp = fopen(pname, "r");
+  struct Patch_Header h;
+  if (!pfp || fread(&h, sizeof(h), 1, pfp) != 1 || h.magic != PATCH_MAGIC || h.version != PATCH_VERSION)
+  {
+    fprintf(out, "patch error: \"%s\" is not a patch.\n", pname);
+    if (pfp) { fclose(pfp); }
+    return -1;
+  }
+  int fd = open(iname, O_RDWR);
+  struct stat st;
+  int ret = -1;
+  if (fd == -1 || fstat(fd, &st) == -1)
+  {
+    fprintf(out, "patch error: Cannot open \"%s\".\n", iname);
+  }
+  // also keeps the image open in this shell from being patched under it
+  else if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+  {
+    fprintf(out, "patch error: Image is in use by another process.\n");
+  }
+  else
+  {
+    ret = PatchFile(pfp, &h, fd, st.st_size, pname, iname);
+  }
+  if (fd != -1) { close(fd); }
+  fclose(pfp);
+  return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Resizing
+//
+// `resize size` grows or shrinks the open image. The metadata regions are laid
+// out again for the new size, a bigger image also getting the inodes createfs
+// would give it, and the parity region moves to the new end. Blocks in the way
+// of grown metadata or past the new end are first copied to free blocks, then
+// a walk of every inode points whatever referred to them at the copies. The
+// result is written to a new file that is renamed over the image file, so a
+// crash leaves either the old image or the new one.
+
+struct Relocation {
+  uint32_t *to;                     // per block of the old image: where it went, 0 = it stays
+  uint32_t  old_num;
+};
+
+int RelocateSlot(void *ctx, int nid, uint32_t *slot, int kind, int level)
+{
+  struct Relocation *r = ctx;
+  if (*slot < r->old_num && r->to[*slot]) { *slot = r->to[*slot]; }
+  return 0;
+}
+
+// write the open image to a new file and put that in place of the image file
+int ReplaceImage(const char *cmd)
+{
+  char tmp[MAX_PATH_LEN + 8];
+  snprintf(tmp, sizeof(tmp), "%s.new", imagePath);
+  FILE *fp = fopen(tmp, "w+");
+  if (!fp)
+  {
+    fprintf(out, "%s error: Cannot create \"%s\".\n", cmd, tmp);
+    return -1;
+  }
+  int ok = flock(fileno(fp), LOCK_EX | LOCK_NB) == 0 && WriteBlocks(fp) == super->block_num &&
+           fflush(fp) == 0 && fsync(fileno(fp)) == 0 && rename(tmp, imagePath) == 0;
+  if (!ok)
+  {
+    fprintf(out, "%s error: Failed to save \"%s\", it is saved on close instead.\n", cmd, imagePath);
+    unlink(tmp);
+    fclose(fp);
+    return -1;
+  }
+  fclose(image);
+  image = fp;
+  JournalRemove();                  // its blocks are of the image replaced
+  memset(segDirty, 0, ( super->block_num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS);
+  return 0;
+}
+
+int ResizeImage(const char *size_str)
+{
+  uint64_t size = ParseSize(size_str);
+  uint64_t num = size / BLOCK_SIZE;
+  if (size == 0 || num > UINT32_MAX)
+  {
+    fprintf(out, "resize error: Invalid size \"%s\".\n", size_str);
+    return -1;
+  }
+  if (!image)
+  {
+    fprintf(out, "resize error: No opened image file.\n");
+    return -1;
+  }
+  // callers make sure no other command is running
+  ReclaimFrom(1);
+
+  // the new layout
+  uint32_t old_num = super->block_num, old_start = super->data_start, old_end = DataEnd();
+  uint32_t old_inodes = super->inode_num;
+  uint32_t inode_num = num > old_num && InodesFor(num) > old_inodes ? InodesFor(num) : old_inodes;
+  uint32_t inode_map_blocks = ( inode_num + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint32_t block_map_blocks = ( num + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+  uint32_t start = 1 + inode_map_blocks + block_map_blocks + inode_num / INODES_PER_BLOCK;
+  int n = super->stripe_data, m = super->stripe_parity;
+  uint32_t end = super->parity_start ? ParityCovered(num, n, m) : num;
+  if (end <= start + 1)
+  {
+    fprintf(out, "resize error: %s is too small for this file system.\n", size_str);
+    return -1;
+  }
+
+  // blocks in use outside the new data area, and free blocks inside it to take them
+  uint32_t lo = start > old_start ? start : old_start;
+  uint64_t moving = 0, room = 0;
+  for (uint32_t b = old_start; b < old_end; ++b)
+  {
+    moving += blockMap[b] && ( b < start || b >= end );
+  }
+  for (uint32_t b = lo; b < end; ++b)
+  {
+    room += b >= old_end || !blockMap[b];
+  }
+  if (moving > room)
+  {
+    fprintf(out, "resize error: Not enough free space, %" PRIu64 " blocks in use would not fit.\n", moving);
+    return -1;
+  }
+
+  uint32_t *to = calloc(old_num, sizeof(uint32_t));
+  uint8_t *used = calloc(num, 1);
+  uint8_t *inodeCopy = malloc((size_t) old_inodes * ( 1 + sizeof(struct Inode) ));
+  // a bigger store first, blocks may move into its new part
+  int grown = num <= old_num || StoreResize(num) == 0;
+  uint32_t segs = ( ( num > old_num ? num : old_num ) + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS;
+  uint8_t *seg = realloc(segDirty, segs);
+  if (seg) { segDirty = seg; }
+  MapMetadata();                    // the store may have moved
+  if (!to || !used || !inodeCopy || !grown || !seg)
+  {
+    free(to); free(used); free(inodeCopy);
+    fprintf(out, "resize error: Out of memory.\n");
+    return -1;
+  }
+
+  uint32_t t = lo;
+  for (uint32_t b = old_start; b < old_end; ++b)
+  {
+    if (!blockMap[b]) { continue; }
+    if (b >= start && b < end)
+    {
+      used[b] = blockMap[b];
+      continue;
+    }
+    while (used[t] || ( t < old_end && blockMap[t] )) { ++t; }
+    memcpy(blocks[t], blocks[b], BLOCK_SIZE);
+    to[b] = t;
+    used[t] = blockMap[b];
+  }
+  struct Relocation r = { to, old_num };
+  for (uint32_t nid = 0; moving && nid < old_inodes; ++nid)
+  {
+    if (inodeMap[nid]) { VisitBlocks(nid, RelocateSlot, &r); }
+  }
+
+  // lay the metadata out again around the copies
+  memcpy(inodeCopy, inodeMap, old_inodes);
+  memcpy(inodeCopy + old_inodes, inodes, (size_t) old_inodes * sizeof(struct Inode));
+  memset(blocks[1], 0, (size_t) ( ( start > old_start ? start : old_start ) - 1 ) * BLOCK_SIZE);
+  memset(used, 1, start);
+  memset(used + end, 1, num - end);
+  super->block_num = num;
+  super->inode_num = inode_num;
+  super->inode_map = 1;
+  super->block_map = super->inode_map + inode_map_blocks;
+  super->inode_table = super->block_map + block_map_blocks;
+  super->data_start = start;
+  if (super->parity_start)
+  {
+    super->parity_start = end;
+    super->csum_start = end + ( end + n - 1 ) / n * m;
+  }
+  memcpy(blocks[super->inode_map], inodeCopy, old_inodes);
+  memcpy(blocks[super->block_map], used, num);
+  memcpy(blocks[super->inode_table], inodeCopy + old_inodes, (size_t) old_inodes * sizeof(struct Inode));
+  free(to); free(used); free(inodeCopy);
+
+  if (num < old_num) { StoreResize(num); } // else the store stays bigger than needed
+  MapMetadata();
+  if (super->parity_start) { memset(stripeDirty, 1, stripeCount); }
+  memset(segDirty, 1, ( num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS); // everything moved
+
+  fprintf(out, "Resized to %u blocks, %" PRIu64 " moved, %" PRIu64 " bytes free.\n", super->block_num, moving, Df());
+  return ReplaceImage("resize");
+}
+
+// the flusher is kept off while the store and the image file are replaced
+int Resize(const char *size_str)
+{
+  FlushStop();
+  int resized = ResizeImage(size_str);
+  FlushStart(resized == 0);
+  return resized;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Segments
+//
+// The image is cut into segments of SEGMENT_BLOCKS blocks, the largest buddy
+// chunk. `close` writes back only the segments with a block changed since the
+// image was loaded or saved, besides the metadata and checksums, so a save
+// costs about what was written instead of the size of the image.
+// In log mode (`log on`, kept in the super block) new blocks come from a whole
+// free segment, one after the other from where the last ones ended, rather
+// than from the holes deleted files left, so writes fill few segments front
+// to back and so does the next save. The inode table stays where it is and
+// serves as the map to the current blocks of every file. The cleaner makes
+// whole free segments again: it copies the blocks in use out of the least
+// used segments to the head of the log, then a walk of every inode points
+// whatever referred to them at the copies. The shell runs it on a thread of
+// its own while it waits for a command, in log mode and once whole free
+// segments make up less than half of the free space.
+
+#define CLEAN_PERCENT 50            // segments used up to this much are cleaned
+#define CLEAN_BATCH   16            // segments cleaned at once, the prompt waits for at most one batch
+
+struct Segment_Use {
+  uint32_t seg;
+  uint32_t live;                    // blocks in use
+};
+
+int CompareSegmentUse(const void *a, const void *b)
+{
+  const struct Segment_Use *x = a, *y = b;
+  if (x->live != y->live) { return x->live < y->live ? -1 : 1; }
+  return x->seg < y->seg ? -1 : x->seg > y->seg;
+}
+
+// the segments wholly in the data area, first .. end - 1
+uint32_t SegmentsFirst()
+{
+  return ( super->data_start + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS;
+}
+
+uint32_t SegmentsEnd()
+{
+  return DataEnd() / SEGMENT_BLOCKS;
+}
+
+// whole free segments, callers hold allocLock
+uint32_t FreeSegments()
+{
+  uint32_t n = 0;
+  for (uint32_t s = SegmentsFirst(); s < SegmentsEnd(); ++s)
+  {
+    n += buddyOrder[s * SEGMENT_BLOCKS] == BUDDY_ORDERS;
+  }
+  return n;
+}
+
+int MoveSlot(void *ctx, int nid, uint32_t *slot, int kind, int level)
+{
+  uint32_t *to = ctx;
+  if (*slot >= super->block_num || !to[*slot]) { return 0; }
+  *slot = to[*slot];
+  uint32_t at = SlotBlock(slot);
+  if (at) { MarkDirty(at, 1); }
+  return 0;
+}
+
+// Clean up to max of the least used segments that are used up to percent,
+// leaving alone the one the log goes on in. Returns how many were freed, with
+// the blocks copied out of them added to *moved, -1 if out of memory.
+// With write-back on, the blocks moved out are freed one by one, so those the
+// checkpoint on disk uses are held (see FreeBlock). A segment with held
+// blocks is left alone until they are given back.
+// Callers make sure no command is running.
+int Clean(int percent, int max, uint64_t *moved)
+{
+  ReclaimFrom(1);
+  int deferred = flushDurable != NULL;
+  uint32_t first = SegmentsFirst(), end = SegmentsEnd();
+  uint32_t *to = calloc(super->block_num, sizeof(uint32_t));
+  struct Segment_Use *use = malloc(( end > first ? end - first : 1 ) * sizeof(*use));
+  uint8_t *pending = deferred ? calloc(end + 1, 1) : NULL;
+  if (!to || !use || ( deferred && !pending ))
+  {
+    free(to); free(use); free(pending);
+    return -1;
+  }
+  pthread_mutex_lock(&allocLock);
+  for (size_t i = 0; pending && i < nheld; ++i)
+  {
+    if (held[i].id / SEGMENT_BLOCKS < end) { pending[ held[i].id / SEGMENT_BLOCKS ] = 1; }
+  }
+
+  // the victims, as many as the free space outside them can take in
+  uint32_t n = 0;
+  for (uint32_t s = first; s < end; ++s)
+  {
+    uint32_t live = 0;
+    for (uint32_t b = s * SEGMENT_BLOCKS; b < ( s + 1 ) * SEGMENT_BLOCKS; ++b) { live += blockMap[b] != 0; }
+    if (live && live * 100 <= (uint64_t) percent * SEGMENT_BLOCKS && s != runHint / SEGMENT_BLOCKS &&
+        !( pending && pending[s] ))
+    {
+      use[n].seg = s;
+      use[n++].live = live;
+    }
+  }
+  qsort(use, n, sizeof(*use), CompareSegmentUse);
+  uint64_t room = freeBlocks - reservedBlocks;
+  if (n > max) { n = max; }
+  if (n > room / SEGMENT_BLOCKS) { n = room / SEGMENT_BLOCKS; }
+
+  // nothing may be taken from the victims while their blocks move out
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    for (uint32_t b = use[i].seg * SEGMENT_BLOCKS; b < ( use[i].seg + 1 ) * SEGMENT_BLOCKS; ++b)
+    {
+      if (!buddyOrder[b]) { continue; }
+      uint32_t size = 1u << ( buddyOrder[b] - 1 );
+      BuddyUnlink(b);
+      freeBlocks -= size;
+      b += size - 1;
+    }
+  }
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    for (uint32_t b = use[i].seg * SEGMENT_BLOCKS; b < ( use[i].seg + 1 ) * SEGMENT_BLOCKS; ++b)
+    {
+      if (!blockMap[b]) { continue; }
+      int t = BuddyTake(0, runHint);
+      assert(t != -1);              // there was room for all of them
+      runHint = t + 1;
+      memcpy(blocks[t], blocks[b], BLOCK_SIZE);
+      blockMap[t] = blockMap[b];
+      to[b] = t;
+      ++*moved;
+    }
+  }
+  for (uint32_t nid = 0; n && nid < super->inode_num; ++nid)
+  {
+    if (inodeMap[nid]) { VisitBlocks(nid, MoveSlot, to); }
+  }
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    uint32_t b = use[i].seg * SEGMENT_BLOCKS;
+    if (!deferred)
+    {
+      memset(&blockMap[b], 0, SEGMENT_BLOCKS);
+      BuddyLink(b, BUDDY_ORDERS - 1, 1);
+      freeBlocks += SEGMENT_BLOCKS;
+      continue;
+    }
+    for ( ; b < ( use[i].seg + 1 ) * SEGMENT_BLOCKS; ++b)
+    {
+      if (to[b]) { FreeBlock(b); } else { BuddyFree(b); } // what was free goes back as it was
+    }
+  }
+  if (n) { TailForget(); }          // tail blocks may have moved
+
+  pthread_mutex_unlock(&allocLock);
+  free(to); free(use); free(pending);
+  return n;
+}
+
+// `clean [percent]`: clean every segment used up to percent
+int CleanSegments(const char *percent_str)
+{
+  int percent = percent_str ? atoi(percent_str) : CLEAN_PERCENT;
+  if (percent < 1 || percent > 99)
+  {
+    fprintf(out, "clean error: Give a percentage from 1 to 99.\n");
+    return -1;
+  }
+  if (!image)
+  {
+    fprintf(out, "clean error: No opened image file.\n");
+    return -1;
+  }
+  uint64_t moved = 0;
+  int cleaned = 0, n;
+  // every round empties segments for good (or leaves them to the next
+  // checkpoint), so this ends
+  while (( n = Clean(percent, CLEAN_BATCH, &moved) ) > 0) { cleaned += n; }
+  if (n == -1)
+  {
+    fprintf(out, "clean error: Out of memory.\n");
+    return -1;
+  }
+  pthread_mutex_lock(&allocLock);
+  uint32_t free_segs = FreeSegments();
+  pthread_mutex_unlock(&allocLock);
+  fprintf(out, "Cleaned %d segments, %" PRIu64 " blocks moved, %u of %u segments free.\n", cleaned, moved,
+          free_segs, SegmentsEnd() - SegmentsFirst());
+  return 0;
+}
+
+// `log [on|off]`: switch log mode, or tell whether it is on
+int LogMode(const char *arg)
+{
+  if (!image)
+  {
+    fprintf(out, "log error: No opened image file.\n");
+    return -1;
+  }
+  if (arg && strcmp(arg, "on") == 0) { super->flags |= SUPER_LOG; }
+  else if (arg && strcmp(arg, "off") == 0) { super->flags &= ~SUPER_LOG; }
+  else if (arg)
+  {
+    fprintf(out, "log error: Say on or off.\n");
+    return -1;
+  }
+  pthread_mutex_lock(&allocLock);
+  uint32_t free_segs = FreeSegments();
+  pthread_mutex_unlock(&allocLock);
+  fprintf(out, "Log mode is %s, %u of %u segments free.\n", super->flags & SUPER_LOG ? "on" : "off",
+          free_segs, SegmentsEnd() - SegmentsFirst());
+  return 0;
+}
+
+// The background cleaner. It works a batch at a time while the shell waits
+// for a command, and the shell waits for the batch before it runs one.
+pthread_mutex_t cleanerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cleanerCond = PTHREAD_COND_INITIALIZER;
+pthread_t       cleanerThread;
+int             cleanerStarted;
+int             cleanerRun;         // the shell is waiting for a command
+int             cleanerBusy;        // a batch is being cleaned
+int             cleanerDone;        // nothing left to clean until the next command
+
+// in log mode, once whole free segments are less than half of the free space
+int CleanWanted()
+{
+  if (!image || !( super->flags & SUPER_LOG )) { return 0; }
+  pthread_mutex_lock(&allocLock);
+  int want = (uint64_t) FreeSegments() * SEGMENT_BLOCKS < freeBlocks / 2;
+  pthread_mutex_unlock(&allocLock);
+  return want;
+}
+
+void *Cleaner(void *arg)
+{
+  pthread_mutex_lock(&cleanerLock);
+  while (1)
+  {
+    while (!cleanerRun || cleanerDone) { pthread_cond_wait(&cleanerCond, &cleanerLock); }
+    cleanerBusy = 1;
+    pthread_mutex_unlock(&cleanerLock);
+    uint64_t moved = 0, t = SpanStart();
+    CommandBegin();                 // not in the middle of a checkpoint
+    int n = CleanWanted() ? Clean(CLEAN_PERCENT, CLEAN_BATCH, &moved) : 0;
+    CommandEnd();
+    SpanStop("clean", n > 0 ? t : 0);
+    pthread_mutex_lock(&cleanerLock);
+    cleanerBusy = 0;
+    cleanerDone = n <= 0;
+    pthread_cond_broadcast(&cleanerCond);
+  }
+  return NULL;
+}
+
+void CleanerResume()
+{
+  pthread_mutex_lock(&cleanerLock);
+  if (!cleanerStarted) { cleanerStarted = pthread_create(&cleanerThread, NULL, Cleaner, NULL) == 0; }
+  cleanerRun = 1;
+  cleanerDone = 0;
+  pthread_cond_broadcast(&cleanerCond);
+  pthread_mutex_unlock(&cleanerLock);
+}
+
+void CleanerPause()
+{
+  pthread_mutex_lock(&cleanerLock);
+  cleanerRun = 0;
+  while (cleanerBusy) { pthread_cond_wait(&cleanerCond, &cleanerLock); }
+  pthread_mutex_unlock(&cleanerLock);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Write-back
+//
+// With `flush seconds [MB]` a flusher thread checkpoints the open image while
+// commands go on: every so many seconds, or sooner once that many MB of it
+// changed. It waits for the commands running to finish, and holds new ones
+// off, only while it seals the parity and copies the changed blocks aside,
+// then writes the copy without a lock so that a crash leaves the image file
+// as one checkpoint or the next, never between:
+//
+// - Data blocks the checkpoint on disk does not use (fresh ones) go straight
+//   to their place, then an fsync. Nothing on disk points at them yet.
+// - Everything else, the blocks changed in place (directory nodes, puts into
+//   reserved space, pointers the cleaner moved, tails), the metadata blocks
+//   whose CRC32C changed, parity and checksums, is appended to the journal
+//   `<image>.journal`, and its fsync commits the checkpoint.
+// - Then those are written in place, another fsync, and the journal is
+//   emptied. `open` first writes in place whatever whole entries it finds
+//   there.
+//
+// Blocks freed while the checkpoint on disk or the one being written uses
+// them are held back from reuse until one without them is committed (see
+// FreeBlock). Writes are paced to FLUSH_RATE unless as much has changed
+// again. Commands starting while more than FLUSH_BEHIND times the MB have
+// yet to reach the disk, or while the held blocks outnumber the free ones,
+// wait for a checkpoint. Images with parity, and checkpoints made while an
+// earlier one is still in the journal, write everything through it. The
+// settings are kept in the super block; `close` ends with a last checkpoint.
+#define FLUSH_POLL_MS 100
+#define FLUSH_RATE    ( 256 << 20 )     // bytes per second a checkpoint writes at
+#define FLUSH_MB      64                // default threshold
+#define FLUSH_BEHIND  4                 // commands wait while this many times the threshold is unwritten
+#define JOURNAL_MAGIC 0x4c4e524a        // "JRNL"
+
+// a journal entry: the header, count records, then the blocks as stored
+struct Journal_Header {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t block_num;               // of the image it belongs to
+  uint32_t crc;                     // of the records
+  uint64_t seq;                     // one more than the entry before
+};
+
+struct Journal_Block {
+  uint32_t bid;
+  uint32_t crc;                     // of the block as stored
+};
+
+struct Checkpoint {
+  uint32_t *bid;                    // the blocks to write, the fresh ones first
+  uint8_t  *copy;                   // and what goes in them
+  uint32_t  n;
+  uint32_t  data;                   // how many of them are fresh
+  uint64_t  epoch;                  // taken at
+  uint64_t  dirtied;                // segsDirtied then
+  int       fd;
+};
+
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  flushCond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t flushWriteLock = PTHREAD_MUTEX_INITIALIZER; // held from taking a checkpoint until it is on disk
+pthread_t       flushThread;
+int             flushStarted;
+int             flushStop;
+int             flushKicked;        // a checkpoint is wanted now
+uint32_t       *flushCrc;           // of each metadata block as written, then as taken
+int             flushCrcOk;         // the ones written can be trusted
+uint64_t        flushCount;         // checkpoints written since write-back was turned on
+uint64_t        flushBytes;
+int             flushFailed;        // the last one could not be written
+int             flushErrno;         // why
+uint64_t        flushDirtied;       // segsDirtied when the last one written was taken
+uint32_t       *flushBid;           // kept for the next checkpoint, so its copy
+uint8_t        *flushCopy;          // does not fault the pages in again
+struct Journal_Block *flushRec;
+uint32_t        flushCap;
+int             flushJournal = -1;  // the journal file, once opened
+off_t           flushJournalEnd;    // of its entries not yet all written in place, 0 = none
+uint64_t        flushSeq;           // of the last entry
+
+void JournalPath(char *path, size_t size)
+{
+  snprintf(path, size, "%s.journal", imagePath);
+}
+
+// drop the journal of the open image, once the image file holds everything in it
+void JournalRemove()
+{
+  char path[MAX_PATH_LEN + 16];
+  JournalPath(path, sizeof(path));
+  unlink(path);
+  flushJournalEnd = 0;
+  flushSeq = 0;
+}
+
+// Write in place the whole entries of the journal of the image file fd, of
+// size bytes, then drop it. An entry a crash cut short is left out with
+// everything after it. 0, or -1 if writing failed.
+int JournalReplay(int fd, off_t size)
+{
+  char path[MAX_PATH_LEN + 16];
+  JournalPath(path, sizeof(path));
+  flushJournalEnd = 0;              // a new image, a new journal
+  flushSeq = 0;
+  int jfd = open(path, O_RDONLY);
+  if (jfd == -1) { return 0; }
+  KernelsInit();                    // for crc32c
+  struct stat st;
+  struct Journal_Header h;
+  struct Journal_Block *rec = NULL;
+  uint8_t data[BLOCK_SIZE];
+  off_t at = 0;
+  uint64_t seq = 0, applied = 0;
+  int ok = fstat(jfd, &st) == 0;
+  while (ok && pread(jfd, &h, sizeof(h), at) == sizeof(h) && h.magic == JOURNAL_MAGIC &&
+         h.block_num == size / BLOCK_SIZE && ( !seq || h.seq == seq + 1 ) && h.count > 0 &&
+         h.count <= ( st.st_size - at ) / BLOCK_SIZE)
+  {
+    off_t first = at + sizeof(h) + (off_t) h.count * sizeof(*rec);
+    free(rec);
+    rec = malloc((size_t) h.count * sizeof(*rec));
+    if (!rec || pread(jfd, rec, (size_t) h.count * sizeof(*rec), at + sizeof(h)) != (ssize_t) ( h.count * sizeof(*rec) ) ||
+        crc32c((uint8_t *) rec, h.count * sizeof(*rec)) != h.crc)
+    {
+      break;
+    }
+    // all of it made it to the disk, or none of it is used
+    uint32_t i = 0;
+    for ( ; i < h.count; ++i)
+    {
+      if (rec[i].bid >= h.block_num || pread(jfd, data, BLOCK_SIZE, first + (off_t) i * BLOCK_SIZE) != BLOCK_SIZE ||
+          crc32c(data, BLOCK_SIZE) != rec[i].crc)
+      {
+        break;
+      }
+    }
+    if (i < h.count) { break; }
+    for (i = 0; ok && i < h.count; ++i)
+    {
+      ok = pread(jfd, data, BLOCK_SIZE, first + (off_t) i * BLOCK_SIZE) == BLOCK_SIZE &&
+           pwrite(fd, data, BLOCK_SIZE, (off_t) rec[i].bid * BLOCK_SIZE) == BLOCK_SIZE;
+    }
+    applied += h.count;
+    seq = h.seq;
+    at = first + (off_t) h.count * BLOCK_SIZE;
+  }
+  free(rec);
+  close(jfd);
+  if (!ok || ( applied && fsync(fd) == -1 )) { return -1; }
+  if (applied) { fprintf(out, "open: Finished the last checkpoint from its journal, %" PRIu64 " blocks.\n", applied); }
+  JournalRemove();
+  return 0;
+}
+
+// sleep up to ns, 1 if the flusher is told to stop
+int FlushWait(uint64_t ns)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ns += ts.tv_nsec;
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  pthread_mutex_lock(&flushLock);
+  while (!flushStop && !flushKicked && pthread_cond_timedwait(&flushCond, &flushLock, &ts) != ETIMEDOUT) { }
+  int stop = flushStop;
+  pthread_mutex_unlock(&flushLock);
+  return stop;
+}
+
+// wake the flusher for a checkpoint, cutting short the pacing of one being written
+void FlushKick()
+{
+  pthread_mutex_lock(&flushLock);
+  flushKicked = 1;
+  pthread_cond_broadcast(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+}
+
+// take commandLock alone, -1 if the flusher is told to stop first
+int FlushLock()
+{
+  while (1)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += FLUSH_POLL_MS * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    if (pthread_rwlock_timedwrlock(&commandLock, &ts) == 0) { return 0; }
+    if (FlushWait(0)) { return -1; }
+  }
+}
+
+// segments changed since the last checkpoint
+uint32_t DirtySegments()
+{
+  uint32_t n = 0, segs = ( super->block_num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS;
+  pthread_mutex_lock(&allocLock);
+  for (uint32_t s = 0; s < segs; ++s) { n += segDirty[s]; }
+  pthread_mutex_unlock(&allocLock);
+  return n;
+}
+
+// the dirty segments that make a checkpoint due
+uint32_t FlushLimit()
+{
+  uint64_t segs = (uint64_t) super->flush_mb * ( 1 << 20 ) / ( SEGMENT_BLOCKS * BLOCK_SIZE );
+  return !super->flush_mb ? UINT32_MAX : segs ? segs : 1;
+}
+
+// Hold a command back, before it takes commandLock, while more than
+// FLUSH_BEHIND times the threshold has changed since the last checkpoint
+// written, or while more blocks are held than are left to reserve, unless
+// writing checkpoints fails. The allocator counters are only peeked at:
+// allocLock is taken before flushLock, not after.
+void FlushThrottle()
+{
+  if (!flushStarted) { return; }
+  pthread_mutex_lock(&flushLock);
+  uint64_t behind = (uint64_t) FLUSH_BEHIND * FlushLimit();
+  while (!flushStop && !flushFailed &&
+         ( ( super->flush_mb && __atomic_load_n(&segsDirtied, __ATOMIC_RELAXED) - flushDirtied > behind ) ||
+           __atomic_load_n(&nheld, __ATOMIC_RELAXED) + __atomic_load_n(&reservedBlocks, __ATOMIC_RELAXED) >
+           __atomic_load_n(&freeBlocks, __ATOMIC_RELAXED) ))
+  {
+    flushKicked = 1;
+    pthread_cond_broadcast(&flushCond);
+    pthread_cond_wait(&flushCond, &flushLock);
+  }
+  pthread_mutex_unlock(&flushLock);
+}
+
+// Copy aside what the checkpoint writes: the changed data and parity, the
+// fresh data first, then the changed metadata and checksum blocks. Only the
+// blocks in use in a changed segment, what is free may hold anything, unless
+// the checksums cover it too. 0, 1 if nothing changed, -1 if out of memory.
+// Callers hold commandLock alone and flushWriteLock.
+int CheckpointTake(struct Checkpoint *c)
+{
+  SealParity();
+  uint32_t num = super->block_num, start = super->data_start;
+  uint32_t csum = super->csum_start ? super->csum_start : num;
+  uint32_t meta = start + ( num - csum ); // the maps and inode table, then the checksums
+  if (!flushCrc && !( flushCrc = malloc((size_t) meta * 2 * sizeof(uint32_t)) )) { return -1; }
+  uint32_t *taken = flushCrc + meta;
+  pthread_mutex_lock(&allocLock);
+  int parity = super->parity_start != 0;
+  int direct = !parity && !flushJournalEnd; // else everything goes through the journal
+  c->data = c->n = 0;
+  for (uint32_t b = start; b < csum; ++b)
+  {
+    int wanted = segDirty[b / SEGMENT_BLOCKS] && ( blockMap[b] || parity );
+    c->n += wanted;
+    c->data += wanted && direct && !flushDurable[b];
+  }
+  for (uint32_t i = 0; i < meta; ++i)
+  {
+    taken[i] = crc32c(blocks[ i < start ? i : i - start + csum ], BLOCK_SIZE);
+    c->n += !flushCrcOk || taken[i] != flushCrc[i];
+  }
+  c->epoch = __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+  c->dirtied = segsDirtied;
+  if (c->n == 0)
+  {
+    pthread_mutex_unlock(&allocLock); // the image file is up to date
+    return 1;
+  }
+  if (c->n > flushCap)
+  {
+    free(flushBid); free(flushCopy); free(flushRec);
+    flushBid = malloc((size_t) c->n * sizeof(uint32_t));
+    flushCopy = malloc((size_t) c->n * BLOCK_SIZE);
+    flushRec = malloc((size_t) c->n * sizeof(struct Journal_Block));
+    flushCap = flushBid && flushCopy && flushRec ? c->n : 0;
+  }
+  if (!flushCap)
+  {
+    pthread_mutex_unlock(&allocLock);
+    return -1;
+  }
+  c->bid = flushBid;
+  c->copy = flushCopy;
+  // the fresh blocks, then the rest in order
+  uint32_t i = 0, j = c->data;
+  for (uint32_t b = 0; b < num; ++b)
+  {
+    if (b < start || b >= csum)
+    {
+      uint32_t m = b < start ? b : b - csum + start;
+      if (!flushCrcOk || taken[m] != flushCrc[m]) { c->bid[j++] = b; }
+    }
+    else if (segDirty[b / SEGMENT_BLOCKS] && ( blockMap[b] || parity ))
+    {
+      if (direct && !flushDurable[b]) { c->bid[i++] = b; } else { c->bid[j++] = b; }
+    }
+  }
+  for (i = 0; i < c->n; ++i) { memcpy(c->copy + (size_t) i * BLOCK_SIZE, blocks[ c->bid[i] ], BLOCK_SIZE); }
+  memcpy(flushTaken, blockMap, num);
+  memset(segDirty, 0, ( num + SEGMENT_BLOCKS - 1 ) / SEGMENT_BLOCKS);
+  flushKickAt = super->flush_mb ? segsDirtied + FlushLimit() : UINT64_MAX;
+  memcpy(flushCrc, taken, (size_t) meta * sizeof(uint32_t));
+  flushCrcOk = 1;
+  c->fd = fileno(image);
+  pthread_mutex_unlock(&allocLock);
+  return 0;
+}
+
+// wait for the bytes written so far to be due at FLUSH_RATE, unless as much
+// has changed again
+void FlushPace(uint64_t start, uint64_t bytes)
+{
+  uint64_t due = start + bytes * 1000000000 / FLUSH_RATE, now = NowNs();
+  if (due > now && DirtySegments() < FlushLimit()) { FlushWait(due - now); }
+}
+
+// write blocks from .. to - 1 of the copy in place, in runs of adjacent blocks
+int CheckpointPut(struct Checkpoint *c, uint32_t from, uint32_t to, uint64_t start, uint64_t *bytes)
+{
+  for (uint32_t i = from; i < to; )
+  {
+    uint32_t n = 1;
+    while (n < SEGMENT_BLOCKS && i + n < to && c->bid[i + n] == c->bid[i] + n) { ++n; }
+    FlushPace(start, *bytes);
+    uint64_t w = SpanStart();
+    int ok = pwrite(c->fd, c->copy + (size_t) i * BLOCK_SIZE, (size_t) n * BLOCK_SIZE,
+                    (off_t) c->bid[i] * BLOCK_SIZE) == (ssize_t) n * BLOCK_SIZE;
+    SpanStop("write", w);
+    if (!ok) { return -1; }
+    *bytes += (uint64_t) n * BLOCK_SIZE;
+    i += n;
+  }
+  return 0;
+}
+
+// append the blocks of the copy past the fresh ones to the journal and fsync it
+int JournalAppend(struct Checkpoint *c, uint64_t start, uint64_t *bytes)
+{
+  if (flushJournal == -1)
+  {
+    char path[MAX_PATH_LEN + 16];
+    JournalPath(path, sizeof(path));
+    if (( flushJournal = open(path, O_RDWR | O_CREAT, 0600) ) == -1) { return -1; }
+    // the new name has to last as well
+    char *slash = strrchr(path, '/');
+    if (slash) { slash[ slash == path ] = 0; }
+    int dfd = open(slash ? path : ".", O_RDONLY | O_DIRECTORY);
+    int ok = dfd != -1 && fsync(dfd) == 0;
+    if (dfd != -1) { close(dfd); }
+    if (!ok)
+    {
+      close(flushJournal);
+      flushJournal = -1;
+      return -1;
+    }
+  }
+  struct Journal_Header h = { JOURNAL_MAGIC, c->n - c->data, super->block_num, 0, flushSeq + 1 };
+  const uint8_t *copy = c->copy + (size_t) c->data * BLOCK_SIZE;
+  for (uint32_t i = 0; i < h.count; ++i)
+  {
+    flushRec[i].bid = c->bid[c->data + i];
+    flushRec[i].crc = crc32c(copy + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  h.crc = crc32c((uint8_t *) flushRec, h.count * sizeof(*flushRec));
+  off_t at = flushJournalEnd;
+  int ok = pwrite(flushJournal, &h, sizeof(h), at) == sizeof(h) &&
+           pwrite(flushJournal, flushRec, h.count * sizeof(*flushRec), at + sizeof(h)) == (ssize_t) ( h.count * sizeof(*flushRec) );
+  at += sizeof(h) + h.count * sizeof(*flushRec);
+  for (uint32_t i = 0; ok && i < h.count; i += SEGMENT_BLOCKS)
+  {
+    uint32_t n = h.count - i < SEGMENT_BLOCKS ? h.count - i : SEGMENT_BLOCKS;
+    FlushPace(start, *bytes);
+    uint64_t w = SpanStart();
+    ok = pwrite(flushJournal, copy + (size_t) i * BLOCK_SIZE, (size_t) n * BLOCK_SIZE, at) == (ssize_t) n * BLOCK_SIZE;
+    SpanStop("write journal", w);
+    at += (off_t) n * BLOCK_SIZE;
+    *bytes += (uint64_t) n * BLOCK_SIZE;
+  }
+  if (!ok || fsync(flushJournal) == -1) { return -1; }
+  flushJournalEnd = at;
+  flushSeq = h.seq;
+  return 0;
+}
+
+// Write the copy: the fresh blocks, an fsync, the rest to the journal (the
+// commit), then in place, an fsync, and the journal is emptied. 0, -1 if it
+// failed before the commit, -2 after.
+int CheckpointWrite(struct Checkpoint *c)
+{
+  uint64_t t = SpanStart();
+  for (uint32_t i = 0; imageKey.on && i < c->n; ++i)
+  {
+    uint8_t *p = c->copy + (size_t) i * BLOCK_SIZE;
+    if (c->bid[i]) { XtsBlock(c->bid[i], p, p, 0); } // the super block is stored plain
+  }
+  SpanStop("encrypt", imageKey.on ? t : 0);
+  uint64_t start = NowNs(), bytes = 0;
+  if (CheckpointPut(c, 0, c->data, start, &bytes) == -1 || ( c->data && fsync(c->fd) == -1 )) { return -1; }
+  if (c->data == c->n) { return 0; }
+  if (JournalAppend(c, start, &bytes) == -1) { return -1; }
+  if (CheckpointPut(c, c->data, c->n, start, &bytes) == -1 || fsync(c->fd) == -1) { return -2; }
+  // left there after a crash, its entries would only be written again,
+  // and the next one starts over them with the next seq
+  if (ftruncate(flushJournal, 0) == 0) { flushJournalEnd = 0; }
+  return 0;
+}
+
+// After writing c: once committed, the blocks it no longer uses may be
+// reused, and unless all of it is in place it goes again with the next one.
+void CheckpointDone(struct Checkpoint *c, int written)
+{
+  int err = errno;
+  uint32_t start = super->data_start, csum = super->csum_start ? super->csum_start : super->block_num;
+  pthread_mutex_lock(&allocLock);
+  if (written != -1)
+  {
+    memcpy(flushDurable, flushTaken, super->block_num);
+    HeldRelease(c->epoch);
+  }
+  else
+  {
+    // the journal entry may have made it to the disk after all
+    for (uint32_t b = 0; b < super->block_num; ++b) { flushDurable[b] |= flushTaken[b]; }
+  }
+  if (written != 0)
+  {
+    for (uint32_t i = 0; i < c->n; ++i)
+    {
+      if (c->bid[i] >= start && c->bid[i] < csum) { segDirty[ c->bid[i] / SEGMENT_BLOCKS ] = 1; }
+    }
+    flushCrcOk = 0;
+  }
+  pthread_mutex_unlock(&allocLock);
+  flushFailed = written != 0;
+  flushErrno = err;
+  if (!flushFailed && c->n)
+  {
+    ++flushCount;
+    flushBytes += (uint64_t) c->n * BLOCK_SIZE;
+  }
+
+  // commands held back for it may go on
+  pthread_mutex_lock(&flushLock);
+  if (!flushFailed) { flushDirtied = c->dirtied; }
+  pthread_cond_broadcast(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+}
+
+// take a checkpoint and write it
+void Checkpoint()
+{
+  struct Checkpoint c;
+  if (FlushLock() == -1) { return; }
+  pthread_mutex_lock(&flushWriteLock);
+  uint64_t t = SpanStart();
+  int taken = CheckpointTake(&c);
+  SpanStop("checkpoint", t);
+  pthread_rwlock_unlock(&commandLock);
+  t = SpanStart();
+  if (taken != -1) { CheckpointDone(&c, taken == 0 ? CheckpointWrite(&c) : 0); }
+  SpanStop("write checkpoint", taken == 0 ? t : 0);
+  if (taken == -1)
+  {
+    flushFailed = 1;
+    flushErrno = ENOMEM;
+  }
+  pthread_mutex_unlock(&flushWriteLock);
+
+  // segments the cleaner left for the checkpoint may be free to clean now
+  pthread_mutex_lock(&cleanerLock);
+  cleanerDone = 0;
+  pthread_cond_broadcast(&cleanerCond);
+  pthread_mutex_unlock(&cleanerLock);
+}
+
+void *Flusher(void *arg)
+{
+  uint64_t last = NowNs();
+  while (!FlushWait((uint64_t) FLUSH_POLL_MS * 1000000))
+  {
+    uint64_t now = NowNs();
+    pthread_mutex_lock(&flushLock);
+    int kicked = flushKicked;         // running short of space waits for it too
+    flushKicked = 0;
+    pthread_mutex_unlock(&flushLock);
+    if (( super->flush_seconds && now - last >= (uint64_t) super->flush_seconds * 1000000000 ) ||
+        DirtySegments() >= FlushLimit() || kicked)
+    {
+      Checkpoint();
+      last = now;
+    }
+  }
+  return NULL;
+}
+
+// give the held blocks back and forget what the image file uses, write-back is off
+void FlushForget()
+{
+  pthread_mutex_lock(&allocLock);
+  HeldRelease(UINT64_MAX);
+  free(flushDurable); free(flushTaken);
+  flushDurable = NULL;
+  flushTaken = NULL;
+  pthread_mutex_unlock(&allocLock);
+}
+
+// Start the flusher if the open image has write-back on. saved: the image
+// file is what is in memory, else the first checkpoint writes everything
+// through the journal.
+void FlushStart(int saved)
+{
+  if (!image || flushStarted || !( super->flush_seconds || super->flush_mb )) { return; }
+  flushStop = 0;
+  flushKicked = 0;
+  flushDirtied = segsDirtied;
+  flushCrcOk = 0;
+  flushCount = flushBytes = 0;
+  flushFailed = 0;
+  KernelsInit();                    // for crc32c
+  uint8_t *durable = malloc(super->block_num), *taken = malloc(super->block_num);
+  if (!durable || !taken)
+  {
+    free(durable); free(taken);
+    return;
+  }
+  pthread_mutex_lock(&allocLock);
+  if (saved) { memcpy(durable, blockMap, super->block_num); } else { memset(durable, 1, super->block_num); }
+  memcpy(taken, durable, super->block_num);
+  flushDurable = durable;
+  flushTaken = taken;
+  flushKickAt = super->flush_mb ? segsDirtied + FlushLimit() : UINT64_MAX;
+  pthread_mutex_unlock(&allocLock);
+  flushStarted = pthread_create(&flushThread, NULL, Flusher, NULL) == 0;
+  if (!flushStarted) { FlushForget(); }
+}
+
+// Write a checkpoint from a command running alone, after the one being
+// written if there is one. 0, or -1 if it failed.
+int FlushSync()
+{
+  if (!flushStarted) { return 0; }
+  struct Checkpoint c;
+  pthread_mutex_lock(&flushWriteLock);
+  int taken = CheckpointTake(&c);
+  if (taken != -1) { CheckpointDone(&c, taken == 0 ? CheckpointWrite(&c) : 0); }
+  if (taken == -1)
+  {
+    flushFailed = 1;
+    flushErrno = ENOMEM;
+  }
+  int failed = flushFailed;
+  pthread_mutex_unlock(&flushWriteLock);
+  return failed ? -1 : 0;
+}
+
+// stop the flusher, letting it finish the checkpoint it is writing
+void FlushStop()
+{
+  if (!flushStarted) { return; }
+  pthread_mutex_lock(&flushLock);
+  flushStop = 1;
+  pthread_cond_broadcast(&flushCond);
+  pthread_mutex_unlock(&flushLock);
+  pthread_join(flushThread, NULL);
+  flushStarted = 0;
+  FlushForget();
+  pthread_mutex_lock(&allocLock);
+  flushKickAt = UINT64_MAX;
+  pthread_mutex_unlock(&allocLock);
+  if (flushJournal != -1) { close(flushJournal); }
+  flushJournal = -1;
+  free(flushBid); free(flushCopy); free(flushRec); free(flushCrc);
+  flushBid = NULL;
+  flushCopy = NULL;
+  flushRec = NULL;
+  flushCrc = NULL;
+  flushCap = 0;
+}
+
+// `flush [off | seconds [MB]]`: turn write-back on or off, or tell how it goes
+int Flush(char **arg, int argc)
+{
+  if (!image)
+  {
+    fprintf(out, "flush error: No opened image file.\n");
+    return -1;
+  }
+  if (argc > 0)
+  {
+    char *end1 = "", *end2 = "";
+    unsigned long seconds = 0, mb = 0;
+    if (strcmp(arg[0], "off") != 0)
+    {
+      seconds = strtoul(arg[0], &end1, 10);
+      mb = argc > 1 ? strtoul(arg[1], &end2, 10) : FLUSH_MB;
+    }
+    if (argc > 2 || *end1 || *end2 || arg[0][0] == '-' || ( argc > 1 && arg[1][0] == '-' ) ||
+        seconds > UINT32_MAX || mb > UINT32_MAX || ( strcmp(arg[0], "off") != 0 && !seconds && !mb ))
+    {
+      fprintf(out, "flush error: Give seconds and MB, or off.\n");
+      return -1;
+    }
+    FlushStop();
+    super->flush_seconds = seconds;
+    super->flush_mb = mb;
+    FlushStart(0);
+  }
+  if (!flushStarted)
+  {
+    fprintf(out, "Write-back is off, changes are written on close.\n");
+    return 0;
+  }
+  fprintf(out, "Write-back every %u s or %u MB, %" PRIu64 " checkpoints (%" PRIu64 " MB) written, "
+          "%u MB unflushed.\n", super->flush_seconds, super->flush_mb, flushCount, flushBytes >> 20,
+          DirtySegments() * ( SEGMENT_BLOCKS * BLOCK_SIZE >> 20 ));
+  if (flushFailed) { fprintf(out, "The last checkpoint failed: %s\n", strerror(flushErrno)); }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Benchmark
+//
+// `bench [threads] [seconds]` measures get and list throughput on the files of
+// the current directory with 1, 2, 4 ... threads, while one more thread keeps
+// overwriting a scratch file next to them.
+
+#define BENCH_SCRATCH ".bench"
+#define BENCH_PUT_SIZE ( 256 * 1024 )
+#define MAX_BENCH_THREADS 64
+
+struct Bench {
+  char   **names;                   // files to read
+  int      nnames;
+  int      cwd;
+  unsigned seed;
+  uint64_t ops;                     // gets, or puts for the writer
+  uint64_t lists;
+  uint64_t bytes;
+};
+
+volatile int benchStop;
+__thread char benchSink[BLOCK_SIZE];
+
+// copy into a per-thread buffer, like a get would copy out to a file
+ssize_t NullWrite(void *cookie, const char *buf, size_t size)
+{
+  for (size_t done = 0; done < size; done += BLOCK_SIZE)
+  {
+    memcpy(benchSink, buf + done, size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE);
+  }
+  return size;
+}
+
+int NullSeek(void *cookie, off64_t *offset, int whence)
+{
+  return 0;
+}
+
+// a stream that goes nowhere, so only the file system is measured
+FILE *NullFile()
+{
+  cookie_io_functions_t io = { NULL, NullWrite, NullSeek, NULL };
+  return fopencookie(NULL, "w", io);
+}
+
+void *BenchReader(void *arg)
+{
+  struct Bench *b = arg;
+  out = NullFile();
+  cwd = b->cwd;
+  while (!benchStop)
+  {
+    ReadBegin();
+    const char *name = b->names[ rand_r(&b->seed) % b->nnames ];
+    int nid = Namei(name);
+    if (nid != -1 && GetStream(name, out) == 0)
+    {
+      b->bytes += inodes[nid].size;
+      ++b->ops;
+    }
+    if (b->ops % 16 == 0)
+    {
+      List(1, NULL, SORT_NAME);
+      ++b->lists;
+    }
+    ReadEnd();
+  }
+  fclose(out);
+  ReadDone();
+  return NULL;
+}
+
+void *BenchWriter(void *arg)
+{
+  struct Bench *b = arg;
+  char *data = malloc(BENCH_PUT_SIZE);
+  out = NullFile();
+  cwd = b->cwd;
+  for (int i = 0; data && i < BENCH_PUT_SIZE; ++i) { data[i] = rand_r(&b->seed); }
+  while (data && !benchStop)
+  {
+    FILE *ifp = fmemopen(data, BENCH_PUT_SIZE, "r");
+    ReadBegin();
+    if (ifp && PutStream(ifp, BENCH_PUT_SIZE, BENCH_SCRATCH, NULL) == 0) { ++b->ops; }
+    ReadEnd();
+    Reclaim();
+    if (ifp) { fclose(ifp); }
+  }
+  free(data);
+  fclose(out);
+  ReadDone();
+  return NULL;
+}
+
+uint32_t Gcd(uint32_t a, uint32_t b)
+{
+  while (b) { uint32_t r = a % b; a = b; b = r; }
+  return a;
+}
+
+// MB/s of copying every block of the store out once, in a scattered order
+// as gets of many files would, so it shows what the pages cost in TLB misses
+double StoreCopyRate()
+{
+  uint32_t n = super->block_num, step = 1000003;
+  while (n > 1 && Gcd(step, n) != 1) { step += 2; }
+  uint64_t copied = 0, start = NowNs(), now = start;
+  while (now - start < 200000000)   // a fifth of a second at least
+  {
+    for (uint32_t i = 0, b = 0; i < n; ++i, b = ( b + step ) % n)
+    {
+      memcpy(benchSink, blocks[b], BLOCK_SIZE);
+    }
+    copied += n;
+    now = NowNs();
+  }
+  return copied * (double) BLOCK_SIZE / ( now - start ) * 1e9 / ( 1 << 20 );
+}
+
+// runs outside of a command, so it does not hold back reclamation itself
+int Bench(int threads, double seconds)
+{
+  if (threads < 1 || threads > MAX_BENCH_THREADS || !(seconds > 0))
+  {
+    fprintf(out, "bench error: Use 1 to %d threads and a positive time.\n", MAX_BENCH_THREADS);
+    return -1;
+  }
+  int slot;
+  ReadBegin();
+  if (BTreeLookup(cwd, BENCH_SCRATCH, &slot))
+  {
+    ReadEnd();
+    fprintf(out, "bench error: \"%s\" is in the way.\n", BENCH_SCRATCH);
+    return -1;
+  }
+
+  int nnames = 0;
+  char **names = NULL;
+  struct BTree_Cursor c;
+  for (int more = CursorFirst(&c, cwd); more; more = CursorNext(&c))
+  {
+    if (inodes[ c.leaf->inode[c.i] ].type != INODE_FILE) { continue; }
+    char **grown = realloc(names, ( nnames + 1 ) * sizeof(char *));
+    if (!grown) { break; }
+    names = grown;
+    names[nnames++] = strndup(NodeName(c.leaf, c.i), c.leaf->len[c.i]);
+  }
+  ReadEnd();
+  if (nnames == 0)
+  {
+    fprintf(out, "bench error: No files in the current directory.\n");
+    free(names);
+    return -1;
+  }
+
+  fprintf(out, "store: %u blocks in %s, copied at %.0f MB/s\n", super->block_num, storePages, StoreCopyRate());
+  fprintf(out, "threads     gets/s    lists/s       MB/s     puts/s\n");
+  int ret = 0;
+  for (int t = 1; ; t = t * 2 < threads ? t * 2 : threads)
+  {
+    struct Bench b[MAX_BENCH_THREADS + 1];
+    pthread_t tid[MAX_BENCH_THREADS + 1];
+    int ran[MAX_BENCH_THREADS + 1], readers = 0;
+    memset(b, 0, sizeof(b));
+    benchStop = 0;
+    for (int i = 0; i <= t; ++i)
+    {
+      b[i].names = names;
+      b[i].nnames = nnames;
+      b[i].cwd = cwd;
+      b[i].seed = i + 1;
+      ran[i] = pthread_create(&tid[i], NULL, i == t ? BenchWriter : BenchReader, &b[i]) == 0;
+      readers += ran[i] && i < t;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct timespec wait = { (time_t) seconds, ( seconds - (time_t) seconds ) * 1e9 };
+    nanosleep(&wait, NULL);
+    benchStop = 1;
+    for (int i = 0; i <= t; ++i)
+    {
+      if (ran[i]) { pthread_join(tid[i], NULL); }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!readers)
+    {
+      fprintf(out, "bench error: Failed to start the threads.\n");
+      ret = -1;
+      break;
+    }
+
+    double secs = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    uint64_t gets = 0, lists = 0, bytes = 0;
+    for (int i = 0; i < t; ++i)
+    {
+      gets += b[i].ops;
+      lists += b[i].lists;
+      bytes += b[i].bytes;
+    }
+    // the row is for the readers that started
+    fprintf(out, "%7d %10.0f %10.0f %10.1f %10.0f\n", readers, gets / secs, lists / secs,
+            bytes / secs / ( 1 << 20 ), b[t].ops / secs);
+    if (t == threads) { break; }
+  }
+
+  ReadBegin();
+  if (BTreeLookup(cwd, BENCH_SCRATCH, &slot)) { Del(BENCH_SCRATCH); }
+  ReadEnd();
+  Reclaim();
+  for (int i = 0; i < nnames; ++i) { free(names[i]); }
+  free(names);
+  return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// User Input
+//
+// This function processes user input into command tokens 
+int Tokenize(char* str, char** token, int* token_count)
+{ 
+  char *working_str  = strdup( str );
+  // we are going to move the working_str pointer so
+  // keep track of its original value so we can deallocate
+  // the correct amount at the end
+  char *working_root = working_str;                                                  
+  
+  // saveptr for strtok_r
+  char *arg_ptr;  
+
+  // Tokenize the input strings with whitespace used as the delimiter
+  // Empty tokens will not be saved in the array
+  for ( ; *token_count < MAX_NUM_ARGUMENTS; working_str = NULL, ++(*token_count) )
+  {
+    char* t = strtok_r(working_str, WHITESPACE, &arg_ptr);
+    if ( !t ) { break; }
+    snprintf(token[ *token_count ], MAX_COMMAND_SIZE, "%s", t );
+  }
+
+  free( working_root );
+  return 0;
+}
+
+// Check if a char pointed by `ptr` appears in a string `set`
+int IsElement(char* ptr, const char* set) 
+{
+  int i = 0;
+  while ( i < strlen(set) )
+  {
+    if ( *ptr == set[i++] ) { return 1; }
+  }
+  return 0;
+}
+
+// This function trims whitespaces on both ends
+// return str pointer passed in
+char* TrimWhiteSpace(char* str)
+{
+  assert(str);
+  if ( strlen(str) < 1 ) return str;
+
+  char* temp = strdup(str);
+  // end temp string after last non whitespace char
+  char* ptr = temp + strlen(str); // point to terminal null char
+  while (ptr != temp && IsElement(ptr-1,WHITESPACE))
+  {
+    --ptr;
+  }
+  *ptr = 0;
+  // move ptr to first non whitespace char
+  ptr = temp;
+  while ( IsElement(ptr,WHITESPACE) )
+  {
+    ++ptr;
+  }
+  // copy
+  strcpy(str,ptr);
+  free(temp);
+  return str;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Server
+//
+// `dropbox -s image socket [workers]` opens an image once and serves many
+// local clients over a Unix domain socket. A single poll() loop does all the
+// socket work and hands complete requests to a pool of worker threads, one
+// request per client at a time, so slow puts and gets of different clients
+// overlap. Requests and responses carry a small binary header. File data does not go through the
+// socket: the client passes the descriptor of its local file (SCM_RIGHTS) and
+// the server reads or writes it directly.
+
+enum Op { OP_PUT = 1, OP_GET, OP_LIST, OP_DEL, OP_ATTRIB, OP_MKDIR, OP_RMDIR, OP_DF, OP_IMPORT, OP_EXPORT, OP_RESERVE };
+
+struct Request_Header {
+  uint8_t  op;
+  uint8_t  nfds;                    // descriptors passed along with the request
+  uint16_t argc;
+  uint32_t len;                     // bytes of 0-terminated arguments that follow
+};
+
+struct Response_Header {
+  int32_t  status;
+  uint32_t len;                     // bytes of output text that follow
+};
+
+#define MAX_REQUEST_SIZE 8192
+#define MAX_CLIENTS 256
+#define MAX_PASSED_FDS 4
+
+struct Command_Op {
+  const char *name;
+  uint8_t     op;
+  uint8_t     nfds;
+};
+
+const struct Command_Op commandOps[] = {
+  { "put", OP_PUT, 1 }, { "get", OP_GET, 1 }, { "list", OP_LIST, 0 }, { "del", OP_DEL, 0 },
+  { "attrib", OP_ATTRIB, 0 }, { "mkdir", OP_MKDIR, 0 }, { "rmdir", OP_RMDIR, 0 }, { "df", OP_DF, 0 },
+  { "import", OP_IMPORT, 1 }, { "export", OP_EXPORT, 1 }, { "reserve", OP_RESERVE, 0 },
+};
+
+// the name of a request's command, for spans
+const char *OpName(int op)
+{
+  for (size_t i = 0; i < sizeof(commandOps) / sizeof(commandOps[0]); ++i)
+  {
+    if (commandOps[i].op == op) { return commandOps[i].name; }
+  }
+  return "request";
+}
+
+#define MAX_WORKERS 64
+
+struct Client {
+  int      fd;
+  uint8_t  in[MAX_REQUEST_SIZE];    // partially received requests
+  size_t   inLen;
+  int      fds[MAX_PASSED_FDS];     // received descriptors not used yet
+  int      nfds;
+  char    *outBuf;                  // responses not sent yet
+  size_t   outLen;
+  size_t   outPos;
+  int      busy;                    // a worker is running one of its requests
+  int      gone;                    // dropped, freed once its request is done
+};
+
+// a request on its way to a worker and its response on the way back
+struct Job {
+  struct Client *client;
+  struct Request_Header hdr;
+  char    *args;                    // copy of the arguments, argv points into it
+  char    *argv[MAX_NUM_ARGUMENTS];
+  int      fds[MAX_PASSED_FDS];
+  int32_t  status;
+  char    *text;                    // output of the command
+  size_t   textLen;
+  struct Job *next;
+};
+
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  jobReady = PTHREAD_COND_INITIALIZER;
+struct Job *jobs = NULL;            // waiting for a worker, oldest first
+struct Job **jobsTail = &jobs;
+struct Job *jobsDone = NULL;        // waiting for the poll loop
+int workersStop = 0;
+int wakePipe[2];                    // workers wake the poll loop through it
+
+volatile sig_atomic_t serverStop = 0;
+
+void StopServer(int sig)
+{
+  serverStop = 1;
+}
+
+// run one request with its output captured for the client
+int Dispatch(struct Request_Header *hdr, char **argv, int *fds)
+{
+  int argc = hdr->argc;
+  int status = -1;
+  cwd = super->root; // clients always name paths from the root
+  switch (hdr->op)
+  {
+    case OP_PUT:
+    {
+      struct stat buf;
+      if (argc < 1 || fstat(fds[0], &buf) == -1 || !S_ISREG(buf.st_mode))
+      {
+        fprintf(out, "put error: Source is not a regular file.\n");
+        break;
+      }
+      FILE *ifp = fdopen(dup(fds[0]), "r");
+      if (!ifp) { break; }
+      fprintf(out, "Reading %" PRId64 " bytes from %s\n", (int64_t) buf . st_size, argv[0] );
+      status = PutStream(ifp, buf.st_size, argv[0], argc > 1 ? argv[1] : NULL);
+      fclose(ifp);
+      break;
+    }
+    case OP_GET:
+    {
+      FILE *ofp = argc < 1 ? NULL : fdopen(dup(fds[0]), "w");
+      if (!ofp) { break; }
+      status = GetStream(argv[0], ofp);
+      fclose(ofp);
+      break;
+    }
+    case OP_LIST:   status = ListArgs(argv, argc); break;
+    case OP_DEL:    status = argc == 1 ? Del(argv[0]) : -1; break;
+    case OP_ATTRIB: status = argc == 2 ? AttribHelper(argv[0], argv[1]) : -1; break;
+    case OP_MKDIR:  status = argc == 1 ? Mkdir(argv[0]) : -1; break;
+    case OP_RMDIR:  status = argc == 1 ? Rmdir(argv[0]) : -1; break;
+    case OP_DF:     PrintDf(); status = 0; break;
+    case OP_RESERVE: status = argc == 2 ? Reserve(argv[0], argv[1]) : -1; break;
+    case OP_IMPORT:
+    case OP_EXPORT:
+    {
+      // the archive name is only informational, the client passed it open
+      FILE *fp = argc < 1 ? NULL : fdopen(dup(fds[0]), hdr->op == OP_IMPORT ? "r" : "w");
+      if (!fp) { break; }
+      const char *path = argc > 1 ? argv[1] : NULL;
+      status = hdr->op == OP_IMPORT ? ImportStream(fp, path) : ExportStream(fp, path);
+      fclose(fp);
+      break;
+    }
+    default:
+      fprintf(out, "error: Unknown request.\n");
+  }
+  return status;
+}
+
+// run requests until the server stops and the queue is empty
+void *Worker(void *arg)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&jobLock);
+    while (!jobs && !workersStop) { pthread_cond_wait(&jobReady, &jobLock); }
+    struct Job *job = jobs;
+    if (job)
+    {
+      jobs = job->next;
+      if (!jobs) { jobsTail = &jobs; }
+    }
+    pthread_mutex_unlock(&jobLock);
+    if (!job) { break; }
+
+    out = open_memstream(&job->text, &job->textLen);
+    CommandBegin();
+    ReadBegin();
+    uint64_t t = SpanStart();
+    job->status = Dispatch(&job->hdr, job->argv, job->fds);
+    SpanStop(OpName(job->hdr.op), t);
+    ReadEnd();
+    Reclaim();
+    CommandEnd();
+    fclose(out);
+    for (int i = 0; i < job->hdr.nfds; ++i) { close(job->fds[i]); }
+
+    pthread_mutex_lock(&jobLock);
+    job->next = jobsDone;
+    jobsDone = job;
+    pthread_mutex_unlock(&jobLock);
+    // a full pipe already wakes the loop
+    if (write(wakePipe[1], "", 1) == -1) { }
+  }
+  ReadDone();
+  return NULL;
+}
+
+void JobFree(struct Job *job)
+{
+  free(job->text);
+  free(job->args);
+  free(job);
+}
+
+// send as much pending output as the socket takes, -1 if the client is gone
+int ClientWrite(struct Client *c)
+{
+  while (c->outPos < c->outLen)
+  {
+    ssize_t n = send(c->fd, c->outBuf + c->outPos, c->outLen - c->outPos, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    c->outPos += n;
+  }
+  c->outPos = c->outLen = 0;
+  return 0;
+}
+
+// hand the complete request at the front of the input buffer to a worker
+int ClientRequest(struct Client *c, struct Request_Header *hdr)
+{
+  if (hdr->argc > MAX_NUM_ARGUMENTS || hdr->nfds > c->nfds)
+  {
+    return -1;
+  }
+  struct Job *job = calloc(1, sizeof(*job));
+  char *args = malloc(hdr->len + 1);
+  if (!job || !args)
+  {
+    free(job);
+    free(args);
+    return -1;
+  }
+  memcpy(args, c->in + sizeof(*hdr), hdr->len);
+  // arguments must be 0-terminated inside the payload
+  size_t pos = 0;
+  for (int i = 0; i < hdr->argc; ++i)
+  {
+    char *end = pos < hdr->len ? memchr(args + pos, 0, hdr->len - pos) : NULL;
+    if (!end)
+    {
+      free(job);
+      free(args);
+      return -1;
+    }
+    job->argv[i] = args + pos;
+    pos = end - args + 1;
+  }
+  job->client = c;
+  job->hdr = *hdr;
+  job->args = args;
+
+  // its descriptors go along, the rest belong to later requests
+  memcpy(job->fds, c->fds, hdr->nfds * sizeof(int));
+  c->nfds -= hdr->nfds;
+  memmove(c->fds, c->fds + hdr->nfds, c->nfds * sizeof(int));
+  c->busy = 1;
+
+  pthread_mutex_lock(&jobLock);
+  *jobsTail = job;
+  jobsTail = &job->next;
+  pthread_cond_signal(&jobReady);
+  pthread_mutex_unlock(&jobLock);
+  return 0;
+}
+
+// start the next complete request unless one is running, -1 to drop the client
+int ClientNext(struct Client *c)
+{
+  struct Request_Header hdr;
+  if (c->busy || c->inLen < sizeof(hdr))
+  {
+    return 0;
+  }
+  memcpy(&hdr, c->in, sizeof(hdr));
+  size_t total = sizeof(hdr) + hdr.len;
+  if (total > sizeof(c->in))
+  {
+    return -1;
+  }
+  if (c->inLen < total)
+  {
+    return 0;
+  }
+  if (ClientRequest(c, &hdr) == -1)
+  {
+    return -1;
+  }
+  c->inLen -= total;
+  memmove(c->in, c->in + total, c->inLen);
+  return 0;
+}
+
+// queue the response of a finished request
+int ClientRespond(struct Client *c, struct Job *job)
+{
+  struct Response_Header rsp;
+  rsp.status = job->status;
+  rsp.len = job->textLen;
+  char *buf = realloc(c->outBuf, c->outLen + sizeof(rsp) + job->textLen);
+  if (!buf) { return -1; }
+  c->outBuf = buf;
+  memcpy(c->outBuf + c->outLen, &rsp, sizeof(rsp));
+  memcpy(c->outBuf + c->outLen + sizeof(rsp), job->text, job->textLen);
+  c->outLen += sizeof(rsp) + job->textLen;
+  return 0;
+}
+
+// receive bytes and descriptors and start a request, -1 to drop the client
+int ClientRead(struct Client *c)
+{
+  char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+  struct iovec iov = { c->in + c->inLen, sizeof(c->in) - c->inLen };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0)
+  {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  }
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+  {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+    {
+      int count = ( cm->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+      int *fds = (int *) CMSG_DATA(cm);
+      for (int i = 0; i < count; ++i)
+      {
+        if (c->nfds < MAX_PASSED_FDS) { c->fds[c->nfds++] = fds[i]; }
+        else { close(fds[i]); }
+      }
+    }
+  }
+  if (n == 0 || (msg.msg_flags & MSG_CTRUNC))
+  {
+    return -1;
+  }
+  c->inLen += n;
+  return ClientNext(c);
+}
+
+// stop talking to a client, it is freed once no worker runs its request
+void ClientDrop(struct Client *c)
+{
+  if (c->fd != -1) { close(c->fd); }
+  c->fd = -1;
+  c->gone = 1;
+}
+
+void ClientFree(struct Client *c)
+{
+  for (int i = 0; i < c->nfds; ++i) { close(c->fds[i]); }
+  if (c->fd != -1) { close(c->fd); }
+  free(c->outBuf);
+  free(c);
+}
+
+int Serve(const char *img, const char *path, int nworkers)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    printf("serve error: Socket path too long.\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (Open(img) == -1)
+  {
+    return -1;
+  }
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (lfd == -1 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(lfd, 64) == -1
+      || pipe2(wakePipe, O_NONBLOCK | O_CLOEXEC) == -1)
+  {
+    perror("serve error");
+    if (lfd != -1) { close(lfd); }
+    Close();
+    return -1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = StopServer; // no SA_RESTART, so poll() returns to check the flag
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // workers inherit the blocked signals, so only this thread is interrupted
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  pthread_t workers[MAX_WORKERS];
+  int started = 0;
+  while (started < nworkers && pthread_create(&workers[started], NULL, Worker, NULL) == 0) { ++started; }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  printf("Serving %s on %s with %d workers\n", img, path, started);
+  fflush(stdout);
+
+  struct Client *clients[MAX_CLIENTS];
+  struct pollfd  pfd[MAX_CLIENTS + 2];
+  int nclients = 0;
+  while (!serverStop && started > 0)
+  {
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = wakePipe[0];
+    pfd[1].events = POLLIN;
+    for (int i = 0; i < nclients; ++i)
+    {
+      struct Client *c = clients[i];
+      // a client with a running request is only listened to again afterwards
+      short events = ( c->busy ? 0 : POLLIN ) | ( c->outLen ? POLLOUT : 0 );
+      pfd[i+2].fd = events ? c->fd : -1;
+      pfd[i+2].events = events;
+      pfd[i+2].revents = 0;
+    }
+    if (poll(pfd, nclients + 2, -1) == -1)
+    {
+      if (errno == EINTR) { continue; }
+      perror("serve error: poll");
+      break;
+    }
+
+    // pass finished requests back to their clients and start their next ones
+    if (pfd[1].revents & POLLIN)
+    {
+      char buf[64];
+      while (read(wakePipe[0], buf, sizeof(buf)) > 0) { }
+      pthread_mutex_lock(&jobLock);
+      struct Job *list = jobsDone;
+      jobsDone = NULL;
+      pthread_mutex_unlock(&jobLock);
+      while (list)
+      {
+        struct Job *job = list;
+        list = job->next;
+        struct Client *c = job->client;
+        c->busy = 0;
+        if (!c->gone && ( ClientRespond(c, job) == -1 || ClientNext(c) == -1 || ClientWrite(c) == -1 ))
+        {
+          ClientDrop(c);
+        }
+        JobFree(job);
+      }
+    }
+
+    for (int i = 0; i < nclients; ++i)
+    {
+      struct Client *c = clients[i];
+      short ev = pfd[i+2].revents;
+      int drop = 0;
+      if (c->gone) { continue; }
+      if (ev & POLLIN) { drop = ClientRead(c) == -1; }
+      else if (ev & (POLLHUP | POLLERR)) { drop = c->busy || ClientRead(c) == -1; }
+      if (!drop && (ev & POLLOUT)) { drop = ClientWrite(c) == -1; }
+      if (drop) { ClientDrop(c); }
+    }
+
+    // walk backwards so removing a client only moves one already checked
+    for (int i = nclients - 1; i >= 0; --i)
+    {
+      if (clients[i]->gone && !clients[i]->busy)
+      {
+        ClientFree(clients[i]);
+        clients[i] = clients[--nclients];
+      }
+    }
+
+    if (pfd[0].revents & POLLIN)
+    {
+      int fd;
+      while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+      {
+        struct Client *c = nclients < MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+        if (!c) { close(fd); continue; }
+        c->fd = fd;
+        clients[nclients++] = c;
+      }
+    }
+  }
+
+  // let the workers finish what is queued, nothing may run while saving
+  pthread_mutex_lock(&jobLock);
+  workersStop = 1;
+  pthread_cond_broadcast(&jobReady);
+  pthread_mutex_unlock(&jobLock);
+  for (int i = 0; i < started; ++i) { pthread_join(workers[i], NULL); }
+  while (jobsDone)
+  {
+    struct Job *job = jobsDone;
+    jobsDone = job->next;
+    JobFree(job);
+  }
+  for (int i = 0; i < nclients; ++i) { ClientFree(clients[i]); }
+  close(wakePipe[0]);
+  close(wakePipe[1]);
+  close(lfd);
+  unlink(path);
+  printf("Shutting down, saving %s\n", img);
+  return Close();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Client
+//
+// `dropbox -c socket [command]` runs one command, or a shell, against a server.
+
+// send a request with its descriptors and print the response to text, returns its status
+int Request(int sock, uint8_t op, int argc, char **argv, int *fds, int nfds, FILE *text)
+{
+  char buf[MAX_REQUEST_SIZE];
+  struct Request_Header *hdr = (struct Request_Header *) buf;
+  size_t len = sizeof(*hdr);
+  for (int i = 0; i < argc; ++i)
+  {
+    size_t l = strlen(argv[i]) + 1;
+    if (len + l > sizeof(buf))
+    {
+      printf("error: Request too long.\n");
+      return -1;
+    }
+    memcpy(buf + len, argv[i], l);
+    len += l;
+  }
+  hdr->op = op;
+  hdr->nfds = nfds;
+  hdr->argc = argc;
+  hdr->len = len - sizeof(*hdr);
+
+  char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { buf, len };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds > 0)
+  {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+  }
+  // the descriptors ride on the first byte, the rest may follow in pieces
+  size_t sent = 0;
+  while (sent < len)
+  {
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      perror("error: Lost connection to server");
+      return -1;
+    }
+    sent += n;
+    iov.iov_base = buf + sent;
+    iov.iov_len = len - sent;
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+  }
+
+  struct Response_Header rsp;
+  if (recv(sock, &rsp, sizeof(rsp), MSG_WAITALL) != sizeof(rsp))
+  {
+    printf("error: Lost connection to server.\n");
+    return -1;
+  }
+  while (rsp.len > 0)
+  {
+    ssize_t n = recv(sock, buf, rsp.len < sizeof(buf) ? rsp.len : sizeof(buf), 0);
+    if (n <= 0)
+    {
+      printf("error: Lost connection to server.\n");
+      return -1;
+    }
+    fwrite(buf, 1, n, text);
+    rsp.len -= n;
+  }
+  fflush(text);
+  return rsp.status;
+}
+
+// turn a shell command into a request, opening local files for put and get
+int ClientCommand(int sock, char **token, int token_count)
+{
+  const struct Command_Op *cmd = NULL;
+  for (size_t i = 0; i < sizeof(commandOps) / sizeof(commandOps[0]); ++i)
+  {
+    if (strcmp(commandOps[i].name, token[0]) == 0) { cmd = &commandOps[i]; }
+  }
+  if (!cmd)
+  {
+    printf("error: Unknown command.\n");
+    return -1;
+  }
+
+  int fd = -1;
+  char *args[MAX_NUM_ARGUMENTS];
+  int argc = token_count - 1;
+  memcpy(args, token + 1, argc * sizeof(char *));
+  if (cmd->op == OP_PUT || cmd->op == OP_GET)
+  {
+    if (token_count != 2 && token_count != 3)
+    {
+      printf("Usage: %s filename [destination] (optional)\n", token[0]);
+      return -1;
+    }
+    if (cmd->op == OP_PUT)
+    {
+      fd = open(token[1], O_RDONLY | O_CLOEXEC);
+      if (fd == -1)
+      {
+        printf("put error: File does not exist.\n");
+        return -1;
+      }
+      // the server only gets the descriptor, so send the name along
+      args[0] = (char *) BaseName(token[1]);
+    }
+    else
+    {
+      const char *dest = token_count == 3 ? token[2] : BaseName(token[1]);
+      fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd == -1)
+      {
+        printf("Could not open output file: %s\n", dest );
+        return -1;
+      }
+      argc = 1;
+    }
+  }
+  int toStdout = 0;
+  if (cmd->op == OP_IMPORT || cmd->op == OP_EXPORT)
+  {
+    if (token_count != 2 && token_count != 3)
+    {
+      printf("Usage: %s archive [path] (optional)\n", token[0]);
+      return -1;
+    }
+    toStdout = cmd->op == OP_EXPORT && strcmp(token[1], "-") == 0;
+    if (strcmp(token[1], "-") == 0)
+    {
+      fd = fcntl(cmd->op == OP_IMPORT ? 0 : 1, F_DUPFD_CLOEXEC, 0);
+    }
+    else if (cmd->op == OP_IMPORT)
+    {
+      fd = open(token[1], O_RDONLY | O_CLOEXEC);
+    }
+    else
+    {
+      fd = open(token[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1)
+    {
+      printf("%s error: Cannot open \"%s\".\n", token[0], token[1]);
+      return -1;
+    }
+  }
+
+  // the response would end up inside an archive written to stdout
+  if (toStdout) { fflush(stdout); }
+  int status = Request(sock, cmd->op, argc, args, &fd, fd == -1 ? 0 : 1, toStdout ? stderr : stdout);
+  if (fd != -1) { close(fd); }
+  if (status != 0 && cmd->op == OP_GET)
+  {
+    unlink(token_count == 3 ? token[2] : BaseName(token[1]));
+  }
+  if (status != 0 && cmd->op == OP_EXPORT && !toStdout)
+  {
+    unlink(token[1]);
+  }
+  return status;
+}
+
+int ClientShell(const char *path, int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+  {
+    perror("error: Cannot connect to server");
+    return 1;
+  }
+
+  if (argc > 0) // one command from the command line
+  {
+    int status = ClientCommand(sock, argv, argc < MAX_NUM_ARGUMENTS ? argc : MAX_NUM_ARGUMENTS);
+    close(sock);
+    return status == 0 ? 0 : 1;
+  }
+
+  char* cmd_str = (char*) calloc( MAX_COMMAND_SIZE, sizeof(char) );
+  char* token[MAX_NUM_ARGUMENTS];
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
+  {
+    token[i] = (char*)calloc(MAX_COMMAND_SIZE, sizeof(char));
+  }
+  while (1)
+  {
+    printf ("msh> ");
+    fflush(stdout);
+    if ( !fgets (cmd_str, MAX_COMMAND_SIZE, stdin) ) { break; }
+    char *working_ptr = TrimWhiteSpace(cmd_str);
+    if ( !strlen(working_ptr) ) { continue; }
+    int token_count = 0;
+    Tokenize(working_ptr, token, &token_count);
+    if (strcmp("exit", token[0]) == 0 || strcmp("quit", token[0]) == 0) { break; }
+    ClientCommand(sock, token, token_count);
+  }
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
+  {
+    free(token[i]);
+  }
+  free(cmd_str);
+  close(sock);
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// 
+// Tracing
+//
+// `dropbox -t trace ...` records the shell session into a binary trace: for
+// every command that touches the file system its arguments, the size of the
+// file put or got, when it started and how long it took.
+// `dropbox -r trace image [-p]` replays a trace on image, a copy of the one
+// traced or a new one, since every open and createfs of the trace goes to it.
+// Puts read generated contents of the recorded size and gets write nowhere.
+// Commands run back to back, or with -p at the pace they were recorded at;
+// then the latencies of each command are printed next to the recorded ones.
+
+#define TRACE_MAGIC   0x54425044    // "DPBT"
+#define TRACE_VERSION 1
+
+enum Trace_Op { TRACE_PUT, TRACE_GET, TRACE_DEL, TRACE_ATTRIB, TRACE_LIST, TRACE_OPEN, TRACE_CLOSE,
+                TRACE_MKDIR, TRACE_RMDIR, TRACE_CD, TRACE_CREATEFS, TRACE_DF, TRACE_OPS };
+
+const char *traceOps[TRACE_OPS] = {
+  [TRACE_PUT] = "put", [TRACE_GET] = "get", [TRACE_DEL] = "del", [TRACE_ATTRIB] = "attrib",
+  [TRACE_LIST] = "list", [TRACE_OPEN] = "open", [TRACE_CLOSE] = "close", [TRACE_MKDIR] = "mkdir",
+  [TRACE_RMDIR] = "rmdir", [TRACE_CD] = "cd", [TRACE_CREATEFS] = "createfs", [TRACE_DF] = "df",
+};
+
+struct Trace_Header {
+  uint32_t magic;
+  uint32_t version;
+  int64_t  time;                    // wall clock when recording started
+};
+
+// followed by len bytes of arguments, each ending in a 0
+struct Trace_Record {
+  uint64_t start;                   // ns after recording started
+  uint64_t duration;                // ns
+  uint64_t size;                    // bytes put or got, else 0
+  uint8_t  op;
+  uint8_t  argc;                    // arguments after the command name
+  uint16_t len;
+  uint32_t pad;
+};
+
+FILE    *traceFile = NULL;
+uint64_t traceEpoch;                // when recording started
+struct Trace_Record tracePending;   // the command running, op TRACE_OPS if none
+char     traceArgs[MAX_COMMAND_SIZE];
+
+int TraceOpen(const char *path)
+{
+  traceFile = fopen(path, "w");
+  if (!traceFile)
+  {
+    perror("error: Cannot create the trace");
+    return -1;
+  }
+  struct Trace_Header h = { TRACE_MAGIC, TRACE_VERSION, time(NULL) };
+  fwrite(&h, sizeof(h), 1, traceFile);
+  traceEpoch = NowNs();
+  tracePending.op = TRACE_OPS;
+  return 0;
+}
+
+// note a shell command as it starts, if it is one that is traced
+void TraceBegin(char **token, int count)
+{
+  if (!traceFile) { return; }
+  int op = 0;
+  while (op < TRACE_OPS && strcmp(traceOps[op], token[0]) != 0) { ++op; }
+  tracePending.op = op;
+  if (op == TRACE_OPS) { return; }
+
+  uint64_t size = 0;
+  struct stat st;
+  if (op == TRACE_PUT && count >= 2 && stat(token[1], &st) == 0) { size = st.st_size; }
+  int nid = op == TRACE_GET && count >= 2 ? Namei(token[1]) : -1;
+  if (nid != -1) { size = inodes[nid].size; }
+  // the arguments came from one command line, so they fit
+  size_t len = 0;
+  for (int i = 1; i < count; ++i)
+  {
+    size_t n = strlen(token[i]) + 1;
+    memcpy(traceArgs + len, token[i], n);
+    len += n;
+  }
+  tracePending.size = size;
+  tracePending.argc = count - 1;
+  tracePending.len = len;
+  tracePending.start = NowNs() - traceEpoch;
+}
+
+// write out the command that just finished
+void TraceEnd()
+{
+  if (!traceFile || tracePending.op == TRACE_OPS) { return; }
+  tracePending.duration = NowNs() - traceEpoch - tracePending.start;
+  fwrite(&tracePending, sizeof(tracePending), 1, traceFile);
+  fwrite(traceArgs, 1, tracePending.len, traceFile);
+  tracePending.op = TRACE_OPS;
+}
+
+void TraceClose()
+{
+  TraceEnd();
+  if (traceFile && fclose(traceFile) == EOF) { perror("error: Writing the trace failed"); }
+  traceFile = NULL;
+}
+
+// the contents of a replayed put, cookie is the position
+ssize_t PatternRead(void *cookie, char *buf, size_t size)
+{
+  uint64_t *pos = cookie;
+  for (size_t i = 0; i < size; i += 8)
+  {
+    uint64_t v = ( ( *pos + i ) / 8 + 1 ) * 0x9e3779b97f4a7c15ull;
+    memcpy(buf + i, &v, size - i < 8 ? size - i : 8);
+  }
+  *pos += size;
+  return size;
+}
+
+// run one traced command with its file system side only, -1 if it failed
+int ReplayOne(struct Trace_Record *r, char **arg, const char *img, FILE *sink)
+{
+  int argc = r->argc;
+  switch (r->op)
+  {
+    case TRACE_PUT:
+    {
+      if (argc < 1) { return -1; }
+      uint64_t pos = 0;
+      cookie_io_functions_t io = { PatternRead, NULL, NULL, NULL };
+      FILE *ifp = fopencookie(&pos, "r", io);
+      if (!ifp) { return -1; }
+      int ret = PutStream(ifp, r->size, BaseName(arg[0]), argc > 1 ? arg[1] : NULL);
+      fclose(ifp);
+      return ret;
+    }
+    case TRACE_GET:      return argc >= 1 ? GetStream(arg[0], sink) : -1;
+    case TRACE_DEL:      return argc >= 1 ? Del(arg[0]) : -1;
+    case TRACE_ATTRIB:   return argc == 2 ? AttribHelper(arg[0], arg[1]) : -1;
+    case TRACE_LIST:     return ListArgs(arg, argc);
+    case TRACE_OPEN:     return Open(img);
+    case TRACE_CLOSE:    return Close();
+    case TRACE_MKDIR:    return argc == 1 ? Mkdir(arg[0]) : -1;
+    case TRACE_RMDIR:    return argc == 1 ? Rmdir(arg[0]) : -1;
+    case TRACE_CD:       return Cd(argc == 1 ? arg[0] : "/");
+    case TRACE_CREATEFS: return CreatefsArgs(img, arg + 1, argc - 1);
+    case TRACE_DF:       PrintDf(); return 0;
+  }
+  return -1;
+}
+
+int CompareU64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// latency in microseconds at fraction q of the sorted v[0..n-1]
+double Percentile(uint64_t *v, size_t n, double q)
+{
+  return n ? v[ (size_t) ( q * ( n - 1 ) + 0.5 ) ] / 1e3 : 0;
+}
+
+int Replay(const char *path, const char *img, int paced)
+{
+  FILE *fp = fopen(path, "r");
+  struct Trace_Header h;
+  if (!fp || fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION)
+  {
+    printf("replay error: \"%s\" is not a trace.\n", path);
+    if (fp) { fclose(fp); }
+    return -1;
+  }
+
+  // per command: replayed and recorded latencies
+  uint64_t *lat[TRACE_OPS] = { NULL }, *rec[TRACE_OPS] = { NULL };
+  size_t count[TRACE_OPS] = { 0 }, cap[TRACE_OPS] = { 0 };
+  uint64_t failed = 0, total = 0;
+  FILE *sink = NullFile();
+  FILE *console = out;
+  out = sink;                       // the commands' own output is not wanted
+
+  struct Trace_Record r;
+  char args[MAX_COMMAND_SIZE];
+  char *arg[MAX_NUM_ARGUMENTS];
+  int bad = 0;
+  uint64_t begin = NowNs();
+  while (fread(&r, sizeof(r), 1, fp) == 1)
+  {
+    bad = r.op >= TRACE_OPS || r.argc >= MAX_NUM_ARGUMENTS || r.len > sizeof(args) ||
+          fread(args, 1, r.len, fp) != r.len || ( r.len && args[r.len-1] );
+    for (size_t i = 0, off = 0; !bad && i < r.argc; ++i)
+    {
+      arg[i] = args + off;
+      off += strlen(arg[i]) + 1;
+      bad = off > r.len;
+    }
+    if (bad) { break; }
+
+    if (paced)
+    {
+      uint64_t now = NowNs();
+      if (begin + r.start > now)
+      {
+        uint64_t wait = begin + r.start - now;
+        struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+        nanosleep(&ts, NULL);
+      }
+    }
+    uint64_t t0 = NowNs();
+    CommandBegin();
+    ReadBegin();
+    failed += ReplayOne(&r, arg, img, sink) != 0;
+    ReadEnd();
+    Reclaim();
+    CommandEnd();
+    uint64_t t1 = NowNs();
+
+    if (count[r.op] == cap[r.op])
+    {
+      cap[r.op] = cap[r.op] ? cap[r.op] * 2 : 64;
+      lat[r.op] = realloc(lat[r.op], cap[r.op] * sizeof(uint64_t));
+      rec[r.op] = realloc(rec[r.op], cap[r.op] * sizeof(uint64_t));
+      assert(lat[r.op] && rec[r.op]);
+    }
+    lat[r.op][count[r.op]] = t1 - t0;
+    rec[r.op][count[r.op]++] = r.duration;
+    ++total;
+  }
+  double secs = ( NowNs() - begin ) / 1e9;
+  out = console;
+  fclose(sink);
+  fclose(fp);
+
+  fprintf(out, "Replayed %" PRIu64 " commands in %.3f s%s, %" PRIu64 " failed%s.\n", total, secs,
+          paced ? " at the recorded pace" : "", failed, bad ? "; the trace is cut short" : "");
+  fprintf(out, "%-9s %7s %11s %11s %11s %11s %11s  (us)\n", "command", "count", "traced p50",
+          "p50", "p90", "p99", "max");
+  for (int op = 0; op < TRACE_OPS; ++op)
+  {
+    size_t n = count[op];
+    if (n == 0) { continue; }
+    qsort(lat[op], n, sizeof(uint64_t), CompareU64);
+    qsort(rec[op], n, sizeof(uint64_t), CompareU64);
+    fprintf(out, "%-9s %7zu %11.1f %11.1f %11.1f %11.1f %11.1f\n", traceOps[op], n,
+            Percentile(rec[op], n, 0.5), Percentile(lat[op], n, 0.5), Percentile(lat[op], n, 0.9),
+            Percentile(lat[op], n, 0.99), lat[op][n-1] / 1e3);
+    free(lat[op]);
+    free(rec[op]);
+  }
+  return bad ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  out = stdout;
+  Initialize(BLOCK_NUM);
+
+  // in front of the other options `-t trace` records the session, `-S file` saves spans
+  while (argc >= 3 && ( strcmp("-t", argv[1]) == 0 || strcmp("-S", argv[1]) == 0 ))
+  {
+    if (argv[1][1] == 't' && TraceOpen(argv[2]) == -1) { return 1; }
+    if (argv[1][1] == 'S' && SpanBegin(argv[2]) == -1) { return 1; }
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc >= 2 && strcmp("-r", argv[1]) == 0)
+  {
+    if (argc != 4 && ( argc != 5 || strcmp("-p", argv[4]) != 0 ))
+    {
+      printf("Usage: %s -r trace image [-p]\n", argv[0]);
+      return 1;
+    }
+    int ret = Replay(argv[2], argv[3], argc == 5);
+    if (image) { Close(); }
+    return ret == 0 ? 0 : 1;
+  }
+
+  if (argc >= 2 && strcmp("-s", argv[1]) == 0)
+  {
+    long workers = argc == 5 ? strtol(argv[4], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc != 4 && argc != 5)
+    {
+      printf("Usage: %s -s image socket [workers]\n", argv[0]);
+      return 1;
+    }
+    if (workers < 1) { workers = 1; }
+    if (workers > MAX_WORKERS) { workers = MAX_WORKERS; }
+    return Serve(argv[2], argv[3], workers) == 0 ? 0 : 1;
+  }
+  if (argc >= 2 && strcmp("-c", argv[1]) == 0)
+  {
+    if (argc < 3)
+    {
+      printf("Usage: %s -c socket [command]\n", argv[0]);
+      return 1;
+    }
+    return ClientShell(argv[2], argc - 3, argv + 3);
+  }
+
+  // `dropbox -f image command [args]` runs one command on an image without
+  // a prompt, so that an export to standard output yields a clean archive
+  FILE *input = stdin;
+  int prompt = 1;
+  char script[MAX_COMMAND_SIZE];
+  if (argc >= 2 && strcmp("-f", argv[1]) == 0)
+  {
+    if (argc < 4)
+    {
+      printf("Usage: %s -f image command [args]\n", argv[0]);
+      return 1;
+    }
+    size_t len = 0;
+    for (int i = 3; i < argc && len < sizeof(script); ++i)
+    {
+      len += snprintf(script + len, sizeof(script) - len, "%s%s", argv[i], i + 1 < argc ? " " : "\nclose\n");
+    }
+    if (len >= sizeof(script))
+    {
+      printf("error: Command too long.\n");
+      return 1;
+    }
+    if (Open(argv[2]) == -1) { return 1; }
+    input = fmemopen(script, len, "r");
+    prompt = 0;
+  }
+
+  // cmd input string
+  char* cmd_str = (char*) calloc( MAX_COMMAND_SIZE, sizeof(char) );
+  char* working_ptr = cmd_str;
+
+  // For parsing command tokens
+  char* token[MAX_NUM_ARGUMENTS];
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
+  {
+    token[i] = (char*)calloc(MAX_COMMAND_SIZE, sizeof(char));
+  }
+  int token_count = 0;
+  uint64_t spanStart = 0;           // of the command being run
+  const char *spanCommand = NULL;
+
+  // main loop
+  while (1) 
+  {
+    // the previous command is done with whatever it saw
+    ReadEnd();
+    SpanStop(spanCommand, spanStart);
+    spanStart = 0;
+    Reclaim();
+    CommandEnd();
+    TraceEnd();
+    if (prompt) { printf ("msh> "); }
+    if (prompt) { CleanerResume(); } // the cleaner works while the user types
+    int got = fgets(cmd_str, MAX_COMMAND_SIZE, input) != NULL;
+    CleanerPause();
+    if ( !got ) { break; } // end of input
+    /* Trim whitespace at both ends */
+    working_ptr = TrimWhiteSpace(cmd_str);
+    if ( !working_ptr || !strlen(working_ptr) )
+      continue; // empty str, restart loop
+
+    /* Parse input */
+    token_count = 0;
+    Tokenize(working_ptr, token, &token_count);
+    CommandBegin();
+    ReadBegin();
+    TraceBegin(token, token_count);
+    if ( ( spanStart = SpanStart() ) ) { spanCommand = SpanName(token[0]); }
+
+    if ( strcmp("put", token[0]) == 0)
+    {
+      if (token_count == 2 || token_count == 3)
+      {
+        Put(token[1], token_count == 3 ? token[2] : NULL);
+      }
+      else
+      {
+        printf("Usage: put filename [destination] (optional)\n");
+      }
+      continue; // restart loop after printing history
+    }
+
+    else if ( strcmp("list", token[0]) == 0)
+    {
+      ListArgs(token + 1, token_count - 1);
+      continue; // restart loop after printing history
+    }
+
+    else if (strcmp("mkdir", token[0]) == 0 || strcmp("rmdir", token[0]) == 0)
+    {
+      if (token_count != 2)
+      {
+        printf("Usage: %s path\n", token[0]);
+      }
+      else if (token[0][0] == 'm')
+      {
+        Mkdir(token[1]);
+      }
+      else
+      {
+        Rmdir(token[1]);
+      }
+      continue;
+    }
+
+    else if (strcmp("cd", token[0]) == 0)
+    {
+      Cd(token_count == 2 ? token[1] : "/");
+      continue;
+    }
+
+    else if (strcmp("pwd", token[0]) == 0)
+    {
+      printf("%s\n", cwdPath);
+      continue;
+    }
+    else if ( strcmp("get", token[0]) == 0)
+    {
+      if (token_count == 2)
+      {
+        Get(token[1]);
+      }
+      else if (token_count == 3)
+      {
+        GetDest(token[1], token[2]);
+      }
+      else
+      {
+        printf("Usage: get filename [destination] (optional)\n");
+      }
+      continue;
+    }
+
+    else if (strcmp("createfs", token[0]) == 0)
+    {
+      if (token_count < 2 || CreatefsArgs(token[1], token + 2, token_count - 2) == -2)
+      {
+        printf("Usage: createfs filename [size] [-e] [-p N+M] (e.g. 64M or 4G; -e encrypts, -p adds parity)\n");
+      }
+      continue;
+    }
+
+    else if (strcmp("open", token[0]) == 0)
+    {
+      Open(token[1]);
+      continue;
+    }
+
+    else if (strcmp("close", token[0]) == 0)
+    {
+      Close();
+      continue;
+    }
+
+    else if (strcmp("del", token[0]) == 0)
+    {
+      Del(token[1]);
+      continue;
+    }
+
+    else if (strcmp("attrib", token[0]) == 0)
+    {
+      if (token_count != 3)
+      {
+        printf("Usage: attrib command (e.g. h+ or r-) filename\n");
+      }
+      AttribHelper(token[1], token[2]);
+      continue;
+    }
+    
+    else if (strcmp("df", token[0]) == 0)
+    {
+      PrintDf();
+      continue;
+    }
+
+    else if (strcmp("scrub", token[0]) == 0)
+    {
+      Scrub();
+      continue;
+    }
+
+    else if (strcmp("fsck", token[0]) == 0)
+    {
+      if (token_count > 2 || ( token_count == 2 && strcmp("-r", token[1]) != 0 ))
+      {
+        printf("Usage: fsck [-r] (rebuild the maps)\n");
+      }
+      else
+      {
+        Fsck(token_count == 2);
+      }
+      continue;
+    }
+
+    else if (strcmp("import", token[0]) == 0 || strcmp("export", token[0]) == 0)
+    {
+      if (token_count != 2 && token_count != 3)
+      {
+        printf("Usage: %s archive [path] (optional)\n", token[0]);
+      }
+      else if (token[0][0] == 'i')
+      {
+        Import(token[1], token_count == 3 ? token[2] : NULL);
+      }
+      else
+      {
+        Export(token[1], token_count == 3 ? token[2] : NULL);
+      }
+      continue;
+    }
+
+    else if (strcmp("reserve", token[0]) == 0)
+    {
+      if (token_count != 3)
+      {
+        printf("Usage: reserve filename size (e.g. 64M)\n");
+      }
+      else
+      {
+        Reserve(token[1], token[2]);
+      }
+      continue;
+    }
+
+    else if (strcmp("resize", token[0]) == 0)
+    {
+      if (token_count != 2)
+      {
+        printf("Usage: resize size (e.g. 64M or 4G)\n");
+      }
+      else
+      {
+        Resize(token[1]);
+      }
+      continue;
+    }
+
+    else if (strcmp("log", token[0]) == 0)
+    {
+      if (token_count > 2)
+      {
+        printf("Usage: log [on|off]\n");
+      }
+      else
+      {
+        LogMode(token_count == 2 ? token[1] : NULL);
+      }
+      continue;
+    }
+
+    else if (strcmp("clean", token[0]) == 0)
+    {
+      if (token_count > 2)
+      {
+        printf("Usage: clean [percent]\n");
+      }
+      else
+      {
+        CleanSegments(token_count == 2 ? token[1] : NULL);
+      }
+      continue;
+    }
+
+    else if (strcmp("flush", token[0]) == 0)
+    {
+      if (token_count > 3)
+      {
+        printf("Usage: flush [off | seconds [MB]]\n");
+      }
+      else
+      {
+        Flush(token + 1, token_count - 1);
+      }
+      continue;
+    }
+
+    else if (strcmp("diff", token[0]) == 0 || strcmp("patch", token[0]) == 0)
+    {
+      if (token_count != 3)
+      {
+        printf("Usage: %s\n", token[0][0] == 'd' ? "diff base_image patch_file" : "patch patch_file image_file");
+      }
+      else if (token[0][0] == 'd')
+      {
+        Diff(token[1], token[2]);
+      }
+      else
+      {
+        Patch(token[1], token[2]);
+      }
+      continue;
+    }
+
+    else if (strcmp("readahead", token[0]) == 0)
+    {
+      char *end = "";
+      long n = token_count == 2 ? strtol(token[1], &end, 10) : -1;
+      if (token_count > 2 || *end || ( token_count == 2 && ( n < 0 || n > PIPE_MAX_DEPTH ) ))
+      {
+        printf("Usage: readahead [chunks] (0 to %d)\n", PIPE_MAX_DEPTH);
+      }
+      else
+      {
+        if (n >= 0) { pipeDepth = n; }
+        printf("Readahead: %d chunks of %d KB.\n", pipeDepth, PIPE_CHUNK / 1024);
+      }
+      continue;
+    }
+
+    else if (strcmp("bench", token[0]) == 0)
+    {
+      ReadEnd();
+      Bench(token_count >= 2 ? atoi(token[1]) : 4, token_count >= 3 ? atof(token[2]) : 1);
+      continue;
+    }
+    
+    else if (strcmp("exit", token[0]) == 0 || strcmp("quit", token[0]) == 0)
+    {
+      break;
+    }
+
+    else
+    {
+      printf("error: Unknown command.\n");
+      continue;
+    }
+    
+  }
+  // without close the image file stays as the last checkpoint left it
+  CommandEnd();
+  FlushStop();
+  
+  // mem recycle
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; ++i)
+  {
+    free(token[i]);
+  }
+  free(cmd_str);
+  if (input != stdin) { fclose(input); }
+  TraceClose();
+
+
+  return 0;
+}